@@ -0,0 +1,653 @@
+#include "arrow_writer.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Writes the Arrow IPC file format (columnar format 1.0, metadata V5) with
+// no external library: a minimal FlatBuffers builder produces the Schema,
+// RecordBatch and Footer metadata, and each batch body is the raw column
+// buffers. Ids and numeric columns are fixed-width, so readers can mmap them.
+// Buffers are written in host byte order, which must be little-endian.
+
+void arrow_row_int(CsvRow* row, long value) {
+    int64_t v = value;
+    csv_row_reserve(row, 9);
+    row->data[row->len++] = ARROW_INT;
+    memcpy(row->data + row->len, &v, 8);
+    row->len += 8;
+}
+
+void arrow_row_text(CsvRow* row, char tag, const char* s, size_t len) {
+    uint32_t n = len;
+    csv_row_reserve(row, 5 + len);
+    row->data[row->len++] = tag;
+    memcpy(row->data + row->len, &n, 4);
+    memcpy(row->data + row->len + 4, s, len);
+    row->len += 4 + len;
+}
+
+// FlatBuffers are built back to front: the buffer grows downwards from the
+// end of buf, and objects are referred to by their distance from that end
+typedef struct {
+    unsigned char* buf;
+    size_t cap;
+    size_t size;
+    size_t minalign;
+    size_t table_start;
+    int num_fields;
+    int field_ids[8];
+    size_t field_refs[8];
+} FlatBuilder;
+
+static void fb_reserve(FlatBuilder* b, size_t len) {
+    if (b->size + len <= b->cap) return;
+    size_t cap = b->cap ? b->cap * 2 : 1024;
+    while (cap < b->size + len) cap *= 2;
+    unsigned char* buf = malloc(cap);
+    if (!buf) {
+        fprintf(stderr, "Error: Memory allocation failed for Arrow metadata\n");
+        exit(1);
+    }
+    if (b->size) memcpy(buf + cap - b->size, b->buf + b->cap - b->size, b->size);
+    free(b->buf);
+    b->buf = buf;
+    b->cap = cap;
+}
+
+static void fb_push(FlatBuilder* b, const void* data, size_t len) {
+    if (len == 0) return;
+    fb_reserve(b, len);
+    b->size += len;
+    memcpy(b->buf + b->cap - b->size, data, len);
+}
+
+// Pads so that the next len bytes end on an align boundary
+static void fb_prealign(FlatBuilder* b, size_t len, size_t align) {
+    static const unsigned char zeros[8] = { 0 };
+    if (align > b->minalign) b->minalign = align;
+    fb_push(b, zeros, (align - (b->size + len) % align) % align);
+}
+
+static void fb_scalar(FlatBuilder* b, const void* value, size_t len) {
+    fb_prealign(b, len, len);
+    fb_push(b, value, len);
+}
+
+// Pushes a uoffset pointing at an object built earlier
+static void fb_offset(FlatBuilder* b, size_t ref) {
+    fb_prealign(b, 4, 4);
+    uint32_t value = b->size + 4 - ref;
+    fb_push(b, &value, 4);
+}
+
+static size_t fb_string(FlatBuilder* b, const char* s, size_t len) {
+    fb_prealign(b, len + 1, 4);
+    fb_push(b, "", 1);
+    fb_push(b, s, len);
+    uint32_t n = len;
+    fb_push(b, &n, 4);
+    return b->size;
+}
+
+// Vector elements are pushed last to first between these two calls
+static void fb_start_vector(FlatBuilder* b, size_t count, size_t elem_size, size_t align) {
+    fb_prealign(b, count * elem_size, 4);
+    fb_prealign(b, count * elem_size, align);
+}
+
+static size_t fb_end_vector(FlatBuilder* b, size_t count) {
+    uint32_t n = count;
+    fb_push(b, &n, 4);
+    return b->size;
+}
+
+// Table fields are pushed between these calls; anything they point to must
+// already be built
+static void fb_start_table(FlatBuilder* b) {
+    b->table_start = b->size;
+    b->num_fields = 0;
+}
+
+static void fb_track(FlatBuilder* b, int id) {
+    b->field_ids[b->num_fields] = id;
+    b->field_refs[b->num_fields] = b->size;
+    b->num_fields++;
+}
+
+static void fb_field_scalar(FlatBuilder* b, int id, const void* value, size_t len) {
+    fb_scalar(b, value, len);
+    fb_track(b, id);
+}
+
+static void fb_field_offset(FlatBuilder* b, int id, size_t ref) {
+    fb_offset(b, ref);
+    fb_track(b, id);
+}
+
+static size_t fb_end_table(FlatBuilder* b) {
+    int32_t placeholder = 0;
+    fb_scalar(b, &placeholder, 4);
+    size_t table = b->size;
+
+    uint16_t vtable[10] = { 0 };
+    int slots = 0;
+    for (int i = 0; i < b->num_fields; i++) {
+        if (b->field_ids[i] + 1 > slots) slots = b->field_ids[i] + 1;
+        vtable[2 + b->field_ids[i]] = table - b->field_refs[i];
+    }
+    vtable[0] = (2 + slots) * 2;
+    vtable[1] = table - b->table_start;
+    fb_push(b, vtable, vtable[0]);
+
+    int32_t vtable_offset = b->size - table;
+    memcpy(b->buf + b->cap - table, &vtable_offset, 4);
+    return table;
+}
+
+// Adds the root offset; the finished buffer is the last size bytes of buf
+static void fb_finish(FlatBuilder* b, size_t root) {
+    fb_prealign(b, 4, b->minalign);
+    fb_offset(b, root);
+}
+
+static void fb_reset(FlatBuilder* b) {
+    b->size = 0;
+    b->minalign = 8;
+}
+
+// Arrow metadata enums and union tags
+#define METADATA_V5 4
+#define HEADER_SCHEMA 1
+#define HEADER_RECORD_BATCH 3
+#define TYPE_INT 2
+#define TYPE_FLOATING_POINT 3
+#define TYPE_UTF8 5
+#define TYPE_BOOL 6
+#define PRECISION_DOUBLE 2
+
+// What a column's values turned out to be, widened as rows are read
+#define KIND_INT 1
+#define KIND_FLOAT 2
+#define KIND_BOOL 4
+#define KIND_TEXT 8
+
+typedef enum {
+    COLUMN_INT64,
+    COLUMN_FLOAT64,
+    COLUMN_BOOL,
+    COLUMN_UTF8
+} ColumnType;
+
+// CsvRow doubles as a growable byte buffer for the column buffers
+typedef struct {
+    const char* name;
+    size_t name_len;
+    int kinds;
+    ColumnType type;
+    CsvRow validity;
+    CsvRow offsets;
+    CsvRow values;
+    long nulls;
+} Column;
+
+typedef struct {
+    int64_t offset;
+    int32_t metadata_length;
+    int32_t padding;
+    int64_t body_length;
+} Block;
+
+typedef struct {
+    FILE* out;
+    const char* path;
+    int failed;         // a write failed; nothing more is written
+    unsigned long long pos;
+    FlatBuilder fb;
+    Block* blocks;
+    int num_blocks;
+    int max_blocks;
+} ArrowFile;
+
+// One field of a spill record
+typedef struct {
+    char tag;
+    int64_t number;
+    const char* text;
+    uint32_t len;
+} Field;
+
+// Reads the field at *p and advances past it; returns its tag, or -1 if
+// the spill is cut short
+static int read_field(const unsigned char** p, const unsigned char* end, Field* field) {
+    if (*p >= end) return -1;
+    field->tag = *(*p)++;
+    if (field->tag == ARROW_INT) {
+        if (*p + 8 > end) return -1;
+        memcpy(&field->number, *p, 8);
+        *p += 8;
+    } else if (field->tag == ARROW_STRING || field->tag == ARROW_NUMBER) {
+        if (*p + 4 > end) return -1;
+        memcpy(&field->len, *p, 4);
+        field->text = (const char*)*p + 4;
+        if (field->len > (size_t)(end - *p) - 4) return -1;
+        *p += 4 + field->len;
+    }
+    return field->tag;
+}
+
+// Integers up to 18 digits always fit in 64 bits; longer ones become doubles
+static int integer_text(const char* s, size_t len) {
+    size_t i = s[0] == '-' ? 1 : 0;
+    if (len - i == 0 || len - i > 18) return 0;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return 0;
+    }
+    return 1;
+}
+
+static int64_t parse_integer(const char* s, size_t len) {
+    int negative = s[0] == '-';
+    int64_t value = 0;
+    for (size_t i = negative; i < len; i++) value = value * 10 + (s[i] - '0');
+    return negative ? -value : value;
+}
+
+static double parse_double(const char* s, size_t len) {
+    char small[64];
+    char* text = len < sizeof(small) ? small : malloc(len + 1);
+    if (!text) {
+        fprintf(stderr, "Error: Memory allocation failed for number\n");
+        exit(1);
+    }
+    memcpy(text, s, len);
+    text[len] = '\0';
+    double value = strtod(text, NULL);
+    if (text != small) free(text);
+    return value;
+}
+
+static int field_kind(Field* field) {
+    switch (field->tag) {
+        case ARROW_INT: return KIND_INT;
+        case ARROW_NUMBER: return integer_text(field->text, field->len) ? KIND_INT : KIND_FLOAT;
+        case ARROW_TRUE:
+        case ARROW_FALSE: return KIND_BOOL;
+        case ARROW_NULL: return 0;
+        default: return KIND_TEXT;
+    }
+}
+
+// Picks the narrowest type that holds every value; all-null columns and
+// columns mixing booleans with numbers or strings are stored as text
+static ColumnType resolve_type(int kinds) {
+    if (kinds & KIND_TEXT) return COLUMN_UTF8;
+    if (kinds & KIND_BOOL) return kinds == KIND_BOOL ? COLUMN_BOOL : COLUMN_UTF8;
+    if (kinds & KIND_FLOAT) return COLUMN_FLOAT64;
+    if (kinds & KIND_INT) return COLUMN_INT64;
+    return COLUMN_UTF8;
+}
+
+// Appends bit index of a bitmap, adding a zeroed byte every eight bits
+static void append_bit(CsvRow* bits, long index, int value) {
+    if (index % 8 == 0) csv_row_char(bits, 0);
+    if (value) bits->data[index / 8] |= 1 << (index % 8);
+}
+
+static void append_value(Column* column, Field* field, long row) {
+    int is_null = field->tag == ARROW_NULL;
+    append_bit(&column->validity, row, !is_null);
+    if (is_null) column->nulls++;
+
+    switch (column->type) {
+        case COLUMN_INT64: {
+            int64_t value = 0;
+            if (field->tag == ARROW_INT) value = field->number;
+            else if (!is_null) value = parse_integer(field->text, field->len);
+            csv_row_raw(&column->values, (const char*)&value, 8);
+            break;
+        }
+        case COLUMN_FLOAT64: {
+            double value = 0;
+            if (field->tag == ARROW_INT) value = field->number;
+            else if (!is_null) value = parse_double(field->text, field->len);
+            csv_row_raw(&column->values, (const char*)&value, 8);
+            break;
+        }
+        case COLUMN_BOOL:
+            append_bit(&column->values, row, field->tag == ARROW_TRUE);
+            break;
+        case COLUMN_UTF8: {
+            if (field->tag == ARROW_STRING || field->tag == ARROW_NUMBER) {
+                csv_row_raw(&column->values, field->text, field->len);
+            } else if (field->tag == ARROW_INT) {
+                csv_row_int(&column->values, field->number);
+            } else if (field->tag == ARROW_TRUE) {
+                csv_row_raw(&column->values, "true", 4);
+            } else if (field->tag == ARROW_FALSE) {
+                csv_row_raw(&column->values, "false", 5);
+            }
+            int32_t end = column->values.len;
+            csv_row_raw(&column->offsets, (const char*)&end, 4);
+            break;
+        }
+    }
+}
+
+static void write_bytes(ArrowFile* file, const void* data, size_t len) {
+    if (file->failed) return;
+    if (len && fwrite(data, 1, len, file->out) != len) file->failed = 1;
+    file->pos += len;
+}
+
+static void write_padding(ArrowFile* file) {
+    static const char zeros[8] = { 0 };
+    write_bytes(file, zeros, (8 - file->pos % 8) % 8);
+}
+
+// Builds a Schema table describing the columns
+static size_t build_schema(FlatBuilder* b, Column* columns, int num_columns) {
+    size_t* fields = malloc(num_columns * sizeof(size_t));
+    if (!fields) {
+        fprintf(stderr, "Error: Memory allocation failed for Arrow schema\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_columns; i++) {
+        size_t name = fb_string(b, columns[i].name, columns[i].name_len);
+        uint8_t type_tag;
+        fb_start_table(b);
+        if (columns[i].type == COLUMN_INT64) {
+            int32_t bit_width = 64;
+            uint8_t is_signed = 1;
+            fb_field_scalar(b, 0, &bit_width, 4);
+            fb_field_scalar(b, 1, &is_signed, 1);
+            type_tag = TYPE_INT;
+        } else if (columns[i].type == COLUMN_FLOAT64) {
+            int16_t precision = PRECISION_DOUBLE;
+            fb_field_scalar(b, 0, &precision, 2);
+            type_tag = TYPE_FLOATING_POINT;
+        } else {
+            type_tag = columns[i].type == COLUMN_BOOL ? TYPE_BOOL : TYPE_UTF8;
+        }
+        size_t type = fb_end_table(b);
+        fb_start_vector(b, 0, 4, 4);
+        size_t children = fb_end_vector(b, 0);
+
+        uint8_t nullable = 1;
+        fb_start_table(b);
+        fb_field_offset(b, 0, name);
+        fb_field_scalar(b, 1, &nullable, 1);
+        fb_field_scalar(b, 2, &type_tag, 1);
+        fb_field_offset(b, 3, type);
+        fb_field_offset(b, 5, children);
+        fields[i] = fb_end_table(b);
+    }
+    fb_start_vector(b, num_columns, 4, 4);
+    for (int i = num_columns - 1; i >= 0; i--) fb_offset(b, fields[i]);
+    size_t field_vector = fb_end_vector(b, num_columns);
+    free(fields);
+
+    int16_t little_endian = 0;
+    fb_start_table(b);
+    fb_field_scalar(b, 0, &little_endian, 2);
+    fb_field_offset(b, 1, field_vector);
+    return fb_end_table(b);
+}
+
+// Wraps a header in a Message and writes it with its continuation marker
+// and length prefix; the caller writes body_length bytes of body after it
+static void write_message(ArrowFile* file, uint8_t header_type, size_t header, int64_t body_length) {
+    FlatBuilder* b = &file->fb;
+    int16_t version = METADATA_V5;
+    fb_start_table(b);
+    fb_field_scalar(b, 3, &body_length, 8);
+    fb_field_offset(b, 2, header);
+    fb_field_scalar(b, 0, &version, 2);
+    fb_field_scalar(b, 1, &header_type, 1);
+    fb_finish(b, fb_end_table(b));
+
+    int32_t prefix[2] = { -1, (int32_t)((b->size + 7) / 8 * 8) };
+    if (header_type == HEADER_RECORD_BATCH) {
+        if (file->num_blocks == file->max_blocks) {
+            file->max_blocks = file->max_blocks ? file->max_blocks * 2 : 16;
+            file->blocks = realloc(file->blocks, file->max_blocks * sizeof(Block));
+            if (!file->blocks) {
+                fprintf(stderr, "Error: Memory allocation failed for Arrow blocks\n");
+                exit(1);
+            }
+        }
+        Block* block = &file->blocks[file->num_blocks++];
+        block->offset = file->pos;
+        block->metadata_length = 8 + prefix[1];
+        block->padding = 0;
+        block->body_length = body_length;
+    }
+    write_bytes(file, prefix, 8);
+    write_bytes(file, b->buf + b->cap - b->size, b->size);
+    write_padding(file);
+}
+
+static void write_batch(ArrowFile* file, Column* columns, int num_columns, long rows) {
+    FlatBuilder* b = &file->fb;
+    fb_reset(b);
+
+    // Each column has a validity buffer, then offsets (strings only), then
+    // values; buffers are laid out back to back, each padded to 8 bytes
+    int num_buffers = 0;
+    int64_t (*buffers)[2] = malloc(num_columns * 3 * sizeof(*buffers));
+    CsvRow** parts = malloc(num_columns * 3 * sizeof(CsvRow*));
+    if (!buffers || !parts) {
+        fprintf(stderr, "Error: Memory allocation failed for Arrow batch\n");
+        exit(1);
+    }
+    int64_t body_length = 0;
+    for (int i = 0; i < num_columns; i++) {
+        Column* column = &columns[i];
+        CsvRow* own[3] = { &column->validity, NULL, &column->values };
+        if (column->type == COLUMN_UTF8) own[1] = &column->offsets;
+        for (int k = 0; k < 3; k++) {
+            if (k == 1 && !own[1]) continue;
+            size_t len = own[k]->len;
+            if (k == 0 && column->nulls == 0) len = 0;   // no bitmap needed
+            buffers[num_buffers][0] = body_length;
+            buffers[num_buffers][1] = len;
+            parts[num_buffers++] = len ? own[k] : NULL;
+            body_length += (len + 7) / 8 * 8;
+        }
+    }
+
+    fb_start_vector(b, num_columns, 16, 8);
+    for (int i = num_columns - 1; i >= 0; i--) {
+        int64_t node[2] = { rows, columns[i].nulls };
+        fb_push(b, node, 16);
+    }
+    size_t nodes = fb_end_vector(b, num_columns);
+    fb_start_vector(b, num_buffers, 16, 8);
+    for (int i = num_buffers - 1; i >= 0; i--) fb_push(b, buffers[i], 16);
+    size_t buffer_vector = fb_end_vector(b, num_buffers);
+
+    int64_t length = rows;
+    fb_start_table(b);
+    fb_field_scalar(b, 0, &length, 8);
+    fb_field_offset(b, 1, nodes);
+    fb_field_offset(b, 2, buffer_vector);
+    write_message(file, HEADER_RECORD_BATCH, fb_end_table(b), body_length);
+
+    for (int i = 0; i < num_buffers; i++) {
+        if (!parts[i]) continue;
+        write_bytes(file, parts[i]->data, buffers[i][1]);
+        write_padding(file);
+    }
+    free(buffers);
+    free(parts);
+}
+
+// Empties the column buffers for the next batch
+static void reset_columns(Column* columns, int num_columns) {
+    for (int i = 0; i < num_columns; i++) {
+        columns[i].validity.len = 0;
+        columns[i].values.len = 0;
+        columns[i].offsets.len = 0;
+        columns[i].nulls = 0;
+        if (columns[i].type == COLUMN_UTF8) {
+            int32_t start = 0;
+            csv_row_raw(&columns[i].offsets, (const char*)&start, 4);
+        }
+    }
+}
+
+static void write_footer(ArrowFile* file, Column* columns, int num_columns) {
+    FlatBuilder* b = &file->fb;
+    fb_reset(b);
+    size_t schema = build_schema(b, columns, num_columns);
+    fb_start_vector(b, 0, sizeof(Block), 8);
+    size_t dictionaries = fb_end_vector(b, 0);
+    fb_start_vector(b, file->num_blocks, sizeof(Block), 8);
+    for (int i = file->num_blocks - 1; i >= 0; i--) fb_push(b, &file->blocks[i], sizeof(Block));
+    size_t batches = fb_end_vector(b, file->num_blocks);
+
+    int16_t version = METADATA_V5;
+    fb_start_table(b);
+    fb_field_offset(b, 1, schema);
+    fb_field_offset(b, 2, dictionaries);
+    fb_field_offset(b, 3, batches);
+    fb_field_scalar(b, 0, &version, 2);
+    fb_finish(b, fb_end_table(b));
+
+    int32_t footer_length = b->size;
+    write_bytes(file, b->buf + b->cap - b->size, b->size);
+    write_bytes(file, &footer_length, 4);
+    write_bytes(file, "ARROW1", 6);
+}
+
+int arrow_finish(const char* spill_path, const char* arrow_path, char* error, size_t error_size) {
+    int phase = stats_enter(PHASE_FLUSH);
+    int fd = open(spill_path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(error, error_size, "Cannot open file %s", spill_path);
+        stats_leave(phase);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        snprintf(error, error_size, "Cannot read file %s", spill_path);
+        close(fd);
+        stats_leave(phase);
+        return -1;
+    }
+    const unsigned char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        snprintf(error, error_size, "Cannot map file %s", spill_path);
+        stats_leave(phase);
+        return -1;
+    }
+    const unsigned char* end = data + st.st_size;
+    Column* columns = NULL;
+    int num_columns = 0;
+    ArrowFile file = { NULL, arrow_path, 0, 0, { 0 }, NULL, 0, 0 };
+    int status = -1;
+    int tag;
+
+    // The header record names the columns
+    const unsigned char* p = data;
+    const unsigned char* body;
+    Field field;
+    for (body = p; (tag = read_field(&body, end, &field)) != ARROW_END; num_columns++) {
+        if (tag < 0) goto corrupt;
+    }
+    columns = calloc(num_columns ? num_columns : 1, sizeof(Column));
+    if (!columns) {
+        fprintf(stderr, "Error: Memory allocation failed for Arrow columns\n");
+        exit(1);
+    }
+    for (int i = 0; read_field(&p, end, &field) != ARROW_END; i++) {
+        columns[i].name = field.text;
+        columns[i].name_len = field.len;
+    }
+
+    // First pass: find each column's type. Rows are positional like the CSV
+    // rows; missing trailing fields are null and extra fields are dropped.
+    long long_rows = 0;
+    while (p < end) {
+        int k = 0;
+        while ((tag = read_field(&p, end, &field)) != ARROW_END) {
+            if (tag < 0) goto corrupt;
+            if (k < num_columns) columns[k].kinds |= field_kind(&field);
+            k++;
+        }
+        if (k > num_columns) long_rows++;
+    }
+    for (int i = 0; i < num_columns; i++) columns[i].type = resolve_type(columns[i].kinds);
+    if (long_rows) {
+        fprintf(stderr, "Warning: %ld rows of %s have more fields than its header; extra fields dropped\n",
+                long_rows, arrow_path);
+    }
+
+    file.out = fopen(arrow_path, "wb");
+    if (!file.out) {
+        snprintf(error, error_size, "Cannot open file %s", arrow_path);
+        goto done;
+    }
+    write_bytes(&file, "ARROW1\0\0", 8);
+    fb_reset(&file.fb);
+    write_message(&file, HEADER_SCHEMA, build_schema(&file.fb, columns, num_columns), 0);
+
+    // Second pass: fill the column buffers and write a batch whenever one
+    // is full. The first pass checked every record, so reads cannot fail.
+    Field null_field = { ARROW_NULL, 0, NULL, 0 };
+    long batch_rows = 0;
+    size_t batch_bytes = 0;
+    reset_columns(columns, num_columns);
+    for (p = body; p < end && !file.failed; ) {
+        const unsigned char* start = p;
+        int k = 0;
+        while (read_field(&p, end, &field) != ARROW_END) {
+            if (k < num_columns) append_value(&columns[k], &field, batch_rows);
+            k++;
+        }
+        for (; k < num_columns; k++) append_value(&columns[k], &null_field, batch_rows);
+        batch_rows++;
+        batch_bytes += p - start;
+        if (batch_rows == ARROW_BATCH_ROWS || batch_bytes >= ARROW_BATCH_BYTES) {
+            write_batch(&file, columns, num_columns, batch_rows);
+            reset_columns(columns, num_columns);
+            batch_rows = 0;
+            batch_bytes = 0;
+        }
+    }
+    if (batch_rows > 0) write_batch(&file, columns, num_columns, batch_rows);
+
+    int32_t end_of_stream[2] = { -1, 0 };
+    write_bytes(&file, end_of_stream, 8);
+    write_footer(&file, columns, num_columns);
+    if (fclose(file.out) != 0 || file.failed) {
+        snprintf(error, error_size, "Cannot write file %s", arrow_path);
+        goto done;
+    }
+    unlink(spill_path);
+    status = 0;
+    goto done;
+
+corrupt:
+    snprintf(error, error_size, "Corrupt spill file %s", spill_path);
+done:
+    if (columns) {
+        for (int i = 0; i < num_columns; i++) {
+            csv_row_free(&columns[i].validity);
+            csv_row_free(&columns[i].offsets);
+            csv_row_free(&columns[i].values);
+        }
+        free(columns);
+    }
+    free(file.blocks);
+    free(file.fb.buf);
+    munmap((void*)data, st.st_size);
+    stats_leave(phase);
+    return status;
+}
@@ -0,0 +1,35 @@
+#ifndef ARROW_WRITER_H
+#define ARROW_WRITER_H
+
+#include "csv_writer.h"
+
+// Rows per record batch, and a cap on a batch's string bytes so one batch
+// never needs more than this much memory
+#define ARROW_BATCH_ROWS 65536
+#define ARROW_BATCH_BYTES (64 * 1024 * 1024)
+
+// With --format arrow, rows go through the same shared writers as CSV but
+// are encoded as tagged binary records in a spill file. Each field is one tag
+// byte, followed by an 8-byte integer for ARROW_INT or a 4-byte length and
+// the bytes for ARROW_STRING and ARROW_NUMBER. A record ends with ARROW_END.
+// The first record of a spill holds the column names.
+#define ARROW_INT 'i'       // ids, parent ids, seq and index columns
+#define ARROW_STRING 's'
+#define ARROW_NUMBER 'n'    // JSON number text, typed when the file is built
+#define ARROW_TRUE 't'
+#define ARROW_FALSE 'f'
+#define ARROW_NULL '0'
+#define ARROW_END '\n'
+
+void arrow_row_int(CsvRow* row, long value);
+void arrow_row_text(CsvRow* row, char tag, const char* s, size_t len);
+
+static inline void arrow_row_tag(CsvRow* row, char tag) {
+    csv_row_char(row, tag);
+}
+
+// Builds the Arrow IPC file for a closed spill file and removes the spill.
+// Returns 0 on success, or -1 with the reason in error.
+int arrow_finish(const char* spill_path, const char* arrow_path, char* error, size_t error_size);
+
+#endif
@@ -1,300 +1,326 @@
 #include "ast.h"
+#include "stats.h"
+#include "intern.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-ASTNode* make_object(ASTNode* members) {
-    ASTNode* node = malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for object\n");
-        exit(1);
-    }
-    node->type = OBJ;
-    int count = 0;
-    ASTNode* temp = members;
-    while (temp) {
-        count++;
-        temp = temp->data.object.values[1]; // Next in list
-    }
-    node->data.object.keys = malloc(count * sizeof(char*));
-    node->data.object.values = malloc(count * sizeof(ASTNode*));
-    if (!node->data.object.keys || !node->data.object.values) {
-        fprintf(stderr, "Error: Memory allocation failed for object arrays\n");
-        exit(1);
-    }
-    node->data.object.count = count;
-    temp = members;
-    for (int i = count - 1; i >= 0; i--) {
-        if (!temp->data.object.keys[0] || !temp->data.object.values[0]) {
-            fprintf(stderr, "Error: Invalid pair in object list\n");
+// Whole cells taken by bytes of inline text
+static uint32_t cells_for(size_t bytes) {
+    return (bytes + sizeof(ASTNode) - 1) / sizeof(ASTNode);
+}
+
+// Containers with children and inline text hold a position, which is
+// relative once the node is placed
+static int has_position(const ASTNode* node) {
+    return node->inline_text || ((node->type == OBJ || node->type == ARR) && node->count > 0);
+}
+
+// Sets *at to the index of n new cells at the end of the arena, grown
+// geometrically. Positions are 32-bit, which bounds a tree at 2^31 cells:
+// past that it returns 0 and sets too_large, the value is left empty, and
+// the parser reports the input and stops.
+static int reserve_cells(AstBuilder* b, size_t n, uint32_t* at) {
+    if (b->count == 0) b->count = 1;    // cell 0 is the root's
+    if (b->count + n > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 1024;
+        while (b->count + n > capacity) capacity *= 2;
+        if (capacity > INT32_MAX) capacity = INT32_MAX;
+        if (b->count + n > capacity) {
+            b->too_large = 1;
+            return 0;
+        }
+        b->cells = realloc(b->cells, capacity * sizeof(ASTNode));
+        stats_count_alloc((capacity - b->capacity) * sizeof(ASTNode));
+        if (!b->cells) {
+            fprintf(stderr, "Error: Memory allocation failed for node arena\n");
             exit(1);
         }
-        node->data.object.keys[i] = temp->data.object.keys[0];
-        node->data.object.values[i] = temp->data.object.values[0];
-        ASTNode* next = temp->data.object.values[1];
-        free(temp->data.object.keys);
-        free(temp->data.object.values);
-        free(temp);
-        temp = next;
+        b->capacity = capacity;
     }
-    return node;
+    *at = b->count;
+    b->count += n;
+    return 1;
 }
 
-ASTNode* make_array(ASTNode* elements) {
-    ASTNode* node = malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for array\n");
-        exit(1);
-    }
-    node->type = ARR;
-    int count = 0;
-    ASTNode* temp = elements;
-    while (temp) {
-        count++;
-        temp = temp->data.array.elements[1]; // Next in list
-    }
-    node->data.array.elements = malloc(count * sizeof(ASTNode*));
-    if (!node->data.array.elements) {
-        fprintf(stderr, "Error: Memory allocation failed for array elements\n");
-        exit(1);
-    }
-    node->data.array.count = count;
-    temp = elements;
-    for (int i = count - 1; i >= 0; i--) {
-        if (!temp || !temp->data.array.elements || !temp->data.array.elements[0]) {
-            fprintf(stderr, "Error: Invalid element in array list at index %d\n", i);
+static PendingValue* push_pending(AstBuilder* b, NodeType type) {
+    if (b->num_pending == b->max_pending) {
+        uint32_t grown = b->max_pending ? b->max_pending : 64;
+        b->max_pending += grown;
+        b->pending = realloc(b->pending, b->max_pending * sizeof(PendingValue));
+        stats_count_alloc(grown * sizeof(PendingValue));
+        if (!b->pending) {
+            fprintf(stderr, "Error: Memory allocation failed for pending values\n");
             exit(1);
         }
-        fprintf(stderr, "make_array: copying element[%d]=%p\n", i, temp->data.array.elements[0]);
-        if (temp->data.array.elements[0]->type == STR) {
-            fprintf(stderr, "  type=STR, string='%s'\n", temp->data.array.elements[0]->data.string);
-        }
-        node->data.array.elements[i] = temp->data.array.elements[0];
-        ASTNode* next = temp->data.array.elements[1];
-        free(temp->data.array.elements);
-        free(temp);
-        temp = next;
     }
-    return node;
+    PendingValue* value = &b->pending[b->num_pending++];
+    memset(value, 0, sizeof(PendingValue));
+    value->node.type = type;
+    stats_count_node(type);
+    return value;
 }
 
-ASTNode* make_string(char* string) {
-    if (!string) {
-        fprintf(stderr, "Error: Null string in make_string\n");
+// Scalar nodes borrow the token's span, or its pooled copy when it is one
+// the lexer copied, so repeated values share storage. Text neither can
+// hold is copied into the arena and the token freed. The parser keeps
+// lengths within 32 bits.
+static void push_text(AstBuilder* b, NodeType type, Span text) {
+    if (!text.ptr) {
+        fprintf(stderr, "Error: Null text in push_text\n");
         exit(1);
     }
-    ASTNode* node = malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for string\n");
-        exit(1);
+    if (text.owned) {
+        const char* pooled = intern_value(text.ptr, text.len);
+        if (pooled) {
+            free((char*)text.ptr);
+            text = (Span){ pooled, text.len, 0 };
+        }
     }
-    node->type = STR;
-    node->data.string = strdup(string);
-    if (!node->data.string) {
-        fprintf(stderr, "Error: Memory allocation failed for string copy\n");
-        exit(1);
+    uint32_t at = 0;
+    if (text.owned) {
+        if (reserve_cells(b, cells_for(text.len), &at)) {
+            memcpy(b->cells + at, text.ptr, text.len);
+        } else {
+            text.len = 0;
+        }
+        free((char*)text.ptr);
     }
-    fprintf(stderr, "make_string: created node=%p, string='%s'\n", node, node->data.string);
-    return node;
+    PendingValue* value = push_pending(b, type);
+    value->node.count = text.len;
+    if (text.owned) {
+        value->node.inline_text = 1;
+        value->node.data.first = at;
+    } else {
+        value->node.data.text = text.ptr;
+    }
+    TRACE("push_text: type=%d, text='%.*s'\n", type, (int)text.len, text.owned ? (char*)(b->cells + at) : text.ptr);
 }
 
-ASTNode* make_number(char* number) {
-    if (!number) {
-        fprintf(stderr, "Error: Null number in make_number\n");
-        exit(1);
-    }
-    ASTNode* node = malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for number\n");
-        exit(1);
-    }
-    node->type = NUM;
-    node->data.string = strdup(number);
-    if (!node->data.string) {
-        fprintf(stderr, "Error: Memory allocation failed for number copy\n");
-        exit(1);
-    }
-    return node;
+void push_string(AstBuilder* b, Span string) {
+    push_text(b, STR, string);
 }
 
-ASTNode* make_true() {
-    ASTNode* node = malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for true\n");
-        exit(1);
-    }
-    node->type = TRU;
-    return node;
+void push_number(AstBuilder* b, Span number) {
+    push_text(b, NUM, number);
 }
 
-ASTNode* make_false() {
-    ASTNode* node = malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for false\n");
-        exit(1);
-    }
-    node->type = FALS;
-    return node;
+// true, false and null
+void push_literal(AstBuilder* b, NodeType type) {
+    push_pending(b, type);
 }
 
-ASTNode* make_null() {
-    ASTNode* node = malloc(sizeof(ASTNode));
-    if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for null\n");
-        exit(1);
+// Replaces the values pushed since start with a container holding them:
+// they are copied into the arena, followed for an object by their keys
+static void close_container(AstBuilder* b, NodeType type, uint32_t start) {
+    uint32_t n = b->num_pending - start;
+    uint32_t at = 0;
+    if (n > 0 && !reserve_cells(b, n + (type == OBJ ? ast_key_cells(n) : 0), &at)) n = 0;
+    if (n > 0) {
+        ASTNode* children = b->cells + at;
+        char** keys = (char**)(children + n);
+        for (uint32_t i = 0; i < n; i++) {
+            PendingValue* value = &b->pending[start + i];
+            children[i] = value->node;
+            if (has_position(&value->node)) children[i].data.first = value->node.data.first - (int32_t)(at + i);
+            if (type == OBJ) keys[i] = value->key;
+        }
     }
-    node->type = NUL;
-    return node;
+    b->num_pending = start;
+    PendingValue* container = push_pending(b, type);
+    container->node.count = n;
+    container->node.data.first = at;
+    TRACE("close_container: type=%d, count=%u\n", type, n);
 }
 
-ASTNode* make_pair(char* key, ASTNode* value) {
-    if (!key || !value) {
-        fprintf(stderr, "Error: Null key or value in make_pair\n");
-        exit(1);
+void close_object(AstBuilder* b, uint32_t start) {
+    close_container(b, OBJ, start);
+}
+
+void close_array(AstBuilder* b, uint32_t start) {
+    close_container(b, ARR, start);
+}
+
+// The value reduced last, not yet placed
+ASTNode* last_value(AstBuilder* b) {
+    return &b->pending[b->num_pending - 1].node;
+}
+
+// key must be interned (see span_string)
+void set_key(AstBuilder* b, char* key) {
+    b->pending[b->num_pending - 1].key = key;
+}
+
+// Forgets the value reduced last; any cells it took stay unused until the
+// tree is freed
+void drop_value(AstBuilder* b) {
+    b->num_pending--;
+}
+
+// Where the cells of the next value will start
+uint32_t arena_mark(AstBuilder* b) {
+    return b->count ? b->count : 1;
+}
+
+// Pops the last value, whose cells all lie from mark on, as a tree of its
+// own, and gives those cells back to the builder. A value that fills most
+// of the arena takes the arena itself rather than a copy.
+ASTNode* take_tree(AstBuilder* b, uint32_t mark) {
+    ASTNode root = b->pending[--b->num_pending].node;
+    ASTNode* tree;
+    if (mark <= 1 && b->cells && (size_t)b->count * 2 >= b->capacity) {
+        tree = realloc(b->cells, b->count * sizeof(ASTNode));   // trims the slack
+        if (!tree) tree = b->cells;
+        b->cells = NULL;
+        b->count = 0;
+        b->capacity = 0;
+    } else {
+        size_t n = b->cells ? b->count - mark : 0;
+        tree = malloc((n + 1) * sizeof(ASTNode));
+        stats_count_alloc((n + 1) * sizeof(ASTNode));
+        if (!tree) {
+            fprintf(stderr, "Error: Memory allocation failed for tree\n");
+            exit(1);
+        }
+        if (n > 0) memcpy(tree + 1, b->cells + mark, n * sizeof(ASTNode));
+        if (has_position(&root)) root.data.first = root.data.first - mark + 1;
+        if (b->cells) b->count = mark;
     }
-    ASTNode* node = malloc(sizeof(ASTNode));
+    tree[0] = root;
+    return tree;
+}
+
+// Frees what a parse left in the builder, such as the values of a parse
+// abandoned on an error
+void free_builder(AstBuilder* b) {
+    free(b->cells);
+    free(b->pending);
+    memset(b, 0, sizeof(AstBuilder));
+}
+
+// Returns the interned copy of a key. Interned keys are shared by every
+// object that uses them and are not freed with the tree; equal keys are the
+// same pointer.
+char* span_string(Span span) {
+    char* key = intern_string(span.ptr, span.len);
+    if (span.owned) free((char*)span.ptr);
+    return key;
+}
+
+// A tree of one empty array
+ASTNode* make_empty_array() {
+    ASTNode* node = calloc(1, sizeof(ASTNode));
     if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for pair\n");
-        exit(1);
-    }
-    node->type = OBJ; // Temporary for pair
-    node->data.object.keys = malloc(sizeof(char*));
-    node->data.object.values = malloc(2 * sizeof(ASTNode*));
-    if (!node->data.object.keys || !node->data.object.values) {
-        fprintf(stderr, "Error: Memory allocation failed for pair arrays\n");
+        fprintf(stderr, "Error: Memory allocation failed for array\n");
         exit(1);
     }
-    node->data.object.keys[0] = strdup(key);
-    node->data.object.values[0] = value;
-    node->data.object.values[1] = NULL; // Next pointer
-    node->data.object.count = 1;
+    node->type = ARR;
     return node;
 }
 
-ASTNode* make_pair_list(ASTNode* pair, ASTNode* list) {
-    if (!pair) {
-        fprintf(stderr, "Warning: Null pair in make_pair_list\n");
-        return list;
-    }
-    ASTNode* new_pair = malloc(sizeof(ASTNode));
-    if (!new_pair) {
-        fprintf(stderr, "Error: Memory allocation failed for pair list\n");
-        exit(1);
-    }
-    new_pair->type = OBJ;
-    new_pair->data.object.keys = malloc(sizeof(char*));
-    new_pair->data.object.values = malloc(2 * sizeof(ASTNode*));
-    if (!new_pair->data.object.keys || !new_pair->data.object.values) {
-        fprintf(stderr, "Error: Memory allocation failed for pair list arrays\n");
+ElementList* make_element_list() {
+    ElementList* list = malloc(sizeof(ElementList));
+    stats_count_alloc(sizeof(ElementList));
+    if (!list) {
+        fprintf(stderr, "Error: Memory allocation failed for element list\n");
         exit(1);
     }
-    new_pair->data.object.keys[0] = pair->data.object.keys[0];
-    new_pair->data.object.values[0] = pair->data.object.values[0];
-    new_pair->data.object.values[1] = list; // Link to the rest of the list
-    new_pair->data.object.count = 1;
-    free(pair->data.object.keys);
-    free(pair->data.object.values);
-    free(pair);
-    return new_pair;
+    list->elements = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    return list;
 }
 
-ASTNode* make_element_list(ASTNode* element, ASTNode* list) {
-    fprintf(stderr, "make_element_list: element=%p, list=%p\n", element, list);
-    if (!element) {
-        fprintf(stderr, "Warning: Null element in make_element_list\n");
-        return list;
-    }
-    fprintf(stderr, "Element type=%d", element->type);
-    if (element->type == STR) {
-        fprintf(stderr, ", string='%s'\n", element->data.string ? element->data.string : "null");
-    } else if (element->type == NUM) {
-        fprintf(stderr, ", number='%s'\n", element->data.string ? element->data.string : "null");
-    } else {
-        fprintf(stderr, "\n");
-    }
-    ASTNode* new_element = malloc(sizeof(ASTNode));
-    if (!new_element) {
-        fprintf(stderr, "Error: Memory allocation failed for element list\n");
-        exit(1);
-    }
-    new_element->type = ARR; // Temporary for list
-    new_element->data.array.elements = malloc(2 * sizeof(ASTNode*));
-    if (!new_element->data.array.elements) {
-        fprintf(stderr, "Error: Memory allocation failed for element list array\n");
-        exit(1);
+void append_element(ElementList* list, ASTNode* element) {
+    TRACE("append_element: element=%p, type=%d, count=%d\n", element, element->type, list->count);
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 4;
+        list->elements = realloc(list->elements, list->capacity * sizeof(ASTNode*));
+        stats_count_alloc(list->capacity * sizeof(ASTNode*));
+        if (!list->elements) {
+            fprintf(stderr, "Error: Memory allocation failed for element list array\n");
+            exit(1);
+        }
     }
-    new_element->data.array.elements[0] = element;
-    new_element->data.array.elements[1] = list; // Link to the rest of the list
-    new_element->data.array.count = 1;
-    fprintf(stderr, "Created element list node: elements[0]=%p\n", element);
-    return new_element;
+    list->elements[list->count++] = element;
 }
 
-void free_ast(ASTNode* node) {
-    if (!node) return;
-    switch (node->type) {
-        case OBJ:
-            for (int i = 0; i < node->data.object.count; i++) {
-                if (node->data.object.keys[i]) free(node->data.object.keys[i]);
-                free_ast(node->data.object.values[i]);
-            }
-            free(node->data.object.keys);
-            free(node->data.object.values);
-            break;
-        case ARR:
-            for (int i = 0; i < node->data.array.count; i++) {
-                free_ast(node->data.array.elements[i]);
-            }
-            free(node->data.array.elements);
-            break;
-        case STR:
-        case NUM:
-            if (node->data.string) free(node->data.string);
-            break;
-        default:
-            break;
-    }
-    free(node);
+// Frees the list with the trees still in it
+void free_element_list(ElementList* list) {
+    for (int i = 0; i < list->count; i++) free_ast(list->elements[i]);
+    free(list->elements);
+    free(list);
 }
 
-void print_ast_node(ASTNode* node, int indent) {
-    if (!node) {
-        for (int i = 0; i < indent; i++) printf("  ");
-        printf("NULL\n");
-        return;
+// The whole tree is one block, however deep it is
+void free_ast(ASTNode* root) {
+    free(root);
+}
+
+// print_ast_node walks containers with an explicit stack of (node, next
+// child) entries, so depth is limited by heap, not C stack
+typedef struct {
+    ASTNode* node;
+    int indent;
+    uint32_t next;
+} NodeCursor;
+
+typedef struct {
+    NodeCursor* items;
+    int count;
+    int capacity;
+    NodeCursor small[32];
+} NodeStack;
+
+static void node_stack_init(NodeStack* stack) {
+    stack->items = stack->small;
+    stack->count = 0;
+    stack->capacity = 32;
+}
+
+static void node_stack_push(NodeStack* stack, ASTNode* node, int indent) {
+    if (stack->count == stack->capacity) {
+        stack->capacity *= 2;
+        if (stack->items == stack->small) {
+            stack->items = malloc(stack->capacity * sizeof(NodeCursor));
+            if (stack->items) memcpy(stack->items, stack->small, sizeof(stack->small));
+        } else {
+            stack->items = realloc(stack->items, stack->capacity * sizeof(NodeCursor));
+        }
+        if (!stack->items) {
+            fprintf(stderr, "Error: Memory allocation failed for traversal stack\n");
+            exit(1);
+        }
     }
+    NodeCursor* top = &stack->items[stack->count++];
+    top->node = node;
+    top->indent = indent;
+    top->next = 0;
+}
+
+static void node_stack_free(NodeStack* stack) {
+    if (stack->items != stack->small) free(stack->items);
+}
+
+static void print_indent(int indent) {
     for (int i = 0; i < indent; i++) printf("  ");
+}
+
+// Prints a scalar's line or a container's header line; returns 1 if the node
+// has children to print below it
+static int print_node_line(ASTNode* node) {
     switch (node->type) {
         case OBJ:
-            printf("OBJECT (count=%d)\n", node->data.object.count);
-            for (int i = 0; i < node->data.object.count; i++) {
-                for (int j = 0; j < indent + 1; j++) printf("  ");
-                printf("\"%s\": ", node->data.object.keys[i] ? node->data.object.keys[i] : "null");
-                print_ast_node(node->data.object.values[i], indent + 2);
-            }
-            break;
+            printf("OBJECT (count=%u)\n", node->count);
+            return 1;
         case ARR:
-            printf("ARRAY (count=%d)\n", node->data.array.count);
-            for (int i = 0; i < node->data.array.count; i++) {
-                for (int j = 0; j < indent + 1; j++) printf("  ");
-                printf("[%d]: ", i);
-                if (!node->data.array.elements[i]) {
-                    printf("NULL\n");
-                    continue;
-                }
-                char* ptr = (char*)node->data.array.elements[i];
-                if (ptr[0] >= 32 && ptr[0] <= 126 && ptr[1] >= 32 && ptr[1] <= 126) {
-                    fprintf(stderr, "Error: Invalid ASTNode at array index %d, looks like string '%s'\n", i, ptr);
-                    exit(1);
-                }
-                print_ast_node(node->data.array.elements[i], indent + 2);
-            }
-            break;
+            printf("ARRAY (count=%u)\n", node->count);
+            return 1;
         case STR:
-            printf("STRING \"%s\"\n", node->data.string ? node->data.string : "null");
+            printf("STRING \"%.*s\"\n", (int)node->count, ast_text(node));
             break;
         case NUM:
-            printf("NUMBER %s\n", node->data.string ? node->data.string : "null");
+            printf("NUMBER %.*s\n", (int)node->count, ast_text(node));
             break;
         case TRU:
             printf("TRUE\n");
@@ -309,4 +335,39 @@ void print_ast_node(ASTNode* node, int indent) {
             printf("UNKNOWN TYPE (%d)\n", node->type);
             break;
     }
-}
\ No newline at end of file
+    return 0;
+}
+
+void print_ast_node(ASTNode* node, int indent) {
+    print_indent(indent);
+    if (!node) {
+        printf("NULL\n");
+        return;
+    }
+    if (!print_node_line(node)) return;
+
+    NodeStack stack;
+    node_stack_init(&stack);
+    node_stack_push(&stack, node, indent);
+    while (stack.count > 0) {
+        NodeCursor* top = &stack.items[stack.count - 1];
+        ASTNode* current = top->node;
+        if (top->next >= current->count) {
+            stack.count--;
+            continue;
+        }
+        uint32_t i = top->next++;
+        int child_indent = top->indent + 2;
+        ASTNode* child = ast_children(current) + i;
+        print_indent(top->indent + 1);
+        if (current->type == OBJ) {
+            char* key = ast_keys(current)[i];
+            printf("\"%s\": ", key ? key : "null");
+        } else {
+            printf("[%u]: ", i);
+        }
+        print_indent(child_indent);
+        if (print_node_line(child)) node_stack_push(&stack, child, child_indent);
+    }
+    node_stack_free(&stack);
+}
@@ -1,6 +1,10 @@
 #ifndef AST_H
 #define AST_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "json2relcsv.h"
+
 typedef enum {
     OBJ,
     ARR,
@@ -11,29 +15,114 @@ typedef enum {
     NUL
 } NodeType;
 
+// Text of a string or number token. Borrowed spans point into the retained
+// input buffer; owned spans (escaped strings, flex tokens) are malloc'd and
+// belong to whoever holds the token.
+typedef struct {
+    const char* ptr;
+    size_t len;
+    int owned;
+} Span;
+
+// A tree is one block of fixed-size cells with its root in the first. The
+// children of a container are consecutive nodes, and an object's keys
+// follow its children as an array of interned pointers, in step. Positions
+// are 32-bit cell offsets from the node that holds them, so a tree can be
+// moved or copied as a whole. Text that was copied out of the input, such
+// as an escaped string the value pool did not take, is stored in the block
+// too. free_ast releases the block, and only takes a root.
 typedef struct ASTNode {
-    NodeType type;
+    uint8_t type;           // NodeType
+    uint8_t inline_text;    // strings and numbers: the text is in the block, at first
+    uint32_t count;         // members or elements; length of a string or number
     union {
-        struct { char** keys; struct ASTNode** values; int count; } object;
-        struct { struct ASTNode** elements; int count; } array;
-        char* string;
+        int32_t first;      // first child, or inline text, relative to this node
+        const char* text;   // borrowed text: the input, the value pool or a cache
     } data;
 } ASTNode;
 
-ASTNode* make_object(ASTNode* members);
-ASTNode* make_array(ASTNode* elements);
-ASTNode* make_string(char* string);
-ASTNode* make_number(char* number);
-ASTNode* make_true();
-ASTNode* make_false();
-ASTNode* make_null();
-ASTNode* make_pair(char* key, ASTNode* value);
-ASTNode* make_pair_list(ASTNode* pair, ASTNode* list);
-ASTNode* make_element_list(ASTNode* element, ASTNode* list);
-
-void free_ast(ASTNode* node);
+static inline ASTNode* ast_children(const ASTNode* node) {
+    return (ASTNode*)node + node->data.first;
+}
+
+static inline char** ast_keys(const ASTNode* object) {
+    return (char**)(ast_children(object) + object->count);
+}
+
+// Cells an object's keys take after its children
+static inline uint32_t ast_key_cells(uint32_t count) {
+    return ((size_t)count * sizeof(char*) + sizeof(ASTNode) - 1) / sizeof(ASTNode);
+}
+
+static inline const char* ast_text(const ASTNode* node) {
+    return node->inline_text ? (const char*)(node + node->data.first) : node->data.text;
+}
+
+// A value the parser has reduced but not yet placed in its parent; first is
+// still an absolute cell index
+typedef struct {
+    ASTNode node;
+    char* key;
+} PendingValue;
+
+// Builds the trees of one parse. Reduced values wait on a stack until
+// their container closes; then they are copied into the arena as its
+// children. Cell 0 is kept for the root. Zero-initialized is empty.
+typedef struct {
+    ASTNode* cells;
+    uint32_t count;
+    uint32_t capacity;
+    PendingValue* pending;
+    uint32_t num_pending;
+    uint32_t max_pending;
+    int too_large;      // set once a tree outgrows the arena; see reserve_cells
+} AstBuilder;
+
+void push_string(AstBuilder* b, Span string);
+void push_number(AstBuilder* b, Span number);
+void push_literal(AstBuilder* b, NodeType type);
+void close_object(AstBuilder* b, uint32_t start);
+void close_array(AstBuilder* b, uint32_t start);
+ASTNode* last_value(AstBuilder* b);
+void set_key(AstBuilder* b, char* key);
+void drop_value(AstBuilder* b);
+uint32_t arena_mark(AstBuilder* b);
+ASTNode* take_tree(AstBuilder* b, uint32_t mark);
+void free_builder(AstBuilder* b);
+char* span_string(Span span);
+ASTNode* make_empty_array();
+
+// --split: elements taken out of a chunk as trees of their own
+typedef struct {
+    ASTNode** elements;
+    int count;
+    int capacity;
+} ElementList;
+
+ElementList* make_element_list();
+void append_element(ElementList* list, ASTNode* element);
+void free_element_list(ElementList* list);
+
+void free_ast(ASTNode* root);
 void print_ast_node(ASTNode* node, int indent);
-void generate_csv(ASTNode* root, char* out_dir);
-void cleanup_tables();
+
+// Table generation, into the converter's tables and output directory
+void generate_csv(Converter* c, ASTNode* root);
+void convert_document(Converter* c, ASTNode* root);
+void release_row_buffer();
+void close_tables(Converter* c);
+void cleanup_tables(Converter* c);
+int get_table_stats(Converter* c, int index, const char** name, int* columns, unsigned long long* rows, unsigned long long* bytes);
+int get_table_state(Converter* c, int index, const char** name, const char** ids, char*** columns, int* num_columns, int* next_id, int* pending);
+char* table_file_path(Converter* c, int index);
+int restore_table(Converter* c, char* name, const char* ids, char** columns, int num_columns, int next_id);
+void reopen_table(Converter* c, int index);
+int reserve_row_id(Converter* c, const char* name);
+
+typedef struct Table Table;
+
+Table* create_array_table(Converter* c, ASTNode* first, char* parent_table, char* array_key);
+void emit_array_element(Converter* c, Table* table, ASTNode* element, int parent_id, char* array_key, int index);
+int emit_object_row(Converter* c, ASTNode* object, Table* parent, int parent_id, char* key, int seq, int streamed_id);
 
 #endif
\ No newline at end of file
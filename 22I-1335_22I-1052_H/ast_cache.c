@@ -0,0 +1,297 @@
+#include "ast_cache.h"
+#include "converter.h"
+#include "csv_writer.h"
+#include "intern.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct AstCache {
+    const char* map;
+    size_t size;
+    ASTNode* root;
+};
+
+// Distinct keys by pointer: keys are interned, so equal keys are one pointer
+typedef struct {
+    char** slots;
+    uint32_t* ids;
+    size_t capacity;
+    uint64_t* offsets;      // of each key's text in the strings section
+    size_t count;
+} KeyTable;
+
+static void* cache_alloc(size_t bytes, const char* what) {
+    void* p = malloc(bytes ? bytes : 1);
+    if (!p) {
+        fprintf(stderr, "Error: Memory allocation failed for %s\n", what);
+        exit(1);
+    }
+    return p;
+}
+
+static size_t hash_pointer(const char* key, size_t capacity) {
+    return ((uintptr_t)key >> 4) * 11400714819323198485ULL & (capacity - 1);
+}
+
+// Returns the key's id, adding its text to strings the first time
+static uint32_t key_id(KeyTable* t, CsvRow* strings, char* key) {
+    if ((t->count + 1) * 2 > t->capacity) {
+        char** old_slots = t->slots;
+        uint32_t* old_ids = t->ids;
+        size_t old_capacity = t->capacity;
+        t->capacity = old_capacity ? old_capacity * 2 : 256;
+        t->slots = calloc(t->capacity, sizeof(char*));
+        t->ids = cache_alloc(t->capacity * sizeof(uint32_t), "AST cache keys");
+        t->offsets = realloc(t->offsets, t->capacity / 2 * sizeof(uint64_t));
+        if (!t->slots || !t->offsets) {
+            fprintf(stderr, "Error: Memory allocation failed for AST cache keys\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (!old_slots[i]) continue;
+            size_t slot = hash_pointer(old_slots[i], t->capacity);
+            while (t->slots[slot]) slot = (slot + 1) & (t->capacity - 1);
+            t->slots[slot] = old_slots[i];
+            t->ids[slot] = old_ids[i];
+        }
+        free(old_slots);
+        free(old_ids);
+    }
+    size_t slot = hash_pointer(key, t->capacity);
+    while (t->slots[slot]) {
+        if (t->slots[slot] == key) return t->ids[slot];
+        slot = (slot + 1) & (t->capacity - 1);
+    }
+    t->slots[slot] = key;
+    t->ids[slot] = t->count;
+    t->offsets[t->count] = strings->len;
+    csv_row_raw(strings, key, strlen(key) + 1);
+    return t->count++;
+}
+
+static int write_all(FILE* f, const void* data, size_t size) {
+    return size == 0 || fwrite(data, size, 1, f) == 1;
+}
+
+// Lays the tree out breadth first and writes it to path, through a
+// temporary file renamed into place. Returns -1 after reporting an error.
+int save_ast_cache(Converter* c, ASTNode* root, const char* path) {
+    size_t count = 1;
+    size_t capacity = 1024;
+    ASTNode** order = cache_alloc(capacity * sizeof(ASTNode*), "AST cache order");
+    order[0] = root;
+    for (size_t i = 0; i < count; i++) {
+        ASTNode* node = order[i];
+        size_t n = node->type == OBJ || node->type == ARR ? node->count : 0;
+        if (count + n > capacity) {
+            while (count + n > capacity) capacity *= 2;
+            order = realloc(order, capacity * sizeof(ASTNode*));
+            if (!order) {
+                fprintf(stderr, "Error: Memory allocation failed for AST cache order\n");
+                exit(1);
+            }
+        }
+        for (size_t j = 0; j < n; j++) order[count++] = &ast_children(node)[j];
+    }
+    if (count >= AST_CACHE_NO_KEY) {
+        free(order);
+        converter_fail(c, CONVERT_ERROR_OUTPUT, "The tree is too large for an AST cache");
+        return -1;
+    }
+
+    AstCacheNode* nodes = cache_alloc(count * sizeof(AstCacheNode), "AST cache nodes");
+    uint32_t* node_keys = cache_alloc(count * sizeof(uint32_t), "AST cache keys");
+    KeyTable keys;
+    memset(&keys, 0, sizeof(KeyTable));
+    CsvRow strings = { NULL, 0, 0 };
+    uint64_t next_child = 1;
+    node_keys[0] = AST_CACHE_NO_KEY;
+    for (size_t i = 0; i < count; i++) {
+        ASTNode* node = order[i];
+        nodes[i].type = node->type;
+        nodes[i].count = 0;
+        nodes[i].first = 0;
+        if (node->type == OBJ || node->type == ARR) {
+            for (uint32_t j = 0; j < node->count; j++) {
+                node_keys[next_child + j] = node->type == OBJ ? key_id(&keys, &strings, ast_keys(node)[j]) : AST_CACHE_NO_KEY;
+            }
+            nodes[i].count = node->count;
+            nodes[i].first = next_child;
+            next_child += node->count;
+        } else if (node->type == STR || node->type == NUM) {
+            nodes[i].count = node->count;
+            nodes[i].first = strings.len;
+            csv_row_raw(&strings, ast_text(node), node->count);
+        }
+    }
+    free(order);
+
+    char* temporary = cache_alloc(strlen(path) + 5, "AST cache path");
+    sprintf(temporary, "%s.tmp", path);
+    int status = 0;
+    FILE* f = fopen(temporary, "wb");
+    if (f) {
+        AstCacheHeader header;
+        memcpy(header.magic, AST_CACHE_MAGIC, sizeof(header.magic));
+        header.node_count = count;
+        header.key_count = keys.count;
+        header.string_bytes = strings.len;
+        static const char padding[8] = { 0 };
+        int written = write_all(f, &header, sizeof(header)) &&
+                      write_all(f, nodes, count * sizeof(AstCacheNode)) &&
+                      write_all(f, node_keys, count * sizeof(uint32_t)) &&
+                      write_all(f, padding, count % 2 * sizeof(uint32_t)) &&
+                      write_all(f, keys.offsets, keys.count * sizeof(uint64_t)) &&
+                      write_all(f, strings.data, strings.len);
+        if (fclose(f) != 0 || !written || rename(temporary, path) != 0) {
+            unlink(temporary);
+            status = -1;
+        }
+    } else {
+        status = -1;
+    }
+    if (status != 0) converter_fail(c, CONVERT_ERROR_OUTPUT, "Cannot write AST cache %s", path);
+    free(temporary);
+    free(nodes);
+    free(node_keys);
+    free(keys.slots);
+    free(keys.ids);
+    free(keys.offsets);
+    csv_row_free(&strings);
+    return status;
+}
+
+// Maps the cache at path and builds its tree over the mapping, in one block
+// laid out as the parser lays trees out. Returns NULL after reporting an
+// error.
+AstCache* load_ast_cache(Converter* c, const char* path, ASTNode** root) {
+    int phase = stats_enter(PHASE_PARSE);
+    *root = NULL;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        converter_fail(c, CONVERT_ERROR_INPUT, "Cannot open AST cache %s", path);
+        stats_leave(phase);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    const char* map = size >= sizeof(AstCacheHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        converter_fail(c, CONVERT_ERROR_INPUT, "Invalid AST cache %s", path);
+        stats_leave(phase);
+        return NULL;
+    }
+    stats_count_input(size);
+
+    // Every section must fit the file exactly
+    const AstCacheHeader* header = (const AstCacheHeader*)map;
+    uint64_t n = header->node_count;
+    uint64_t k = header->key_count;
+    uint64_t s = header->string_bytes;
+    int valid = memcmp(header->magic, AST_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+                n >= 1 && n < AST_CACHE_NO_KEY && k <= n && s <= size;
+    size_t keys_at = sizeof(AstCacheHeader) + n * sizeof(AstCacheNode);
+    size_t offsets_at = keys_at + (n + n % 2) * sizeof(uint32_t);
+    size_t strings_at = offsets_at + k * sizeof(uint64_t);
+    valid = valid && strings_at <= size && size - strings_at == s;
+
+    const AstCacheNode* records = (const AstCacheNode*)(map + sizeof(AstCacheHeader));
+    const uint32_t* node_keys = (const uint32_t*)(map + keys_at);
+    const uint64_t* offsets = (const uint64_t*)(map + offsets_at);
+    const char* strings = map + strings_at;
+
+    // Keys are interned again, so shapes compare them by pointer as usual
+    char** key_strings = valid ? cache_alloc(k * sizeof(char*), "AST cache keys") : NULL;
+    for (uint64_t i = 0; valid && i < k; i++) {
+        const char* end = offsets[i] < s ? memchr(strings + offsets[i], '\0', s - offsets[i]) : NULL;
+        if (end) {
+            key_strings[i] = intern_string(strings + offsets[i], end - (strings + offsets[i]));
+        } else {
+            valid = 0;
+        }
+    }
+
+    // The children of each container must start where those of the one
+    // before ended, which makes the nodes a tree. Each container's children
+    // take the next cells of the block, followed by the keys of an object's.
+    uint64_t next_child = 1;
+    uint64_t cells = 1;
+    for (uint64_t i = 0; valid && i < n; i++) {
+        const AstCacheNode* r = &records[i];
+        if (r->type == OBJ || r->type == ARR) {
+            valid = r->first == next_child && r->count <= INT_MAX && r->count <= n - next_child;
+            for (uint64_t j = 0; valid && r->type == OBJ && j < r->count; j++) {
+                valid = node_keys[r->first + j] < k;
+            }
+            next_child += r->count;
+            cells += r->count;
+            if (r->type == OBJ) cells += ast_key_cells(r->count);
+        } else if (r->type == STR || r->type == NUM) {
+            valid = r->first <= s && r->count <= s - r->first;
+        } else {
+            valid = r->type <= NUL;
+        }
+    }
+    valid = valid && cells <= INT32_MAX;
+    if (!valid || next_child != n) {
+        free(key_strings);
+        munmap((void*)map, size);
+        converter_fail(c, CONVERT_ERROR_INPUT, "Invalid AST cache %s", path);
+        stats_leave(phase);
+        return NULL;
+    }
+
+    // Breadth-first order places the nodes in cache order, so the cell of
+    // the next child to place only ever moves forward
+    ASTNode* block = cache_alloc(cells * sizeof(ASTNode), "AST cache nodes");
+    uint32_t* at = cache_alloc(n * sizeof(uint32_t), "AST cache nodes");
+    stats_count_alloc(cells * sizeof(ASTNode));
+    at[0] = 0;
+    uint32_t next_cell = 1;
+    for (uint64_t i = 0; i < n; i++) {
+        const AstCacheNode* r = &records[i];
+        ASTNode* node = &block[at[i]];
+        memset(node, 0, sizeof(ASTNode));
+        node->type = r->type;
+        node->count = r->count;
+        if (stats_active) thread_stats.nodes[r->type]++;
+        if ((r->type == OBJ || r->type == ARR) && r->count > 0) {
+            node->data.first = next_cell - at[i];
+            for (uint32_t j = 0; j < r->count; j++) at[r->first + j] = next_cell + j;
+            next_cell += r->count;
+            if (r->type == OBJ) {
+                char** keys = ast_keys(node);
+                for (uint32_t j = 0; j < r->count; j++) keys[j] = key_strings[node_keys[r->first + j]];
+                next_cell += ast_key_cells(r->count);
+            }
+        } else if (r->type == STR || r->type == NUM) {
+            node->data.text = strings + r->first;
+        }
+    }
+    free(at);
+    free(key_strings);
+
+    AstCache* cache = cache_alloc(sizeof(AstCache), "AST cache");
+    cache->map = map;
+    cache->size = size;
+    cache->root = block;
+    *root = block;
+    stats_leave(phase);
+    return cache;
+}
+
+void release_ast_cache(AstCache* cache) {
+    if (!cache) return;
+    free_ast(cache->root);
+    munmap((void*)cache->map, cache->size);
+    free(cache);
+}
@@ -0,0 +1,44 @@
+#ifndef AST_CACHE_H
+#define AST_CACHE_H
+
+#include <stdint.h>
+#include "ast.h"
+
+// --emit-cache and --from-cache: a parsed tree saved as one blob with no
+// pointers, so a later run can convert the same input without parsing it.
+// The file is, in native byte order:
+//   AstCacheHeader
+//   AstCacheNode nodes[node_count]     breadth first, the root first
+//   uint32_t node_keys[node_count]     key of each object member, else ~0
+//   (padding to 8 bytes)
+//   uint64_t keys[key_count]           offset of each distinct key in strings
+//   char strings[string_bytes]         keys (NUL-terminated) and scalar text
+// Breadth-first order puts the children of every container next to each
+// other, right after those of the containers before it, so a container only
+// records its first child. Offsets are relative to their section, so the
+// blob can be mapped anywhere.
+#define AST_CACHE_MAGIC "J2RAST1\n"
+#define AST_CACHE_NO_KEY UINT32_MAX
+
+typedef struct {
+    char magic[8];
+    uint64_t node_count;
+    uint64_t key_count;
+    uint64_t string_bytes;
+} AstCacheHeader;
+
+typedef struct {
+    uint32_t type;      // NodeType
+    uint32_t count;     // members or elements; length of a string or number
+    uint64_t first;     // index of the first child; offset of the text
+} AstCacheNode;
+
+// A tree loaded from a cache: its nodes borrow their text from the mapping
+// and are freed together by release_ast_cache, not free_ast
+typedef struct AstCache AstCache;
+
+int save_ast_cache(Converter* c, ASTNode* root, const char* path);
+AstCache* load_ast_cache(Converter* c, const char* path, ASTNode** root);
+void release_ast_cache(AstCache* cache);
+
+#endif
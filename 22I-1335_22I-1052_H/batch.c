@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "ast.h"
+#include "converter.h"
+#include "infer.h"
+#include "parser.tab.h"
+#include "simd_lexer.h"
+#include "batch.h"
+#include "stats.h"
+
+// Files to convert, after directories are expanded
+typedef struct {
+    char** paths;
+    int count;
+    int capacity;
+    int next;       // index of the next unclaimed file, taken atomically
+    int ndjson;
+    Converter* converter;
+} FileQueue;
+
+int is_directory(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void add_path(FileQueue* queue, char* path) {
+    if (queue->count == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->paths = realloc(queue->paths, queue->capacity * sizeof(char*));
+        if (!queue->paths) {
+            fprintf(stderr, "Error: Memory allocation failed for file list\n");
+            exit(1);
+        }
+    }
+    queue->paths[queue->count++] = path;
+}
+
+static int has_input_extension(const char* name) {
+    const char* dot = strrchr(name, '.');
+    return dot && (strcmp(dot, ".json") == 0 || strcmp(dot, ".ndjson") == 0 || strcmp(dot, ".jsonl") == 0);
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Adds the JSON files directly inside a directory, sorted so runs are repeatable
+static int add_directory(FileQueue* queue, const char* dir_path) {
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        converter_fail(queue->converter, CONVERT_ERROR_INPUT, "Cannot open directory %s", dir_path);
+        return -1;
+    }
+    int first = queue->count;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || !has_input_extension(entry->d_name)) continue;
+        char* path = malloc(strlen(dir_path) + strlen(entry->d_name) + 2);
+        if (!path) {
+            fprintf(stderr, "Error: Memory allocation failed for file path\n");
+            exit(1);
+        }
+        sprintf(path, "%s/%s", dir_path, entry->d_name);
+        if (is_directory(path)) {
+            free(path);
+            continue;
+        }
+        add_path(queue, path);
+    }
+    closedir(dir);
+    qsort(queue->paths + first, queue->count - first, sizeof(char*), compare_paths);
+    return 0;
+}
+
+// Claims files until none are left or the converter has failed
+static void* batch_worker(void* arg) {
+    FileQueue* queue = arg;
+    Converter* c = queue->converter;
+    stats_thread_start(c);
+    while (!converter_failed(c)) {
+        int i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+        if (i >= queue->count) break;
+        SimdLexer* input;
+        ASTNode* root;
+        if (parse_file(c, queue->paths[i], queue->ndjson, 0, &root, &input) == 0 && root) {
+            if (c->options.infer) infer_document(c, root);
+            convert_document(c, root);
+            free_ast(root);
+        }
+        simd_lexer_close(input);
+    }
+    release_row_buffer();
+    stats_thread_done(c);
+    return NULL;
+}
+
+// Converts every input on a pool of worker threads. All files share one set
+// of tables; row ids come from atomic per-table counters, so foreign keys
+// stay consistent whichever thread writes a row.
+void run_batch(Converter* c, char** inputs, int num_inputs, int jobs, int ndjson) {
+    FileQueue queue = { NULL, 0, 0, 0, ndjson, c };
+    for (int i = 0; i < num_inputs && !converter_failed(c); i++) {
+        if (is_directory(inputs[i])) {
+            add_directory(&queue, inputs[i]);
+        } else {
+            add_path(&queue, strdup(inputs[i]));
+        }
+    }
+    if (queue.count == 0 && !converter_failed(c)) {
+        converter_fail(c, CONVERT_ERROR_INPUT, "No input files found");
+    }
+    if (jobs > queue.count) jobs = queue.count;
+
+    pthread_t* workers = malloc((jobs ? jobs : 1) * sizeof(pthread_t));
+    if (!workers) {
+        fprintf(stderr, "Error: Memory allocation failed for workers\n");
+        exit(1);
+    }
+    int started = 0;
+    while (!converter_failed(c) && started < jobs) {
+        if (pthread_create(&workers[started], NULL, batch_worker, &queue) != 0) {
+            converter_fail(c, CONVERT_ERROR_RESOURCE, "Cannot start worker thread");
+            break;
+        }
+        started++;
+    }
+    int phase = stats_enter(PHASE_WAIT);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    stats_leave(phase);
+    free(workers);
+
+    for (int i = 0; i < queue.count; i++) free(queue.paths[i]);
+    free(queue.paths);
+}
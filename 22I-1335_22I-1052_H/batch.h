@@ -0,0 +1,9 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "json2relcsv.h"
+
+int is_directory(const char* path);
+void run_batch(Converter* c, char** inputs, int num_inputs, int jobs, int ndjson);
+
+#endif
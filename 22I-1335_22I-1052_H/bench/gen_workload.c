@@ -0,0 +1,174 @@
+// Synthetic JSON workloads for the benchmark harness.
+//
+// Usage: gen_workload <shape> <megabytes> [seed] > out.json
+//
+// Shapes:
+//   wide     root array of flat objects with 64 scalar members
+//   deep     root array of objects nested 48 levels deep
+//   scalars  root object holding one huge scalar array ("genres")
+//   items    root array of orders, each with "items" and "comments" arrays of objects
+//   hetero   root array of objects drawn from 500 different key sets
+//
+// Output is a pure function of shape, size and seed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long long rng_state;
+
+// xorshift64*, so every platform produces the same workload
+static unsigned long long next_random() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static unsigned random_below(unsigned n) {
+    return (unsigned)(next_random() % n);
+}
+
+static long long written = 0;
+
+static void emit(const char* s) {
+    written += strlen(s);
+    fputs(s, stdout);
+}
+
+static void emitf(const char* fmt, long long a, long long b) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), fmt, a, b);
+    emit(buf);
+}
+
+// A short word, with an escape or a comma now and then to exercise quoting
+static void emit_word() {
+    static const char* words[] = {
+        "alpha", "beta", "gamma", "delta", "drama", "comedy", "thriller",
+        "horror", "say \\\"hi\\\"", "a, b", "line\\nbreak", "zeta"
+    };
+    emit("\"");
+    emit(words[random_below(sizeof(words) / sizeof(words[0]))]);
+    emit("\"");
+}
+
+static void emit_scalar() {
+    switch (random_below(6)) {
+        case 0: emit_word(); break;
+        case 1: emitf("%lld", random_below(1000000), 0); break;
+        case 2: {
+            long long whole = random_below(10000);
+            emitf("%lld.%02lld", whole, random_below(100));
+            break;
+        }
+        case 3: emit(random_below(2) ? "true" : "false"); break;
+        case 4: emit("null"); break;
+        default: {
+            long long group = random_below(100000);
+            emitf("\"id-%lld-%lld\"", group, random_below(1000));
+            break;
+        }
+    }
+}
+
+static void gen_wide(long long target) {
+    emit("[");
+    for (long long n = 0; written < target; n++) {
+        emit(n ? ",\n{" : "\n{");
+        for (int k = 0; k < 64; k++) {
+            if (k) emit(", ");
+            emitf("\"field_%02lld\": ", k, 0);
+            emit_scalar();
+        }
+        emit("}");
+    }
+    emit("\n]\n");
+}
+
+static void gen_deep(long long target) {
+    emit("[");
+    for (long long n = 0; written < target; n++) {
+        emit(n ? ",\n" : "\n");
+        for (int d = 0; d < 48; d++) {
+            emitf("{\"level\": %lld, \"tag\": \"l%lld\", \"child\": ", d, d);
+        }
+        emitf("{\"leaf\": %lld, \"n\": %lld}", n, n);
+        for (int d = 0; d < 48; d++) emit("}");
+    }
+    emit("\n]\n");
+}
+
+static void gen_scalars(long long target) {
+    emit("{\"title\": \"catalog\", \"genres\": [");
+    for (long long n = 0; written < target; n++) {
+        emit(n ? ", " : "");
+        if (n % 16 == 15) emit("\n");
+        emit_word();
+    }
+    emit("]}\n");
+}
+
+static void gen_items(long long target) {
+    emit("[");
+    for (long long n = 0; written < target; n++) {
+        emit(n ? ",\n" : "\n");
+        emitf("{\"order\": %lld, \"customer\": {\"cid\": %lld, \"name\": ", n, random_below(5000));
+        emit_word();
+        emit("}, \"items\": [");
+        int items = 1 + random_below(8);
+        for (int i = 0; i < items; i++) {
+            if (i) emit(", ");
+            long long sku = random_below(100000);
+            emitf("{\"sku\": \"SKU%lld\", \"qty\": %lld", sku, 1 + random_below(9));
+            emitf(", \"price\": %lld.99}", random_below(500), 0);
+        }
+        emit("], \"comments\": [");
+        int comments = random_below(4);
+        for (int i = 0; i < comments; i++) {
+            emit(i ? ", {\"text\": " : "{\"text\": ");
+            emit_word();
+            emitf(", \"stars\": %lld}", 1 + random_below(5), 0);
+        }
+        emit("]}");
+    }
+    emit("\n]\n");
+}
+
+static void gen_hetero(long long target) {
+    emit("[");
+    for (long long n = 0; written < target; n++) {
+        emit(n ? ",\n{" : "\n{");
+        // Each key set is a bitmask over 16 optional keys plus a shared id
+        unsigned mask = random_below(500) * 131 + 7;
+        emitf("\"id\": %lld", n, 0);
+        for (int k = 0; k < 16; k++) {
+            if (mask & (1u << k)) {
+                emitf(", \"k%lld\": ", k, 0);
+                emit_scalar();
+            }
+        }
+        emit("}");
+    }
+    emit("\n]\n");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <wide|deep|scalars|items|hetero> <megabytes> [seed]\n", argv[0]);
+        return 1;
+    }
+    long long target = (long long)(atof(argv[2]) * 1000000);
+    rng_state = argc > 3 ? strtoull(argv[3], NULL, 10) : 42;
+    if (rng_state == 0) rng_state = 42;
+
+    if (strcmp(argv[1], "wide") == 0) gen_wide(target);
+    else if (strcmp(argv[1], "deep") == 0) gen_deep(target);
+    else if (strcmp(argv[1], "scalars") == 0) gen_scalars(target);
+    else if (strcmp(argv[1], "items") == 0) gen_items(target);
+    else if (strcmp(argv[1], "hetero") == 0) gen_hetero(target);
+    else {
+        fprintf(stderr, "Error: Unknown shape %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+#!/bin/bash
+# Runs json2relcsv over the synthetic workloads and compares with a baseline.
+#
+# Usage: run_bench.sh <json2relcsv> <gen_workload> <work-dir> <baseline.tsv> [--update]
+#
+# Environment:
+#   BENCH_MB      size of each workload in MB (default 20)
+#   BENCH_RUNS    timed runs per shape; the fastest is kept (default 3)
+#   BENCH_FLAGS   extra json2relcsv flags (default "--lexer simd")
+#   BENCH_STRICT  set to 1 to also fail when throughput drops
+#
+# Allocation and row counts are deterministic, so any increase fails the run.
+# Throughput and RSS depend on the machine and only warn unless BENCH_STRICT=1.
+set -e
+
+if [ $# -lt 4 ]; then
+    echo "Usage: $0 <json2relcsv> <gen_workload> <work-dir> <baseline.tsv> [--update]" >&2
+    exit 1
+fi
+bin=$1
+gen=$2
+work=$3
+baseline=$4
+update=$5
+
+mb=${BENCH_MB:-20}
+runs=${BENCH_RUNS:-3}
+flags=${BENCH_FLAGS-"--lexer simd"}
+shapes="wide deep scalars items hetero"
+
+mkdir -p "$work"
+results="$work/results.tsv"
+printf "shape\tmb_per_s\trows_per_s\tpeak_rss_kb\tallocations\trows\n" > "$results"
+
+# Pulls one numeric field out of the --stats=json line
+field() {
+    grep -o "\"$1\": [0-9.]*" "$2" | head -1 | sed 's/.*: //'
+}
+
+for shape in $shapes; do
+    input="$work/$shape-$mb.json"
+    [ -f "$input" ] || "$gen" "$shape" "$mb" > "$input"
+
+    best=""
+    for run in $(seq "$runs"); do
+        rm -rf "$work/out"
+        mkdir -p "$work/out"
+        "$bin" "$input" --out-dir "$work/out" --stats=json $flags 2> "$work/stats.json" > /dev/null
+        wall=$(field wall_seconds "$work/stats.json")
+        if [ -z "$best" ] || awk "BEGIN { exit !($wall < $best) }"; then
+            best=$wall
+            cp "$work/stats.json" "$work/best.json"
+        fi
+    done
+
+    bytes=$(field input_bytes "$work/best.json")
+    rss=$(field peak_rss_kb "$work/best.json")
+    allocs=$(field allocations "$work/best.json")
+    rows=$(grep -o '"rows": [0-9]*' "$work/best.json" | awk '{ n += $2 } END { print n + 0 }')
+    awk -v s="$shape" -v w="$best" -v b="$bytes" -v r="$rows" -v m="$rss" -v a="$allocs" \
+        'BEGIN { printf "%s\t%.1f\t%.0f\t%d\t%d\t%d\n", s, b / 1e6 / w, r / w, m, a, r }' >> "$results"
+done
+rm -rf "$work/out" "$work/stats.json" "$work/best.json"
+
+if [ "$update" = "--update" ]; then
+    cp "$results" "$baseline"
+    echo "Baseline written to $baseline"
+    cat "$baseline"
+    exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+    cat "$results"
+    echo "No baseline at $baseline; run with --update to store one"
+    exit 0
+fi
+
+# Prints each metric next to its baseline and flags regressions
+awk -F '\t' -v strict="${BENCH_STRICT:-0}" '
+    NR == FNR { if (FNR > 1) { bmb[$1] = $2; brps[$1] = $3; brss[$1] = $4; balloc[$1] = $5; brows[$1] = $6 } next }
+    FNR == 1 { printf "%-8s %18s %22s %22s %24s %s\n", "shape", "MB/s", "rows/s", "peak RSS KB", "allocations", "status"; next }
+    {
+        status = "ok"
+        if (!($1 in bmb)) status = "new"
+        else {
+            if ($5 > balloc[$1] * 1.01) { status = "REGRESSION (allocations)"; failed = 1 }
+            else if ($6 != brows[$1]) { status = "CHANGED (rows)"; failed = 1 }
+            else if ($2 < bmb[$1] * 0.85) { status = "SLOWER"; if (strict) failed = 1 }
+            else if ($4 > brss[$1] * 1.15) { status = "MORE MEMORY"; if (strict) failed = 1 }
+        }
+        printf "%-8s %8.1f (%7.1f) %10.0f (%9.0f) %10d (%9d) %11d (%10d) %s\n",
+               $1, $2, bmb[$1], $3, brps[$1], $4, brss[$1], $5, balloc[$1], status
+    }
+    END { exit failed }
+' "$baseline" "$results"
@@ -0,0 +1,135 @@
+#include "compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ZSTD_LEVEL 3
+
+struct Compressor {
+    Compression method;
+#ifdef HAVE_ZLIB
+    z_stream zs;    // reset after every block, so its tables are allocated once
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx* cctx;
+#endif
+};
+
+int compression_available(Compression method) {
+    switch (method) {
+        case COMPRESS_NONE: return 1;
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP: return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: return 1;
+#endif
+        default: return 0;
+    }
+}
+
+const char* compression_extension(Compression method) {
+    switch (method) {
+        case COMPRESS_GZIP: return ".gz";
+        case COMPRESS_ZSTD: return ".zst";
+        default: return "";
+    }
+}
+
+const char* compression_name(Compression method) {
+    switch (method) {
+        case COMPRESS_GZIP: return "gzip";
+        case COMPRESS_ZSTD: return "zstd";
+        default: return "none";
+    }
+}
+
+// Returns NULL if the method is not built in or cannot be initialized
+Compressor* compressor_create(Compression method) {
+    if (!compression_available(method) || method == COMPRESS_NONE) return NULL;
+    Compressor* c = calloc(1, sizeof(Compressor));
+    if (!c) {
+        fprintf(stderr, "Error: Memory allocation failed for compressor\n");
+        exit(1);
+    }
+    c->method = method;
+#ifdef HAVE_ZLIB
+    if (method == COMPRESS_GZIP) {
+        // windowBits 15 + 16 asks for a gzip wrapper instead of zlib's
+        if (deflateInit2(&c->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(c);
+            return NULL;
+        }
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (method == COMPRESS_ZSTD) {
+        c->cctx = ZSTD_createCCtx();
+        if (!c->cctx) {
+            free(c);
+            return NULL;
+        }
+    }
+#endif
+    return c;
+}
+
+// Largest output compressor_run can produce for len bytes of input
+size_t compressor_bound(Compressor* c, size_t len) {
+#ifdef HAVE_ZLIB
+    if (c->method == COMPRESS_GZIP) return deflateBound(&c->zs, len);
+#endif
+#ifdef HAVE_ZSTD
+    if (c->method == COMPRESS_ZSTD) return ZSTD_compressBound(len);
+#endif
+    return len;
+}
+
+// Compresses one block into out; returns the compressed size, or 0 if
+// compression failed (a gzip member or zstd frame is never empty)
+size_t compressor_run(Compressor* c, const char* data, size_t len, char* out, size_t cap) {
+#ifdef HAVE_ZLIB
+    if (c->method == COMPRESS_GZIP) {
+        c->zs.next_in = (Bytef*)data;
+        c->zs.avail_in = len;
+        c->zs.next_out = (Bytef*)out;
+        c->zs.avail_out = cap;
+        if (deflate(&c->zs, Z_FINISH) != Z_STREAM_END) {
+            deflateReset(&c->zs);
+            return 0;
+        }
+        size_t n = cap - c->zs.avail_out;
+        // Reset right away: deflateBound leaves out the gzip header and
+        // trailer on a finished stream
+        deflateReset(&c->zs);
+        return n;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (c->method == COMPRESS_ZSTD) {
+        size_t n = ZSTD_compressCCtx(c->cctx, out, cap, data, len, ZSTD_LEVEL);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    (void)data;
+    (void)len;
+    (void)out;
+    (void)cap;
+    return 0;
+}
+
+void compressor_free(Compressor* c) {
+    if (!c) return;
+#ifdef HAVE_ZLIB
+    if (c->method == COMPRESS_GZIP) deflateEnd(&c->zs);
+#endif
+#ifdef HAVE_ZSTD
+    if (c->method == COMPRESS_ZSTD) ZSTD_freeCCtx(c->cctx);
+#endif
+    free(c);
+}
@@ -0,0 +1,20 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include "json2relcsv.h"
+
+// Block compressor, one per thread. Each block becomes a complete gzip member
+// or zstd frame, so blocks can be compressed independently and concatenated
+// into one valid .gz or .zst file.
+typedef struct Compressor Compressor;
+
+int compression_available(Compression method);
+const char* compression_extension(Compression method);
+const char* compression_name(Compression method);
+Compressor* compressor_create(Compression method);
+size_t compressor_bound(Compressor* c, size_t len);
+size_t compressor_run(Compressor* c, const char* data, size_t len, char* out, size_t cap);
+void compressor_free(Compressor* c);
+
+#endif
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include "converter.h"
+#include "parser.tab.h"
+#include "simd_lexer.h"
+#include "compress.h"
+#include "batch.h"
+#include "split.h"
+#include "intern.h"
+#include "shard.h"
+#include "ast_cache.h"
+
+// Lexer used when none is picked in the options; build with
+// -DSIMD_LEXER_DEFAULT=1 to make the SIMD lexer the default
+#ifndef SIMD_LEXER_DEFAULT
+#define SIMD_LEXER_DEFAULT 0
+#endif
+
+void converter_default_options(ConverterOptions* options) {
+    memset(options, 0, sizeof(ConverterOptions));
+    options->out_dir = ".";
+    options->simd_lexer = SIMD_LEXER_DEFAULT;
+    options->flush_interval_ms = 1000;
+    options->flush_bytes = 1 << 20;
+}
+
+Converter* converter_create(const ConverterOptions* options) {
+    Converter* c = calloc(1, sizeof(Converter));
+    if (!c) {
+        fprintf(stderr, "Error: Memory allocation failed for converter\n");
+        exit(1);
+    }
+    c->options = *options;
+    c->output_dir = options->out_dir ? options->out_dir : ".";
+    pthread_rwlock_init(&c->catalog_lock, NULL);
+    pthread_mutex_init(&c->error_lock, NULL);
+    pthread_mutex_init(&c->stats.lock, NULL);
+    infer_init(c);
+    // --pipeline writes the files on their own threads, one unless --writers
+    int writer_threads = options->pipeline ? (options->writers ? options->writers : 1) : 0;
+    csv_pool_init(&c->writers, c, options->compression, writer_threads, options->shard_rows, options->shard_bytes,
+                  options->emit_index);
+    c->stream.root_id = 1;
+    c->wake_fd = -1;
+    intern_retain();
+    return c;
+}
+
+// Records the first error of the run; the threads working on it notice
+// through converter_failed and stop
+void converter_fail(Converter* c, ConvertStatus status, const char* format, ...) {
+    pthread_mutex_lock(&c->error_lock);
+    if (c->status == CONVERT_OK) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(c->error, sizeof(c->error), format, args);
+        va_end(args);
+        __atomic_store_n(&c->status, status, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&c->error_lock);
+}
+
+// Forgets an error that left nothing half-done, such as a --serve request
+// that did not parse, so the converter can go on
+void converter_clear_error(Converter* c) {
+    pthread_mutex_lock(&c->error_lock);
+    c->error[0] = '\0';
+    __atomic_store_n(&c->status, CONVERT_OK, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&c->error_lock);
+}
+
+void converter_stop(Converter* c) {
+    __atomic_store_n(&c->stopping, 1, __ATOMIC_RELEASE);
+    int fd = __atomic_load_n(&c->wake_fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0 && write(fd, "", 1) < 0) {
+        // The pipe is full, so the server is already being woken
+    }
+}
+
+// Checks the options against each other and the inputs, in the order the
+// command line always has, and resolves the modes they imply
+static int check_options(Converter* c, char** inputs, int num_inputs) {
+    ConverterOptions* o = &c->options;
+    if (!compression_available(o->compression)) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "json2relcsv was built without %s support", compression_name(o->compression));
+        return -1;
+    }
+    if (o->from_cache && num_inputs > 0) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--from-cache takes no input files");
+        return -1;
+    }
+    if (num_inputs == 0 && !o->from_cache) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "No input file provided");
+        return -1;
+    }
+    if (compile_selectors(c) != 0) return -1;
+    if (o->compression && o->format == FORMAT_ARROW) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--compress cannot be used with --format arrow");
+        return -1;
+    }
+    if (o->emit_index && (o->compression || o->format == FORMAT_ARROW)) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--emit-index cannot be used with --compress or --format arrow");
+        return -1;
+    }
+    if (o->writers && !o->pipeline) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--writers needs --pipeline");
+        return -1;
+    }
+    if (o->split_jobs && (o->ndjson || o->print_ast)) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--split cannot be used with --ndjson or --print-ast");
+        return -1;
+    }
+    if (manifest_enabled(c) && sharding_enabled(c)) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--append and --checkpoint cannot be used with --shard-rows or --shard-bytes");
+        return -1;
+    }
+    if (manifest_enabled(c) && o->emit_index) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--append and --checkpoint cannot be used with --emit-index");
+        return -1;
+    }
+    if (manifest_enabled(c) && (o->infer || o->format == FORMAT_ARROW)) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--append and --checkpoint cannot be used with --infer or --format arrow");
+        return -1;
+    }
+
+    // --pipeline and --split stream JSON input; NDJSON records are already
+    // handed off one by one
+    if (o->pipeline && !o->ndjson) o->stream = 1;
+    if (o->split_jobs) o->stream = 1;
+
+    if (o->checkpoint_interval && !o->stream && !o->ndjson) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--checkpoint needs --stream, --pipeline, --split or --ndjson");
+        return -1;
+    }
+    if (o->stream && o->print_ast) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--print-ast cannot be used with --stream");
+        return -1;
+    }
+    if (o->stream && o->ndjson) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--stream cannot be used with --ndjson");
+        return -1;
+    }
+    if (o->emit_cache || o->from_cache) {
+        if (o->emit_cache && o->from_cache) {
+            converter_fail(c, CONVERT_ERROR_OPTIONS, "--emit-cache cannot be used with --from-cache");
+            return -1;
+        }
+        if (o->stream || o->ndjson || o->jobs > 0 || num_inputs > 1 || (num_inputs == 1 && is_directory(inputs[0]))) {
+            converter_fail(c, CONVERT_ERROR_OPTIONS, "--emit-cache and --from-cache cannot be used with --stream, --pipeline, --split, --ndjson or batch input");
+            return -1;
+        }
+        if (manifest_enabled(c)) {
+            converter_fail(c, CONVERT_ERROR_OPTIONS, "--emit-cache and --from-cache cannot be used with --append or --checkpoint");
+            return -1;
+        }
+        if (o->from_cache && c->selectors.count > 0) {
+            converter_fail(c, CONVERT_ERROR_OPTIONS, "--include and --exclude cannot be used with --from-cache");
+            return -1;
+        }
+    }
+    if (o->jobs > 0 || num_inputs > 1 || (num_inputs == 1 && is_directory(inputs[0]))) {
+        if (o->stream || o->print_ast || o->pipeline) {
+            converter_fail(c, CONVERT_ERROR_OPTIONS, "--stream, --pipeline and --print-ast cannot be used with batch input");
+            return -1;
+        }
+        if (manifest_enabled(c)) {
+            converter_fail(c, CONVERT_ERROR_OPTIONS, "--append and --checkpoint cannot be used with batch input");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Converts a single input file, however it is read
+static void convert_file(Converter* c, const char* input_file) {
+    ConverterOptions* o = &c->options;
+
+    // --append picks up the tables of the previous run, and where it stopped
+    // if it was interrupted; from here on the manifest marks this run as
+    // under way
+    ResumePoint resume = { 0, 0 };
+    if (manifest_enabled(c)) {
+        if (begin_manifest(c, input_file, o->ndjson, &resume) != 0) return;
+        if (resume.offset && !o->ndjson) o->stream = 1;
+    }
+
+    // Rows are written during the parse
+    if (o->stream || o->ndjson) {
+        if (o->infer) stream_hold_rows(c, o->infer == INFER_FULL ? INT_MAX : INFER_SAMPLE_ROWS);
+        if (pipeline_start(c) != 0) return;
+    }
+
+    // A root array is cut into chunks at its top-level commas, which is also
+    // how a run interrupted inside it picks up again
+    if (!o->ndjson && (o->split_jobs || resume.offset)) {
+        if (split_root_array(c, input_file, o->split_jobs ? o->split_jobs : 1, resume.offset, resume.index)) {
+            stream_cleanup(c);
+            return;
+        }
+    }
+
+    SimdLexer* input;
+    ASTNode* root;
+    int status = parse_file(c, input_file, o->ndjson, resume.offset, &root, &input);
+
+    if (o->ndjson) {
+        stream_end(c);
+        simd_lexer_close(input);
+        return;
+    }
+
+    if (o->stream) {
+        // A failed parse still drains the rows already handed off
+        if (status == 0) stream_finish(c, root);
+        stream_end(c);
+        simd_lexer_close(input);
+        stream_cleanup(c);
+        return;
+    }
+
+    if (status != 0) return;
+    if (!o->emit_cache || save_ast_cache(c, root, o->emit_cache) == 0) {
+        if (o->print_ast) {
+            print_ast_node(root, 0);
+        }
+        generate_csv(c, root);
+    }
+    free_ast(root);
+    simd_lexer_close(input);
+}
+
+// --from-cache: converts a tree saved by --emit-cache, with no parse
+static void convert_cache(Converter* c) {
+    ASTNode* root;
+    AstCache* cache = load_ast_cache(c, c->options.from_cache, &root);
+    if (!cache) return;
+    if (c->options.print_ast) {
+        print_ast_node(root, 0);
+    }
+    generate_csv(c, root);
+    release_ast_cache(cache);
+}
+
+// Closes the output files, prints --stats and frees the tables. Runs that
+// keep a manifest record the finished catalog before it is freed; a failed
+// run leaves the manifest at its last checkpoint. Sharded runs list their
+// part files, unless they failed.
+void finish_tables(Converter* c) {
+    close_tables(c);
+    if (manifest_enabled(c) && !converter_failed(c)) save_manifest(c);
+    if (sharding_enabled(c) && !converter_failed(c)) save_shard_manifest(c);
+    if (converter_failed(c)) {
+        stats_thread_done(c);
+    } else {
+        stats_report(c);
+    }
+    cleanup_tables(c);
+}
+
+ConvertStatus converter_run(Converter* c, char** inputs, int num_inputs) {
+    if (c->ran) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "A converter runs only once");
+        return c->status;
+    }
+    c->ran = 1;
+    if (check_options(c, inputs, num_inputs) != 0) return c->status;
+
+    stats_start(c);
+    // Several inputs, a directory or --jobs all go through the worker pool
+    if (c->options.from_cache) {
+        convert_cache(c);
+    } else if (c->options.jobs > 0 || num_inputs > 1 || is_directory(inputs[0])) {
+        run_batch(c, inputs, num_inputs, c->options.jobs > 0 ? c->options.jobs : 1, c->options.ndjson);
+    } else {
+        convert_file(c, inputs[0]);
+    }
+    finish_tables(c);
+    return c->status;
+}
+
+// The message for the status converter_run returned; empty after success
+const char* converter_error(Converter* c) {
+    return c->error;
+}
+
+void converter_free(Converter* c) {
+    if (!c) return;
+    csv_pool_destroy(&c->writers);
+    csv_row_free(&c->shards);
+    free_selectors(&c->selectors);
+    pthread_rwlock_destroy(&c->catalog_lock);
+    pthread_mutex_destroy(&c->error_lock);
+    pthread_mutex_destroy(&c->stats.lock);
+    pthread_mutex_destroy(&c->infer.lock);
+    intern_release();
+    free(c);
+}
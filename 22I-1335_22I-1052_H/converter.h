@@ -0,0 +1,63 @@
+#ifndef CONVERTER_H
+#define CONVERTER_H
+
+#include <pthread.h>
+#include "json2relcsv.h"
+#include "ast.h"
+#include "schema.h"
+#include "infer.h"
+#include "csv_writer.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "manifest.h"
+#include "stats.h"
+#include "selector.h"
+
+// Everything one conversion owns. Created by converter_create; the modules
+// reach their own part through the Converter passed to them.
+struct Converter {
+    ConverterOptions options;   // resolved: --pipeline and --split imply stream
+    const char* output_dir;
+
+    // Tables, shared by every conversion thread. Lookups take the read lock;
+    // creating a table takes the write lock, which also covers the catalog.
+    Table** tables;
+    int num_tables;
+    int max_tables;
+    pthread_rwlock_t catalog_lock;
+    Catalog catalog;
+
+    InferState infer;
+    WriterPool writers;
+    StreamState stream;
+    Pipeline pipeline;
+    ManifestState manifest;
+    RunStats stats;
+    int ran;
+    int count_rows;     // count rows per table even without --stats
+    CsvRow shards;      // --shard-*: manifest entries of the files closed so far
+    Selectors selectors;    // --include/--exclude, compiled once
+
+    // --serve: set by converter_stop, which also writes to wake_fd (-1
+    // unless serving) so the server notices at once
+    int stopping;
+    int wake_fd;
+
+    // The first error wins; later ones are consequences of it
+    ConvertStatus status;
+    pthread_mutex_t error_lock;
+    char error[512];
+};
+
+void converter_fail(Converter* c, ConvertStatus status, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+void converter_clear_error(Converter* c);
+void finish_tables(Converter* c);
+
+// Checked by long-running loops, so every thread stops soon after an error
+static inline int converter_failed(Converter* c) {
+    return __atomic_load_n(&c->status, __ATOMIC_ACQUIRE) != CONVERT_OK;
+}
+
+#endif
@@ -1,43 +1,92 @@
 #include "ast.h"
+#include "converter.h"
+#include "schema.h"
+#include "infer.h"
+#include "csv_writer.h"
+#include "arrow_writer.h"
+#include "stats.h"
+#include "shard.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
-typedef struct {
+typedef struct Table {
     char* name;
     char** columns;
     int num_columns;
-    FILE* fp;
-    int next_id;
+    CsvWriter* out;
+    Shape* file;    // catalog entry of the name the table was created under, whose ids every table of that name takes atomically
+    int index;      // position in the registry
+    unsigned long long rows;    // counted only with --stats or --serve
+    unsigned long long bytes;
+    // Array tables: until a first element is seen the table is pending, with
+    // no file and the columns of a scalar array
+    int pending;
+    int* checked_order;         // an element key order found to match the columns
+    int misaligned;             // set once mismatched elements have been reported
+    // --infer only
+    TableSchema* schema;        // union schema the columns were built from
+    ColumnType* types;          // type of every column
+    int data_column;            // first column taken from the schema
+    int element_ids;            // array of objects: element rows carry their own id
+    struct ShapeColumns* shape_columns; // shape -> column map, by Shape pointer
+    int shape_capacity;
+    int num_shapes;
+    int dropped;                // set once dropped keys have been reported
 } Table;
 
-Table* tables[100];
-int num_tables = 0;
-char** key_sets = NULL;
-int* table_indices = NULL;
-int num_key_sets = 0;
-char* output_dir = ".";
-
-char* join_keys(char** keys, int count) {
-    int len = 0;
-    for (int i = 0; i < count; i++) len += (keys[i] ? strlen(keys[i]) : 0) + 1;
-    char* str = malloc(len + 1);
-    if (!str) {
-        fprintf(stderr, "Error: Memory allocation failed for join_keys\n");
-        exit(1);
-    }
-    str[0] = '\0';
-    for (int i = 0; i < count; i++) {
-        if (keys[i]) {
-            strcat(str, keys[i]);
-            if (i < count - 1) strcat(str, ",");
-        }
+// Where each sorted key of a shape lands in a table: columns[2 * i] for a
+// scalar value, columns[2 * i + 1] for a nested object, -1 if not in the schema
+typedef struct ShapeColumns {
+    Shape* shape;
+    int* columns;
+} ShapeColumns;
+
+// Each thread formats one row at a time here before appending it whole
+static __thread CsvRow row_buffer;
+
+// --infer: which key fills each column of the row being written
+static __thread int* cells = NULL;
+static __thread int cells_capacity = 0;
+
+// Appends a finished row to the table's file. Rows are counted for --stats
+// and for the per-request summaries of --serve. key is the row's first
+// column, which part files record the range of.
+static void write_row(Converter* c, Table* table, CsvRow* row, long key) {
+    if (stats_active || c->count_rows) {
+        __atomic_fetch_add(&table->rows, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&table->bytes, row->len, __ATOMIC_RELAXED);
     }
-    return str;
+    csv_write_row(table->out, row, key);
 }
 
-int compare_strings(const void* a, const void* b) {
-    return strcmp(*(char**)a, *(char**)b);
+// Adds a table to the registry, growing it as needed, and returns its index
+int register_table(Converter* c, Table* table) {
+    table->index = c->num_tables;
+    table->rows = 0;
+    table->bytes = 0;
+    table->pending = 0;
+    table->checked_order = NULL;
+    table->misaligned = 0;
+    table->schema = NULL;
+    table->types = NULL;
+    table->data_column = 0;
+    table->element_ids = 0;
+    table->shape_columns = NULL;
+    table->shape_capacity = 0;
+    table->num_shapes = 0;
+    table->dropped = 0;
+    if (c->num_tables == c->max_tables) {
+        c->max_tables = c->max_tables ? c->max_tables * 2 : 16;
+        c->tables = realloc(c->tables, c->max_tables * sizeof(Table*));
+        if (!c->tables) {
+            fprintf(stderr, "Error: Memory allocation failed for table registry\n");
+            exit(1);
+        }
+    }
+    c->tables[c->num_tables] = table;
+    return c->num_tables++;
 }
 
 int is_scalar(ASTNode* node) {
@@ -45,347 +94,1202 @@ int is_scalar(ASTNode* node) {
         fprintf(stderr, "Warning: Null node in is_scalar\n");
         return 0;
     }
-    // Check if node looks like a string pointer
-    char* ptr = (char*)node;
-    if (ptr[0] >= 32 && ptr[0] <= 126 && ptr[1] >= 32 && ptr[1] <= 126) {
-        fprintf(stderr, "Error: Invalid ASTNode in is_scalar, looks like string '%s'\n", ptr);
-        exit(1);
-    }
     return (node->type == STR || node->type == NUM || node->type == TRU || node->type == FALS || node->type == NUL);
 }
 
-char* value_to_string(ASTNode* node) {
+// Field writers for both formats: CSV text, or tagged spill records for
+// --format arrow, where separators are implied
+static void write_int(Converter* c, CsvRow* row, long value) {
+    if (c->options.format == FORMAT_ARROW) arrow_row_int(row, value);
+    else csv_row_int(row, value);
+}
+
+static void write_separator(Converter* c, CsvRow* row) {
+    if (c->options.format == FORMAT_CSV) csv_row_char(row, ',');
+}
+
+static void end_row(Converter* c, CsvRow* row) {
+    csv_row_char(row, c->options.format == FORMAT_ARROW ? ARROW_END : '\n');
+}
+
+// Writes a scalar field straight from the node, with no intermediate copy
+void write_value(Converter* c, CsvRow* row, ASTNode* node) {
     if (!node) {
-        fprintf(stderr, "Warning: Null node in value_to_string\n");
-        return strdup("");
+        fprintf(stderr, "Warning: Null node in write_value\n");
+        return;
     }
-    // Check if node looks like a string pointer
-    char* ptr = (char*)node;
-    if (ptr[0] >= 32 && ptr[0] <= 126 && ptr[1] >= 32 && ptr[1] <= 126) {
-        fprintf(stderr, "Error: Invalid ASTNode in value_to_string, looks like string '%s'\n", ptr);
-        exit(1);
+    if (c->options.format == FORMAT_ARROW) {
+        switch (node->type) {
+            case STR: arrow_row_text(row, ARROW_STRING, ast_text(node), node->count); break;
+            case NUM: arrow_row_text(row, ARROW_NUMBER, ast_text(node), node->count); break;
+            case TRU: arrow_row_tag(row, ARROW_TRUE); break;
+            case FALS: arrow_row_tag(row, ARROW_FALSE); break;
+            case NUL: arrow_row_tag(row, ARROW_NULL); break;
+            default:
+                fprintf(stderr, "Warning: Invalid node type in write_value\n");
+                break;
+        }
+        return;
     }
     switch (node->type) {
-        case STR: return strdup(node->data.string ? node->data.string : "");
-        case NUM: return strdup(node->data.string ? node->data.string : "");
-        case TRU: return strdup("true");
-        case FALS: return strdup("false");
-        case NUL: return strdup("");
+        case STR:
+            csv_row_field(row, ast_text(node), node->count);
+            break;
+        case NUM:
+            csv_row_raw(row, ast_text(node), node->count);
+            break;
+        case TRU: csv_row_raw(row, "true", 4); break;
+        case FALS: csv_row_raw(row, "false", 5); break;
+        case NUL: break;
         default:
-            fprintf(stderr, "Warning: Invalid node type in value_to_string\n");
-            return strdup("");
+            fprintf(stderr, "Warning: Invalid node type in write_value\n");
+            break;
     }
 }
 
-int process_object(ASTNode* object, char* parent_table, int parent_id, char* array_key, int seq);
+static void write_null(Converter* c, CsvRow* row) {
+    if (c->options.format == FORMAT_ARROW) arrow_row_tag(row, ARROW_NULL);
+}
 
-void process_array(ASTNode* array, char* parent_table, int parent_id, char* array_key) {
-    if (!array || array->type != ARR) {
-        fprintf(stderr, "Error: Invalid array node\n");
-        return;
+// --infer: strings are always quoted, which keeps them apart from numbers,
+// booleans and nulls, and anything in a string column is quoted whatever its
+// own type. Numbers and booleans in their own columns stay unquoted.
+static void write_typed(Converter* c, CsvRow* row, ASTNode* node, ColumnType type) {
+    if (c->options.format == FORMAT_ARROW || node->type == NUL) {
+        write_value(c, row, node);
+    } else if (node->type == STR || (node->type == NUM && type == COLUMN_STRING)) {
+        csv_row_quoted(row, ast_text(node), node->count);
+    } else if (type == COLUMN_STRING && node->type == TRU) {
+        csv_row_quoted(row, "true", 4);
+    } else if (type == COLUMN_STRING && node->type == FALS) {
+        csv_row_quoted(row, "false", 5);
+    } else {
+        write_value(c, row, node);
     }
-    if (!array_key) {
-        fprintf(stderr, "Warning: Null array_key, using default\n");
-        array_key = "array";
+}
+
+// Returns the path of a table's output file. With --format arrow, x.csv
+// becomes x.arrow, and rows are first collected in the spill file
+// x.arrow.spill, which is turned into x.arrow when the table is closed.
+// With --compress, x.csv becomes x.csv.gz or x.csv.zst. If stem is given, it
+// is set to the length of the path before the extension, where the part
+// numbers of --shard-rows and --shard-bytes go.
+static char* table_path(Converter* c, Table* table, int spill, size_t* stem) {
+    size_t name_len = strlen(table->name);
+    const char* extension = compression_extension(c->options.compression);
+    if (c->options.format == FORMAT_ARROW) {
+        if (name_len > 4 && strcmp(table->name + name_len - 4, ".csv") == 0) name_len -= 4;
+        extension = spill ? ".arrow.spill" : ".arrow";
     }
+    char* filepath = malloc(strlen(c->output_dir) + name_len + strlen(extension) + 2);
+    if (!filepath) {
+        fprintf(stderr, "Error: Memory allocation failed for filepath\n");
+        exit(1);
+    }
+    sprintf(filepath, "%s/%.*s%s", c->output_dir, (int)name_len, table->name, extension);
+    if (stem) {
+        *stem = strlen(c->output_dir) + 1 + name_len;
+        if (c->options.format == FORMAT_CSV && name_len > 4 && strcmp(table->name + name_len - 4, ".csv") == 0) *stem -= 4;
+    }
+    return filepath;
+}
 
-    char* table_name = malloc(strlen(array_key) + 5);
-    if (!table_name) {
-        fprintf(stderr, "Error: Memory allocation failed for table_name\n");
+static int same_columns(Table* a, Table* b) {
+    if (a->num_columns != b->num_columns) return 0;
+    for (int i = 0; i < a->num_columns; i++) {
+        if (strcmp(a->columns[i] ? a->columns[i] : "unknown", b->columns[i] ? b->columns[i] : "unknown") != 0) return 0;
+    }
+    return 1;
+}
+
+// Picks the file a table writes. Tables with the same header share a file,
+// but a table whose header differs from that of the table already writing
+// <stem>.csv moves on to <stem>_2.csv, <stem>_3.csv, ... Its ids still come
+// from table->file, so they stay unique across the split files and the
+// arrays under them can tell their parents apart. Needs exclusive access.
+static void claim_table_file(Converter* c, Table* table) {
+    char* base = table->name;
+    size_t len = strlen(base);
+    if (len > 4 && strcmp(base + len - 4, ".csv") == 0) len -= 4;
+    for (int n = 2; ; n++) {
+        Shape* file = lookup_table_file(&c->catalog, table->name);
+        if (file->table_index == -1) file->table_index = table->index;
+        Table* owner = c->tables[file->table_index];
+        if (owner == table || same_columns(owner, table)) break;
+        char* name = malloc(len + 16);
+        if (!name) {
+            fprintf(stderr, "Error: Memory allocation failed for table name\n");
+            exit(1);
+        }
+        sprintf(name, "%.*s_%d.csv", (int)len, base, n);
+        if (table->name != base) free(table->name);
+        table->name = name;
+    }
+    if (table->name != base) free(base);
+}
+
+// Opens a table's file and writes its header row
+void open_table_file(Converter* c, Table* table) {
+    claim_table_file(c, table);
+    size_t stem;
+    char* filepath = table_path(c, table, 1, &stem);
+
+    CsvRow header = { NULL, 0, 0 };
+    for (int i = 0; i < table->num_columns; i++) {
+        char* column = table->columns[i] ? table->columns[i] : "unknown";
+        if (c->options.format == FORMAT_ARROW) {
+            arrow_row_text(&header, ARROW_STRING, column, strlen(column));
+            continue;
+        }
+        if (i > 0) csv_row_char(&header, ',');
+        csv_row_field(&header, column, strlen(column));
+    }
+    end_row(c, &header);
+    table->out = csv_open(&c->writers, filepath, stem, &header); // header only lands if the file is new
+    csv_row_free(&header);
+    free(filepath);
+}
+
+// Names the column for a key (suffix "_id" for a nested object's reference).
+// A name already taken by an earlier column of the table, such as a key
+// "id" after the generated id, gets "_" appended until it is free.
+static char* column_name(char** columns, int count, const char* key, const char* suffix) {
+    size_t len = strlen(key) + strlen(suffix);
+    char* name = malloc(len + 1);
+    if (!name) {
+        fprintf(stderr, "Error: Memory allocation failed for columns\n");
         exit(1);
     }
-    sprintf(table_name, "%s.csv", array_key);
-    int table_index = num_tables++;
-    tables[table_index] = malloc(sizeof(Table));
-    if (!tables[table_index]) {
-        fprintf(stderr, "Error: Memory allocation failed for table\n");
+    sprintf(name, "%s%s", key, suffix);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(columns[i], name) != 0) continue;
+        name = realloc(name, ++len + 1);
+        if (!name) {
+            fprintf(stderr, "Error: Memory allocation failed for columns\n");
+            exit(1);
+        }
+        strcpy(name + len - 1, "_");
+        i = -1;     // the new name may match an earlier column
+    }
+    return name;
+}
+
+// --infer: names the parent key column after the parent table, main_id for
+// the root
+static char* parent_column(char* parent_table) {
+    if (!parent_table) return strdup("main_id");
+    size_t len = strlen(parent_table);
+    if (len > 4 && strcmp(parent_table + len - 4, ".csv") == 0) len -= 4;
+    char* column = malloc(len + 4);
+    if (!column) {
+        fprintf(stderr, "Error: Memory allocation failed for columns\n");
         exit(1);
     }
-    tables[table_index]->name = table_name;
-    tables[table_index]->next_id = 1;
+    sprintf(column, "%.*s_id", (int)len, parent_table);
+    return column;
+}
 
-    // Check if array contains scalars or objects
-    int is_scalar_array = 0;
-    if (array->data.array.count > 0 && array->data.array.elements && array->data.array.elements[0]) {
-        is_scalar_array = is_scalar(array->data.array.elements[0]);
+// --infer: builds a table's columns from its frozen union schema. Object
+// tables are id then the schema; array tables are parent_id,seq,id then the
+// schema, with a value column when scalars and objects are mixed, or
+// parent_id,index,value for arrays of scalars. The id of an element object
+// is what its own nested arrays refer to.
+static void create_inferred_table(Converter* c, Table* table, TableSchema* schema, char* parent_table) {
+    freeze_schema(c, schema);
+    table->schema = schema;
+    table->name = strdup(schema->name);
+    if (!table->name) {
+        fprintf(stderr, "Error: Memory allocation failed for table name\n");
+        exit(1);
     }
+    table->file = lookup_table_file(&c->catalog, table->name);
 
-    if (array->data.array.count == 0 || is_scalar_array) {
-        tables[table_index]->columns = malloc(3 * sizeof(char*));
-        if (!tables[table_index]->columns) {
+    int prefix = 1;
+    if (schema->is_array) prefix = schema->has_objects ? (schema->has_scalars ? 4 : 3) : 3;
+    int col_count = prefix + (schema->is_array && !schema->has_objects ? 0 : schema->num_columns);
+    table->columns = malloc(col_count * sizeof(char*));
+    table->types = malloc(col_count * sizeof(ColumnType));
+    if (!table->columns || !table->types) {
+        fprintf(stderr, "Error: Memory allocation failed for columns\n");
+        exit(1);
+    }
+    if (schema->is_array) {
+        table->columns[0] = parent_column(parent_table);
+        table->columns[1] = strdup(schema->has_objects ? "seq" : "index");
+        table->types[0] = table->types[1] = COLUMN_INT;
+        if (schema->has_objects) {
+            table->columns[2] = strdup("id");
+            table->types[2] = COLUMN_INT;
+            table->element_ids = 1;
+        }
+        if (schema->has_scalars || !schema->has_objects) {
+            table->columns[prefix - 1] = strdup("value");
+            table->types[prefix - 1] = schema->value_type;
+        }
+    } else {
+        table->columns[0] = strdup("id");
+        table->types[0] = COLUMN_INT;
+    }
+    table->data_column = prefix;
+    for (int i = prefix; i < col_count; i++) {
+        Column* column = &schema->columns[i - prefix];
+        table->columns[i] = column_name(table->columns, i, column->key, column->is_ref ? "_id" : "");
+        table->types[i] = column->type;
+    }
+    for (int i = 0; i < col_count; i++) {
+        if (!table->columns[i]) {
+            fprintf(stderr, "Error: Memory allocation failed for columns\n");
+            exit(1);
+        }
+    }
+    table->num_columns = col_count;
+    open_table_file(c, table);
+}
+
+static Table* inferred_array_table(Converter* c, ASTNode* first, char* parent_table, char* table_name) {
+    pthread_rwlock_rdlock(&c->catalog_lock);
+    TableSchema* schema = find_table_schema(c, table_name, 1);
+    Table* table = schema && schema->table_index != -1 ? c->tables[schema->table_index] : NULL;
+    pthread_rwlock_unlock(&c->catalog_lock);
+    if (table) {
+        free(table_name);
+        return table;
+    }
+
+    pthread_rwlock_wrlock(&c->catalog_lock);
+    schema = lookup_table_schema(c, table_name, 1);
+    if (schema->table_index == -1) {
+        infer_creating_node(c, schema, first);
+        table = malloc(sizeof(Table));
+        if (!table) {
+            fprintf(stderr, "Error: Memory allocation failed for table\n");
+            exit(1);
+        }
+        schema->table_index = register_table(c, table);
+        create_inferred_table(c, table, schema, parent_table);
+    }
+    table = c->tables[schema->table_index];
+    pthread_rwlock_unlock(&c->catalog_lock);
+    free(table_name);
+    return table;
+}
+
+// Sets an array table's columns: parent,index,value for scalars (or no
+// element yet), parent,seq,id then the first element's keys for objects.
+// The id is what the element's own nested arrays refer to.
+static void set_array_columns(Converter* c, Table* table, ASTNode* first, char* parent_table) {
+    for (int i = 0; i < table->num_columns; i++) free(table->columns[i]);
+    free(table->columns);
+
+    // Check if array contains scalars or objects
+    int is_scalar_array = first ? is_scalar(first) : 0;
+
+    if (!first || is_scalar_array) {
+        table->columns = malloc(3 * sizeof(char*));
+        if (!table->columns) {
             fprintf(stderr, "Error: Memory allocation failed for columns\n");
             exit(1);
         }
-        tables[table_index]->columns[0] = strdup(parent_table ? parent_table : "main_id");
-        tables[table_index]->columns[1] = strdup("index");
-        tables[table_index]->columns[2] = strdup("value");
-        tables[table_index]->num_columns = 3;
+        table->columns[0] = strdup(parent_table ? parent_table : "main_id");
+        table->columns[1] = strdup("index");
+        table->columns[2] = strdup("value");
+        table->num_columns = 3;
     } else {
-        ASTNode* first = (array->data.array.count > 0 && array->data.array.elements) ? array->data.array.elements[0] : NULL;
-        int col_count = 2; // parent_id and seq
-        if (first && first->type == OBJ) {
-            for (int i = 0; i < first->data.object.count; i++) {
-                if (first->data.object.values[i] && is_scalar(first->data.object.values[i])) col_count++;
-                else if (first->data.object.values[i] && first->data.object.values[i]->type == OBJ) col_count++;
+        int col_count = 3; // parent_id, seq and id
+        if (first->type == OBJ) {
+            ASTNode* values = ast_children(first);
+            for (uint32_t i = 0; i < first->count; i++) {
+                if (is_scalar(&values[i])) col_count++;
+                else if (values[i].type == OBJ) col_count++;
             }
         }
-        tables[table_index]->columns = malloc(col_count * sizeof(char*));
-        if (!tables[table_index]->columns) {
+        table->columns = malloc(col_count * sizeof(char*));
+        if (!table->columns) {
             fprintf(stderr, "Error: Memory allocation failed for columns\n");
             exit(1);
         }
-        tables[table_index]->columns[0] = strdup(parent_table ? parent_table : "main_id");
-        tables[table_index]->columns[1] = strdup("seq");
-        int col_idx = 2;
-        if (first && first->type == OBJ) {
-            for (int i = 0; i < first->data.object.count; i++) {
-                if (first->data.object.values[i] && is_scalar(first->data.object.values[i])) {
-                    tables[table_index]->columns[col_idx++] = strdup(first->data.object.keys[i] ? first->data.object.keys[i] : "unknown");
-                } else if (first->data.object.values[i] && first->data.object.values[i]->type == OBJ) {
-                    char* fk = malloc(strlen(first->data.object.keys[i] ? first->data.object.keys[i] : "unknown") + 4);
-                    if (!fk) {
-                        fprintf(stderr, "Error: Memory allocation failed for foreign key\n");
-                        exit(1);
-                    }
-                    sprintf(fk, "%s_id", first->data.object.keys[i] ? first->data.object.keys[i] : "unknown");
-                    tables[table_index]->columns[col_idx++] = fk;
+        table->columns[0] = strdup(parent_table ? parent_table : "main_id");
+        table->columns[1] = strdup("seq");
+        table->columns[2] = strdup("id");
+        int col_idx = 3;
+        if (first->type == OBJ && first->count > 0) {
+            // Same sorted key order that process_object writes rows in
+            char** keys = ast_keys(first);
+            int* order = lookup_shape(&c->catalog, keys, first->count)->order;
+            for (uint32_t i = 0; i < first->count; i++) {
+                ASTNode* value = &ast_children(first)[order[i]];
+                char* key = keys[order[i]] ? keys[order[i]] : "unknown";
+                if (is_scalar(value) || value->type == OBJ) {
+                    table->columns[col_idx] = column_name(table->columns, col_idx, key, value->type == OBJ ? "_id" : "");
+                    col_idx++;
                 }
             }
         }
-        tables[table_index]->num_columns = col_idx;
+        table->num_columns = col_idx;
     }
+}
 
-    char* filepath = malloc(strlen(output_dir) + strlen(table_name) + 2);
-    if (!filepath) {
-        fprintf(stderr, "Error: Memory allocation failed for filepath\n");
-        exit(1);
+// Returns the table for an array, creating it the first time the key is
+// seen. Its columns come from the first element; a table first seen empty
+// stays pending until an array with elements comes along, or is written
+// with the scalar header when the tables are closed.
+Table* create_array_table(Converter* c, ASTNode* first, char* parent_table, char* array_key) {
+    if (!array_key) {
+        fprintf(stderr, "Warning: Null array_key, using default\n");
+        array_key = "array";
     }
-    sprintf(filepath, "%s/%s", output_dir, table_name);
-    tables[table_index]->fp = fopen(filepath, "w");
-    if (!tables[table_index]->fp) {
-        fprintf(stderr, "Error: Cannot open file %s\n", filepath);
+
+    char* table_name = malloc(strlen(array_key) + 5);
+    if (!table_name) {
+        fprintf(stderr, "Error: Memory allocation failed for table_name\n");
         exit(1);
     }
-    free(filepath);
+    sprintf(table_name, "%s.csv", array_key);
+    if (c->options.infer) return inferred_array_table(c, first, parent_table, table_name);
 
-    for (int i = 0; i < tables[table_index]->num_columns; i++) {
-        fprintf(tables[table_index]->fp, "%s", tables[table_index]->columns[i] ? tables[table_index]->columns[i] : "unknown");
-        if (i < tables[table_index]->num_columns - 1) fprintf(tables[table_index]->fp, ",");
+    pthread_rwlock_rdlock(&c->catalog_lock);
+    Shape* catalog_entry = find_array_table(&c->catalog, table_name);
+    Table* existing = catalog_entry && catalog_entry->table_index != -1 ? c->tables[catalog_entry->table_index] : NULL;
+    pthread_rwlock_unlock(&c->catalog_lock);
+    if (existing && (!first || !__atomic_load_n(&existing->pending, __ATOMIC_ACQUIRE))) {
+        free(table_name);
+        return existing;
     }
-    fprintf(tables[table_index]->fp, "\n");
 
-    for (int i = 0; i < array->data.array.count; i++) {
-        if (!array->data.array.elements || !array->data.array.elements[i]) {
-            fprintf(stderr, "Warning: Skipping null element at index %d\n", i);
-            continue;
-        }
-        // Check if the pointer looks like a string
-        char* ptr = (char*)array->data.array.elements[i];
-        if (ptr[0] >= 32 && ptr[0] <= 126 && ptr[1] >= 32 && ptr[1] <= 126) {
-            fprintf(stderr, "Error: Invalid ASTNode at array index %d, looks like string '%s'\n", i, ptr);
+    pthread_rwlock_wrlock(&c->catalog_lock);
+    catalog_entry = lookup_array_table(&c->catalog, table_name);
+    Table* table;
+    if (catalog_entry->table_index != -1) {
+        // Pending, or another thread created it in the meantime
+        table = c->tables[catalog_entry->table_index];
+        free(table_name);
+    } else {
+        table = malloc(sizeof(Table));
+        if (!table) {
+            fprintf(stderr, "Error: Memory allocation failed for table\n");
             exit(1);
         }
-        if (is_scalar(array->data.array.elements[i])) {
-            char* val = value_to_string(array->data.array.elements[i]);
-            fprintf(tables[table_index]->fp, "%d,%d,\"%s\"\n", parent_id, i, val ? val : "");
-            if (val) free(val);
-        } else if (array->data.array.elements[i]->type == OBJ) {
-            process_object(array->data.array.elements[i], table_name, parent_id, array_key, i);
-        } else {
-            fprintf(stderr, "Warning: Skipping invalid element at index %d\n", i);
-        }
+        catalog_entry->table_index = register_table(c, table);
+        table->name = table_name;
+        table->file = lookup_table_file(&c->catalog, table_name);
+        table->columns = NULL;
+        table->num_columns = 0;
+        table->out = NULL;
+        set_array_columns(c, table, NULL, parent_table);
+        table->pending = 1;
+    }
+    if (first && table->pending) {
+        set_array_columns(c, table, first, parent_table);
+        open_table_file(c, table);
+        __atomic_store_n(&table->pending, 0, __ATOMIC_RELEASE);
     }
+    pthread_rwlock_unlock(&c->catalog_lock);
+    return table;
 }
 
-int process_object(ASTNode* object, char* parent_table, int parent_id, char* array_key, int seq) {
-    if (!object || object->type != OBJ) {
-        fprintf(stderr, "Error: Invalid object node\n");
-        return 0;
+// Creates the table for an object's key set, with columns in sorted key order
+void create_object_table(Converter* c, Table* table, ASTNode* object, int* order, char* name) {
+    char** keys = ast_keys(object);
+    int num_keys = object->count;
+    table->name = strdup(name);
+    if (!table->name) {
+        fprintf(stderr, "Error: Memory allocation failed for table name\n");
+        exit(1);
     }
+    table->file = lookup_table_file(&c->catalog, table->name);
 
-    char** keys = object->data.object.keys;
-    int num_keys = object->data.object.count;
-    if (!keys || num_keys <= 0) {
-        fprintf(stderr, "Warning: Empty or invalid object\n");
-        return 0;
+    int col_count = 1; // id
+    for (int i = 0; i < num_keys; i++) {
+        ASTNode* value = &ast_children(object)[order[i]];
+        if (is_scalar(value)) col_count++;
+        else if (value->type == OBJ) col_count++;
+    }
+    table->columns = malloc(col_count * sizeof(char*));
+    if (!table->columns) {
+        fprintf(stderr, "Error: Memory allocation failed for columns\n");
+        exit(1);
+    }
+    table->columns[0] = strdup("id");
+    int col_idx = 1;
+    for (int i = 0; i < num_keys; i++) {
+        ASTNode* value = &ast_children(object)[order[i]];
+        char* key = keys[order[i]] ? keys[order[i]] : "unknown";
+        if (is_scalar(value) || value->type == OBJ) {
+            table->columns[col_idx] = column_name(table->columns, col_idx, key, value->type == OBJ ? "_id" : "");
+            col_idx++;
+        }
     }
+    table->num_columns = col_idx;
 
-    qsort(keys, num_keys, sizeof(char*), compare_strings);
-    char* key_set = join_keys(keys, num_keys);
+    open_table_file(c, table);
+}
 
-    int table_index = -1;
-    for (int i = 0; i < num_key_sets; i++) {
-        if (key_sets[i] && key_set && strcmp(key_sets[i], key_set) == 0) {
-            table_index = table_indices[i];
-            break;
-        }
+static int* find_shape_columns(Table* table, Shape* shape) {
+    if (table->shape_capacity == 0) return NULL;
+    int slot = ((unsigned long)shape >> 4) & (table->shape_capacity - 1);
+    while (table->shape_columns[slot].shape) {
+        if (table->shape_columns[slot].shape == shape) return table->shape_columns[slot].columns;
+        slot = (slot + 1) & (table->shape_capacity - 1);
     }
+    return NULL;
+}
 
-    if (table_index == -1) {
-        table_index = num_tables++;
-        tables[table_index] = malloc(sizeof(Table));
-        if (!tables[table_index]) {
-            fprintf(stderr, "Error: Memory allocation failed for table\n");
+static void insert_shape_columns(Table* table, Shape* shape, int* columns) {
+    if ((table->num_shapes + 1) * 2 > table->shape_capacity) {
+        int old_capacity = table->shape_capacity;
+        ShapeColumns* old = table->shape_columns;
+        table->shape_capacity = old_capacity ? old_capacity * 2 : 8;
+        table->shape_columns = calloc(table->shape_capacity, sizeof(ShapeColumns));
+        if (!table->shape_columns) {
+            fprintf(stderr, "Error: Memory allocation failed for shape columns\n");
             exit(1);
         }
-        tables[table_index]->name = parent_table ? strdup(parent_table) : strdup("main.csv");
-        tables[table_index]->next_id = 1;
-
-        int col_count = 1; // id
-        for (int i = 0; i < num_keys; i++) {
-            if (object->data.object.values[i] && is_scalar(object->data.object.values[i])) col_count++;
-            else if (object->data.object.values[i] && object->data.object.values[i]->type == OBJ) col_count++;
+        table->num_shapes = 0;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i].shape) insert_shape_columns(table, old[i].shape, old[i].columns);
         }
-        tables[table_index]->columns = malloc(col_count * sizeof(char*));
-        if (!tables[table_index]->columns) {
-            fprintf(stderr, "Error: Memory allocation failed for columns\n");
+        free(old);
+    }
+    int slot = ((unsigned long)shape >> 4) & (table->shape_capacity - 1);
+    while (table->shape_columns[slot].shape) slot = (slot + 1) & (table->shape_capacity - 1);
+    table->shape_columns[slot].shape = shape;
+    table->shape_columns[slot].columns = columns;
+    table->num_shapes++;
+}
+
+// Maps a shape's sorted keys onto a table's columns; needs the write lock
+static int* shape_columns(Table* table, Shape* shape) {
+    int* columns = find_shape_columns(table, shape);
+    if (columns) return columns;
+    columns = malloc((2 * shape->count + 1) * sizeof(int));
+    if (!columns) {
+        fprintf(stderr, "Error: Memory allocation failed for shape columns\n");
+        exit(1);
+    }
+    for (int i = 0; i < shape->count; i++) {
+        char* key = shape->keys[shape->order[i]];
+        int scalar = schema_column(table->schema, key, 0);
+        int ref = schema_column(table->schema, key, 1);
+        columns[2 * i] = scalar < 0 ? -1 : table->data_column + scalar;
+        columns[2 * i + 1] = ref < 0 ? -1 : table->data_column + ref;
+    }
+    insert_shape_columns(table, shape, columns);
+    return columns;
+}
+
+// --infer: objects go to the table named after the key they are stored
+// under, or to their array's table, whatever their key set; columns maps
+// their members onto its union schema
+static Table* inferred_object_table(Converter* c, ASTNode* object, Table* parent, char* key, int** order, int** columns) {
+    char** keys = ast_keys(object);
+    int num_keys = object->count;
+    char* name = NULL;
+    if (!parent) {
+        name = malloc(strlen(key ? key : "main") + 5);
+        if (!name) {
+            fprintf(stderr, "Error: Memory allocation failed for table_name\n");
             exit(1);
         }
-        tables[table_index]->columns[0] = strdup("id");
-        int col_idx = 1;
-        for (int i = 0; i < num_keys; i++) {
-            if (object->data.object.values[i] && is_scalar(object->data.object.values[i])) {
-                tables[table_index]->columns[col_idx++] = strdup(keys[i] ? keys[i] : "unknown");
-            } else if (object->data.object.values[i] && object->data.object.values[i]->type == OBJ) {
-                char* fk = malloc(strlen(keys[i] ? keys[i] : "unknown") + 4);
-                if (!fk) {
-                    fprintf(stderr, "Error: Memory allocation failed for foreign key\n");
+        sprintf(name, "%s.csv", key ? key : "main");
+    }
+
+    pthread_rwlock_rdlock(&c->catalog_lock);
+    Shape* shape = find_shape(&c->catalog, keys, num_keys);
+    Table* table = parent;
+    if (!table) {
+        TableSchema* schema = find_table_schema(c, name, 0);
+        table = schema && schema->table_index != -1 ? c->tables[schema->table_index] : NULL;
+    }
+    int* map = shape && table ? find_shape_columns(table, shape) : NULL;
+    pthread_rwlock_unlock(&c->catalog_lock);
+
+    if (!map) {
+        pthread_rwlock_wrlock(&c->catalog_lock);
+        shape = lookup_shape(&c->catalog, keys, num_keys);
+        if (!table) {
+            TableSchema* schema = lookup_table_schema(c, name, 0);
+            if (schema->table_index == -1) {
+                infer_creating_node(c, schema, object);
+                Table* created = malloc(sizeof(Table));
+                if (!created) {
+                    fprintf(stderr, "Error: Memory allocation failed for table\n");
                     exit(1);
                 }
-                sprintf(fk, "%s_id", keys[i] ? keys[i] : "unknown");
-                tables[table_index]->columns[col_idx++] = fk;
+                schema->table_index = register_table(c, created);
+                create_inferred_table(c, created, schema, NULL);
             }
+            table = c->tables[schema->table_index];
+        }
+        map = shape_columns(table, shape);
+        pthread_rwlock_unlock(&c->catalog_lock);
+    }
+    free(name);
+    *order = shape->order;
+    *columns = map;
+    return table;
+}
+
+// Finds (or creates) the table for an object's key set under its member key
+// (NULL for the root), and the sorted order its members are written in;
+// elements of an array of objects (parent set) go to the array's table. With
+// --infer, also how they map onto columns.
+Table* object_table(Converter* c, ASTNode* object, Table* parent, char* key, int** order, int** columns) {
+    char** keys = ast_keys(object);
+    int num_keys = object->count;
+    if (c->options.infer) return inferred_object_table(c, object, parent, key, order, columns);
+    *columns = NULL;
+
+    // A shape remembers the table it was last placed in, and for which key
+    pthread_rwlock_rdlock(&c->catalog_lock);
+    Shape* shape = find_shape(&c->catalog, keys, num_keys);
+    Table* table = NULL;
+    if (shape && !parent) {
+        int index = shape->table_key == key ? shape->table_index : -1;
+        if (index == -1) {
+            Shape* key_set = find_key_set(&c->catalog, shape, key);
+            if (key_set) index = key_set->table_index;
+        }
+        if (index != -1) table = c->tables[index];
+    }
+    pthread_rwlock_unlock(&c->catalog_lock);
+    if (parent) {
+        // Elements of an array of objects are rows of the array's table and
+        // need no table of their own, only the order of their keys
+        if (!shape) {
+            pthread_rwlock_wrlock(&c->catalog_lock);
+            shape = lookup_shape(&c->catalog, keys, num_keys);
+            pthread_rwlock_unlock(&c->catalog_lock);
         }
-        tables[table_index]->num_columns = col_idx;
+        *order = shape->order;
+        return parent;
+    }
+    if (table) {
+        *order = shape->order;
+        return table;
+    }
 
-        char* filepath = malloc(strlen(output_dir) + strlen(tables[table_index]->name) + 2);
-        if (!filepath) {
-            fprintf(stderr, "Error: Memory allocation failed for filepath\n");
+    pthread_rwlock_wrlock(&c->catalog_lock);
+    shape = lookup_shape(&c->catalog, keys, num_keys);
+    Shape* key_set = lookup_key_set(&c->catalog, shape, key);
+    if (key_set->table_index == -1) {
+        table = malloc(sizeof(Table));
+        if (!table) {
+            fprintf(stderr, "Error: Memory allocation failed for table\n");
             exit(1);
         }
-        sprintf(filepath, "%s/%s", output_dir, tables[table_index]->name);
-        tables[table_index]->fp = fopen(filepath, "w");
-        if (!tables[table_index]->fp) {
-            fprintf(stderr, "Error: Cannot open file %s\n", filepath);
+        key_set->table_index = register_table(c, table);
+        char* name = malloc(strlen(key ? key : "main") + 5);
+        if (!name) {
+            fprintf(stderr, "Error: Memory allocation failed for table_name\n");
             exit(1);
         }
-        free(filepath);
+        sprintf(name, "%s.csv", key ? key : "main");
+        create_object_table(c, table, object, shape->order, name);
+        free(name);
+    }
+    shape->table_index = key_set->table_index;
+    shape->table_key = key;
+    table = c->tables[shape->table_index];
+    *order = shape->order;
+    pthread_rwlock_unlock(&c->catalog_lock);
+    return table;
+}
+
+// Generation walks the tree with an explicit work stack instead of recursing,
+// so nesting depth is bounded by heap rather than C stack. An object is
+// visited in three steps: nested objects first (so its row stays contiguous
+// even when a child lands in the same table), then its own row, then its
+// arrays. Each thread keeps its own stack, reused between documents.
+typedef enum {
+    VISIT_CHILDREN,
+    VISIT_ROW,
+    VISIT_ARRAYS
+} VisitStep;
+
+typedef struct {
+    ASTNode* node;
+    int is_array;
+    VisitStep step;
+    int next;           // next member or element to look at
+    Table* table;       // the object's own table, or the array's table
+    Table* parent;      // array table an object's row goes to, if any
+    int parent_id;
+    int seq;
+    int id;
+    char* key;
+    int* order;
+    int* columns;       // --infer: see ShapeColumns
+    int ids_base;       // this object's child ids start here in child_ids
+    int result_slot;    // where the parent wants this object's id, or -1
+    int streamed;       // the id was reserved and the arrays written while streaming
+} Visit;
 
-        for (int i = 0; i < col_count; i++) {
-            fprintf(tables[table_index]->fp, "%s", tables[table_index]->columns[i] ? tables[table_index]->columns[i] : "unknown");
-            if (i < col_count - 1) fprintf(tables[table_index]->fp, ",");
+typedef struct {
+    Visit* visits;
+    int count;
+    int capacity;
+    int* child_ids;
+    int num_ids;
+    int ids_capacity;
+} WorkStack;
+
+static __thread WorkStack work;
+
+static Visit* push_visit() {
+    if (work.count == work.capacity) {
+        work.capacity = work.capacity ? work.capacity * 2 : 64;
+        work.visits = realloc(work.visits, work.capacity * sizeof(Visit));
+        if (!work.visits) {
+            fprintf(stderr, "Error: Memory allocation failed for work stack\n");
+            exit(1);
         }
-        fprintf(tables[table_index]->fp, "\n");
+    }
+    return &work.visits[work.count++];
+}
 
-        key_sets = realloc(key_sets, (num_key_sets + 1) * sizeof(char*));
-        table_indices = realloc(table_indices, (num_key_sets + 1) * sizeof(int));
-        if (!key_sets || !table_indices) {
-            fprintf(stderr, "Error: Memory allocation failed for key_sets/table_indices\n");
+// Reserves n child id slots; released when the object's visit is popped
+static int reserve_ids(int n) {
+    if (work.num_ids + n > work.ids_capacity) {
+        while (work.num_ids + n > work.ids_capacity) {
+            work.ids_capacity = work.ids_capacity ? work.ids_capacity * 2 : 256;
+        }
+        work.child_ids = realloc(work.child_ids, work.ids_capacity * sizeof(int));
+        if (!work.child_ids) {
+            fprintf(stderr, "Error: Memory allocation failed for child ids\n");
             exit(1);
         }
-        key_sets[num_key_sets] = key_set;
-        table_indices[num_key_sets] = table_index;
-        num_key_sets++;
+    }
+    int base = work.num_ids;
+    work.num_ids += n;
+    return base;
+}
+
+// Starts visiting an object. key is the member or array key it appeared
+// under (NULL for the root) and names a new table. Elements of an array of
+// objects (parent set) are written to the parent's file as parent_id,seq,id,...
+// rows. Returns 0 (after storing id 0 in result_slot) if there is nothing to
+// write. A non-zero streamed_id is the object's id, reserved while its
+// arrays were streamed.
+static int push_object(Converter* c, ASTNode* object, Table* parent, int parent_id, char* key, int seq, int streamed_id, int result_slot) {
+    if (result_slot >= 0) work.child_ids[result_slot] = 0;
+    if (!object || object->type != OBJ) {
+        fprintf(stderr, "Error: Invalid object node\n");
+        return 0;
+    }
+    if (object->count == 0) {
+        // Selectors empty the elements that hold nothing selected
+        if (c->selectors.count == 0) fprintf(stderr, "Warning: Empty or invalid object\n");
+        return 0;
+    }
+
+    int* order;
+    int* columns;
+    Table* table = object_table(c, object, parent, key, &order, &columns);
+    int id = streamed_id ? streamed_id : __atomic_fetch_add(&table->file->next_id, 1, __ATOMIC_RELAXED);
+    int ids_base = reserve_ids(object->count);
+
+    Visit* visit = push_visit();
+    visit->node = object;
+    visit->is_array = 0;
+    visit->step = VISIT_CHILDREN;
+    visit->next = 0;
+    visit->table = table;
+    visit->parent = parent;
+    visit->parent_id = parent_id;
+    visit->seq = seq;
+    visit->id = id;
+    visit->key = key;
+    visit->order = order;
+    visit->columns = columns;
+    visit->ids_base = ids_base;
+    visit->result_slot = result_slot;
+    visit->streamed = streamed_id != 0;
+    return 1;
+}
+
+static int push_array(Converter* c, ASTNode* array, char* parent_table, int parent_id, char* array_key) {
+    if (!array || array->type != ARR) {
+        fprintf(stderr, "Error: Invalid array node\n");
+        return 0;
+    }
+    ASTNode* first = array->count > 0 ? ast_children(array) : NULL;
+    Table* table = create_array_table(c, first, parent_table, array_key);
+
+    Visit* visit = push_visit();
+    visit->node = array;
+    visit->is_array = 1;
+    visit->next = 0;
+    visit->table = table;
+    visit->parent_id = parent_id;
+    visit->key = array_key;
+    visit->result_slot = -1;
+    return 1;
+}
+
+// Reports rows that do not fit the columns of their table, once per table:
+// elements of an array table that differ from its first element, or objects
+// of one key set that hold arrays under other members than the first
+static void report_misaligned(Table* table, int elements) {
+    if (__atomic_exchange_n(&table->misaligned, 1, __ATOMIC_RELAXED)) return;
+    if (elements) {
+        fprintf(stderr, "Warning: Elements of %s differ from its first element, so their rows do not match its header; --infer gives them one schema\n", table->name);
+    } else {
+        fprintf(stderr, "Warning: Objects in %s differ from its first object in which members hold arrays, so their rows do not match its header; --infer gives them one schema\n", table->name);
+    }
+}
+
+// Checks an object element's keys against the columns its array table took
+// from the first element. Once a key order has matched, later elements with
+// it are not checked again.
+static void check_element_columns(Table* table, ASTNode* object, int* order) {
+    if (__atomic_load_n(&table->misaligned, __ATOMIC_RELAXED) || __atomic_load_n(&table->checked_order, __ATOMIC_RELAXED) == order) return;
+    char** keys = ast_keys(object);
+    int col = 3;
+    int match = strcmp(table->columns[1], "seq") == 0 && table->num_columns > 2 && strcmp(table->columns[2], "id") == 0;
+    for (uint32_t i = 0; match && i < object->count; i++) {
+        ASTNode* value = &ast_children(object)[order[i]];
+        if (!is_scalar(value) && value->type != OBJ) continue;
+        char* key = keys[order[i]] ? keys[order[i]] : "unknown";
+        if (col < table->num_columns) {
+            // Named as set_array_columns names them, given the columns so far
+            char* name = column_name(table->columns, col, key, value->type == OBJ ? "_id" : "");
+            match = strcmp(table->columns[col], name) == 0;
+            free(name);
+        } else {
+            match = 0;
+        }
+        col++;
+    }
+    if (match && col == table->num_columns) __atomic_store_n(&table->checked_order, order, __ATOMIC_RELAXED);
+    else report_misaligned(table, 1);
+}
+
+// Reports keys left out of a frozen schema, once per table
+static void report_dropped(Table* table) {
+    if (!__atomic_exchange_n(&table->dropped, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "Warning: Dropping keys outside the inferred schema of %s\n", table->name);
+    }
+}
+
+static void write_scalar_element(Converter* c, Table* table, ASTNode* element, int parent_id, int index) {
+    CsvRow* row = &row_buffer;
+    write_int(c, row, parent_id);
+    write_separator(c, row);
+    write_int(c, row, index);
+    write_separator(c, row);
+    if (table->types) {
+        // --infer: the value column, and nulls for the id and any object
+        // members. A frozen schema of objects only has no value column.
+        int value_column = table->data_column - 1;
+        if (value_column < 2 + table->element_ids) {
+            report_dropped(table);
+            value_column = -1;
+        }
+        for (int i = 2; i < table->num_columns; i++) {
+            if (i > 2) write_separator(c, row);
+            if (i == value_column) write_typed(c, row, element, table->types[i]);
+            else write_null(c, row);
+        }
     } else {
-        free(key_set);
+        if (strcmp(table->columns[1], "index") != 0) report_misaligned(table, 1);   // a scalar among objects
+        write_value(c, row, element);
     }
+    end_row(c, row);
+    write_row(c, table, row, parent_id);
+}
 
-    int id = tables[table_index]->next_id++;
-    FILE* fp = tables[table_index]->fp;
-    fprintf(fp, "%d", id);
+// Checks an array element; returns 1 for a scalar or object worth emitting
+static int valid_element(ASTNode* element, int index) {
+    if (!element) {
+        fprintf(stderr, "Warning: Skipping null element at index %d\n", index);
+        return 0;
+    }
+    if (!is_scalar(element) && element->type != OBJ) {
+        fprintf(stderr, "Warning: Skipping invalid element at index %d\n", index);
+        return 0;
+    }
+    return 1;
+}
 
+// --infer: writes every column of the table, null where the object has no
+// value for it
+static void write_inferred_row(Converter* c, Visit* visit, Table* table, CsvRow* row) {
+    ASTNode* object = visit->node;
+    int num_keys = object->count;
+    int* child_ids = work.child_ids + visit->ids_base;
+    if (table->num_columns > cells_capacity) {
+        cells_capacity = table->num_columns * 2;
+        cells = realloc(cells, cells_capacity * sizeof(int));
+        if (!cells) {
+            fprintf(stderr, "Error: Memory allocation failed for row cells\n");
+            exit(1);
+        }
+    }
+    for (int col = 0; col < table->num_columns; col++) cells[col] = -1;
     for (int i = 0; i < num_keys; i++) {
-        ASTNode* value = object->data.object.values[i];
-        if (!value) {
-            fprintf(stderr, "Warning: Skipping null value for key %s\n", keys[i] ? keys[i] : "unknown");
-            fprintf(fp, ",\"\"");
+        ASTNode* value = &ast_children(object)[visit->order[i]];
+        if (value->type == ARR) continue;
+        int column = is_scalar(value) ? visit->columns[2 * i] : value->type == OBJ ? visit->columns[2 * i + 1] : -1;
+        if (column < 0) report_dropped(table);
+        else cells[column] = i;
+    }
+    int first_column = 1;
+    if (visit->parent) {
+        first_column = 2;
+        if (table->element_ids) {
+            write_separator(c, row);
+            write_int(c, row, visit->id);
+            first_column = 3;
+        }
+    }
+    for (int col = first_column; col < table->num_columns; col++) {
+        write_separator(c, row);
+        if (cells[col] < 0) {
+            write_null(c, row);
             continue;
         }
+        ASTNode* value = &ast_children(object)[visit->order[cells[col]]];
+        if (value->type == OBJ) write_int(c, row, child_ids[cells[col]]);
+        else write_typed(c, row, value, table->types[col]);
+    }
+}
+
+static void write_object_row(Converter* c, Visit* visit) {
+    ASTNode* object = visit->node;
+    char** keys = ast_keys(object);
+    int num_keys = object->count;
+    int* order = visit->order;
+    int* child_ids = work.child_ids + visit->ids_base;
+
+    CsvRow* row = &row_buffer;
+    if (visit->parent) {
+        write_int(c, row, visit->parent_id);
+        write_separator(c, row);
+        write_int(c, row, visit->seq);
+    } else {
+        write_int(c, row, visit->id);
+    }
+
+    if (visit->columns) {
+        write_inferred_row(c, visit, visit->parent ? visit->parent : visit->table, row);
+        end_row(c, row);
+        write_row(c, visit->parent ? visit->parent : visit->table, row, visit->parent ? visit->parent_id : visit->id);
+        return;
+    }
+
+    Table* table = visit->parent ? visit->parent : visit->table;
+    if (visit->parent) {
+        check_element_columns(visit->parent, object, order);
+        write_separator(c, row);
+        write_int(c, row, visit->id);
+    }
+    // The key set fixes the names of the columns but not which members hold
+    // arrays, so an array where the first object had a scalar shortens the row
+    int fields = visit->parent ? 3 : 1;
+    for (int i = 0; i < num_keys; i++) {
+        ASTNode* value = &ast_children(object)[order[i]];
         if (is_scalar(value)) {
-            char* str = value_to_string(value);
-            fprintf(fp, ",\"%s\"", str ? str : "");
-            if (str) free(str);
+            write_separator(c, row);
+            write_value(c, row, value);
+            fields++;
         } else if (value->type == OBJ) {
-            int child_id = process_object(value, NULL, 0, NULL, 0);
-            fprintf(fp, ",%d", child_id);
-        } else if (value->type == ARR) {
-            process_array(value, tables[table_index]->name, id, keys[i] ? keys[i] : "unknown");
-            fprintf(fp, ",\"\"");
-        } else {
-            fprintf(stderr, "Warning: Skipping invalid value for key %s\n", keys[i] ? keys[i] : "unknown");
-            fprintf(fp, ",\"\"");
+            write_separator(c, row);
+            write_int(c, row, child_ids[i]);
+            fields++;
+        } else if (value->type != ARR) {
+            fprintf(stderr, "Warning: Skipping invalid value for key %s\n", keys[order[i]] ? keys[order[i]] : "unknown");
         }
     }
-    fprintf(fp, "\n");
+    if (fields != table->num_columns) report_misaligned(table, visit->parent != NULL);
+    end_row(c, row);
+    write_row(c, table, row, visit->parent ? visit->parent_id : visit->id);
+}
 
-    if (parent_table && array_key) {
-        char* filepath = malloc(strlen(output_dir) + strlen(parent_table) + 2);
-        if (!filepath) {
-            fprintf(stderr, "Error: Memory allocation failed for filepath\n");
-            exit(1);
-        }
-        sprintf(filepath, "%s/%s", output_dir, parent_table);
-        FILE* parent_fp = fopen(filepath, "a");
-        if (!parent_fp) {
-            fprintf(stderr, "Error: Cannot open file %s\n", filepath);
-            exit(1);
+// Runs visits until the stack is back down to base; returns the id of the
+// object visit that sat at base, if any
+static int run_visits(Converter* c, int base) {
+    int result = 0;
+    while (work.count > base) {
+        Visit* visit = &work.visits[work.count - 1];
+
+        if (visit->is_array) {
+            ASTNode* array = visit->node;
+            int pushed = 0;
+            while (!pushed && visit->next < array->count) {
+                int index = visit->next++;
+                ASTNode* element = &ast_children(array)[index];
+                if (!valid_element(element, index)) continue;
+                if (is_scalar(element)) {
+                    write_scalar_element(c, visit->table, element, visit->parent_id, index);
+                } else {
+                    pushed = push_object(c, element, visit->table, visit->parent_id, visit->key ? visit->key : "array", index, 0, -1);
+                }
+            }
+            if (!pushed) work.count--;
+            continue;
         }
-        fprintf(parent_fp, "%d,%d", parent_id, seq);
-        for (int i = 0; i < num_keys; i++) {
-            ASTNode* value = object->data.object.values[i];
-            if (!value) {
-                fprintf(parent_fp, ",\"\"");
-                continue;
+
+        ASTNode* object = visit->node;
+        char** keys = ast_keys(object);
+        int num_keys = object->count;
+        int pushed = 0;
+
+        if (visit->step == VISIT_CHILDREN) {
+            while (!pushed && visit->next < num_keys) {
+                int i = visit->next++;
+                ASTNode* value = &ast_children(object)[visit->order[i]];
+                if (value->type == OBJ) {
+                    char* key = keys[visit->order[i]] ? keys[visit->order[i]] : "unknown";
+                    pushed = push_object(c, value, NULL, 0, key, 0, 0, visit->ids_base + i);
+                }
             }
-            if (is_scalar(value)) {
-                char* str = value_to_string(value);
-                fprintf(parent_fp, ",\"%s\"", str ? str : "");
-                if (str) free(str);
-            } else if (value->type == OBJ) {
-                int child_id = process_object(value, NULL, 0, NULL, 0);
-                fprintf(parent_fp, ",%d", child_id);
-            } else {
-                fprintf(parent_fp, ",\"\"");
+            if (pushed) continue;
+            visit->step = VISIT_ROW;
+        }
+
+        if (visit->step == VISIT_ROW) {
+            write_object_row(c, visit);
+            visit->step = VISIT_ARRAYS;
+            visit->next = visit->streamed ? num_keys : 0;
+        }
+
+        while (!pushed && visit->next < num_keys) {
+            int i = visit->next++;
+            ASTNode* value = &ast_children(object)[visit->order[i]];
+            if (value->type == ARR) {
+                char* key = keys[visit->order[i]] ? keys[visit->order[i]] : "unknown";
+                // Named after the file the id was taken from, which split tables share
+                pushed = push_array(c, value, visit->table->file->keys[0], visit->id, key);
             }
         }
-        fprintf(parent_fp, "\n");
-        fclose(parent_fp);
-        free(filepath);
+        if (pushed) continue;
+
+        // Object finished: hand its id to whoever asked and release its slots
+        if (visit->result_slot >= 0) work.child_ids[visit->result_slot] = visit->id;
+        if (work.count - 1 == base) result = visit->id;
+        work.num_ids = visit->ids_base;
+        work.count--;
     }
+    return result;
+}
 
-    return id;
+// Writes the row for an object and its nested tables; see push_object. When
+// streamed_id is set, it is the id the streaming layer reserved for the
+// object, and its array members were already emitted and are skipped.
+int emit_object_row(Converter* c, ASTNode* object, Table* parent, int parent_id, char* key, int seq, int streamed_id) {
+    int base = work.count;
+    if (!push_object(c, object, parent, parent_id, key, seq, streamed_id, -1)) return 0;
+    return run_visits(c, base);
+}
+
+int process_object(Converter* c, ASTNode* object, Table* parent, int parent_id, char* key, int seq) {
+    return emit_object_row(c, object, parent, parent_id, key, seq, 0);
+}
+
+void emit_array_element(Converter* c, Table* table, ASTNode* element, int parent_id, char* array_key, int index) {
+    if (!valid_element(element, index)) return;
+    if (is_scalar(element)) {
+        write_scalar_element(c, table, element, parent_id, index);
+    } else {
+        emit_object_row(c, element, table, parent_id, array_key ? array_key : "array", index, 0);
+    }
 }
 
-void generate_csv(ASTNode* root, char* out_dir) {
+void process_array(Converter* c, ASTNode* array, char* parent_table, int parent_id, char* array_key) {
+    int base = work.count;
+    if (push_array(c, array, parent_table, parent_id, array_key)) run_visits(c, base);
+}
+
+void generate_csv(Converter* c, ASTNode* root) {
+    if (c->options.infer) infer_document(c, root);
+    convert_document(c, root);
+}
+
+// Converts one document into the converter's tables; safe to call from
+// several threads at once. With --infer, the caller runs infer_document
+// first. Does nothing once the converter has failed.
+void convert_document(Converter* c, ASTNode* root) {
+    if (converter_failed(c)) return;
     if (!root) {
         fprintf(stderr, "Error: Null root node\n");
         return;
     }
-    output_dir = out_dir;
+    int phase = stats_enter(PHASE_CSV);
     if (root->type == OBJ) {
-        process_object(root, NULL, 0, NULL, 0);
+        process_object(c, root, NULL, 0, NULL, 0);
     } else if (root->type == ARR) {
-        process_array(root, NULL, 0, "root");
+        process_array(c, root, NULL, 0, "root");
     } else {
         fprintf(stderr, "Error: Invalid root node type\n");
     }
+    stats_leave(phase);
+}
+
+// Frees the calling thread's row buffer and work stack
+void release_row_buffer() {
+    csv_row_free(&row_buffer);
+    free(cells);
+    cells = NULL;
+    cells_capacity = 0;
+    free(work.visits);
+    free(work.child_ids);
+    memset(&work, 0, sizeof(WorkStack));
+}
+
+// Reports one table's output for --stats; returns 0 past the last table
+int get_table_stats(Converter* c, int index, const char** name, int* columns, unsigned long long* rows, unsigned long long* bytes) {
+    if (index < 0 || index >= c->num_tables) return 0;
+    *name = c->tables[index]->name;
+    *columns = c->tables[index]->num_columns;
+    *rows = c->tables[index]->rows;
+    *bytes = c->tables[index]->bytes;
+    return 1;
+}
+
+// Reports what a manifest records of one table; returns 0 past the last
+// table. pending is set for an array table that has no file yet. ids is the
+// name whose id counter the table takes from, which differs from its own
+// once the table has been split off into <stem>_2.csv and so on.
+int get_table_state(Converter* c, int index, const char** name, const char** ids, char*** columns, int* num_columns, int* next_id, int* pending) {
+    if (index < 0 || index >= c->num_tables) return 0;
+    *pending = c->tables[index]->pending;
+    *name = c->tables[index]->name;
+    *ids = c->tables[index]->file->keys[0];
+    *columns = c->tables[index]->columns;
+    *num_columns = c->tables[index]->num_columns;
+    *next_id = __atomic_load_n(&c->tables[index]->file->next_id, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Path of a table's output file; the caller frees it
+char* table_file_path(Converter* c, int index) {
+    return table_path(c, c->tables[index], 0, NULL);
+}
+
+// --append: registers a table read back from a manifest, taking ownership of
+// name and columns, and returns its index. reopen_table then opens its file.
+int restore_table(Converter* c, char* name, const char* ids, char** columns, int num_columns, int next_id) {
+    Table* table = malloc(sizeof(Table));
+    if (!table) {
+        fprintf(stderr, "Error: Memory allocation failed for table\n");
+        exit(1);
+    }
+    int index = register_table(c, table);
+    table->name = name;
+    table->columns = columns;
+    table->num_columns = num_columns;
+    table->file = lookup_table_file(&c->catalog, ids);
+    if (table->file->next_id < next_id) table->file->next_id = next_id;
+    table->out = NULL;
+    table->pending = 1;     // until its file is reopened, or it gets a first element
+    return index;
+}
+
+// The file of a restored table already holds the header and earlier rows,
+// so new rows go after them
+void reopen_table(Converter* c, int index) {
+    Shape* file = lookup_table_file(&c->catalog, c->tables[index]->name);
+    if (file->table_index == -1) file->table_index = index;
+    char* filepath = table_path(c, c->tables[index], 0, NULL);
+    c->tables[index]->out = csv_open_existing(&c->writers, filepath);
+    c->tables[index]->pending = 0;
+    free(filepath);
+}
+
+// Takes the next id of the rows in the named file, for a row written later
+int reserve_row_id(Converter* c, const char* name) {
+    pthread_rwlock_wrlock(&c->catalog_lock);
+    int id = __atomic_fetch_add(&lookup_table_file(&c->catalog, name)->next_id, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&c->catalog_lock);
+    return id;
+}
+
+static void finish_arrow(Converter* c, const char* spill_path, const char* arrow_path) {
+    char error[sizeof(c->error)];
+    if (arrow_finish(spill_path, arrow_path, error, sizeof(error)) != 0) {
+        converter_fail(c, CONVERT_ERROR_OUTPUT, "%s", error);
+    }
 }
 
-void cleanup_tables() {
-    for (int i = 0; i < num_tables; i++) {
-        if (tables[i]) {
-            if (tables[i]->fp) fclose(tables[i]->fp);
-            for (int j = 0; j < tables[i]->num_columns; j++) {
-                if (tables[i]->columns[j]) free(tables[i]->columns[j]);
+// Flushes and closes every table's file, building the Arrow file once the
+// last table sharing a spill closes it (unless the run has failed); the
+// tables themselves stay until cleanup_tables, so their stats can still be
+// read. Part files are built one by one and listed in the shard manifest,
+// and every file or part gets its row index with --emit-index.
+void close_tables(Converter* c) {
+    for (int i = 0; i < c->num_tables; i++) {
+        if (c->tables[i] && c->tables[i]->pending && !converter_failed(c)) {
+            // Only ever seen empty: the file gets the scalar header
+            open_table_file(c, c->tables[i]);
+            c->tables[i]->pending = 0;
+        }
+        if (c->tables[i] && c->tables[i]->out) {
+            CsvPart* parts;
+            int num_parts;
+            if (csv_close(c->tables[i]->out, &parts, &num_parts) && !converter_failed(c)) {
+                if (parts) {
+                    for (int j = 0; c->options.format == FORMAT_ARROW && j < num_parts; j++) {
+                        char* arrow_path = strdup(parts[j].path);
+                        if (!arrow_path) {
+                            fprintf(stderr, "Error: Memory allocation failed for filepath\n");
+                            exit(1);
+                        }
+                        arrow_path[strlen(arrow_path) - strlen(".spill")] = '\0';
+                        finish_arrow(c, parts[j].path, arrow_path);
+                        free(parts[j].path);
+                        parts[j].path = arrow_path;
+                    }
+                    // The header is that of the first table that opened the file
+                    Table* first = c->tables[i];
+                    for (int j = 0; j < i; j++) {
+                        if (strcmp(c->tables[j]->name, first->name) == 0) {
+                            first = c->tables[j];
+                            break;
+                        }
+                    }
+                    char* key = first->num_columns > 0 ? first->columns[0] : NULL;
+                    if (sharding_enabled(c)) record_shards(c, first->name, key ? key : "unknown", parts, num_parts);
+                    for (int j = 0; c->options.emit_index && j < num_parts; j++) {
+                        if (row_index_save(&parts[j].index, parts[j].path, parts[j].bytes) != 0) {
+                            converter_fail(c, CONVERT_ERROR_OUTPUT, "Cannot write row index for %s", parts[j].path);
+                        }
+                    }
+                } else if (c->options.format == FORMAT_ARROW) {
+                    char* spill_path = table_path(c, c->tables[i], 1, NULL);
+                    char* arrow_path = table_path(c, c->tables[i], 0, NULL);
+                    finish_arrow(c, spill_path, arrow_path);
+                    free(spill_path);
+                    free(arrow_path);
+                }
             }
-            free(tables[i]->columns);
-            if (tables[i]->name) free(tables[i]->name);
-            free(tables[i]);
+            csv_free_parts(parts, num_parts);
+            c->tables[i]->out = NULL;
         }
     }
-    for (int i = 0; i < num_key_sets; i++) {
-        if (key_sets[i]) free(key_sets[i]);
+}
+
+void cleanup_tables(Converter* c) {
+    close_tables(c);
+    for (int i = 0; i < c->num_tables; i++) {
+        if (c->tables[i]) {
+            for (int j = 0; j < c->tables[i]->num_columns; j++) {
+                if (c->tables[i]->columns[j]) free(c->tables[i]->columns[j]);
+            }
+            free(c->tables[i]->columns);
+            free(c->tables[i]->types);
+            for (int j = 0; j < c->tables[i]->shape_capacity; j++) {
+                free(c->tables[i]->shape_columns[j].columns);
+            }
+            free(c->tables[i]->shape_columns);
+            if (c->tables[i]->name) free(c->tables[i]->name);
+            free(c->tables[i]);
+        }
     }
-    free(key_sets);
-    free(table_indices);
+    free(c->tables);
+    c->tables = NULL;
+    c->num_tables = 0;
+    c->max_tables = 0;
+    free_schema_catalog(&c->catalog);
+    free_table_schemas(c);
+    release_row_buffer();
 }
\ No newline at end of file
@@ -0,0 +1,866 @@
+#include "csv_writer.h"
+#include "converter.h"
+#include "stats.h"
+#include "spsc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// A block of output on its way through the compression pool or a writer thread
+typedef struct CompressJob {
+    CsvWriter* writer;
+    const char* path;       // the writer's file when the block was queued
+    int fd;                 // the writer's descriptor for that file, or -1
+    int last;               // the descriptor is closed once this block is written
+    unsigned long seq;      // position among the writer's blocks
+    char* data;             // raw block, then its compressed form
+    size_t len;
+    struct CompressJob* next;
+} CompressJob;
+
+typedef struct WriteThread {
+    WriterPool* pool;
+    SpscQueue queue;
+    pthread_t thread;
+} WriteThread;
+
+void csv_pool_init(WriterPool* pool, Converter* converter, Compression compression, int threads,
+                   unsigned long long shard_rows, size_t shard_bytes, int emit_index) {
+    memset(pool, 0, sizeof(WriterPool));
+    pool->converter = converter;
+    pool->compression = compression;
+    pool->threads = threads;
+    pool->shard_rows = shard_rows;
+    pool->shard_bytes = shard_bytes;
+    pool->emit_index = emit_index;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->queue_lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->job_space, NULL);
+    pthread_cond_init(&pool->block_written, NULL);
+}
+
+// Called once every writer is closed
+void csv_pool_destroy(WriterPool* pool) {
+    free(pool->writers);
+    pool->writers = NULL;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->queue_lock);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_cond_destroy(&pool->job_space);
+    pthread_cond_destroy(&pool->block_written);
+}
+
+static unsigned long hash_path(const char* path) {
+    unsigned long hash = 14695981039346656037UL;
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static void insert_writer(WriterPool* pool, CsvWriter* w) {
+    if ((pool->num_writers + 1) * 2 > pool->writer_capacity) {
+        int old_capacity = pool->writer_capacity;
+        CsvWriter** old = pool->writers;
+        pool->writer_capacity = old_capacity ? old_capacity * 2 : 64;
+        pool->writers = calloc(pool->writer_capacity, sizeof(CsvWriter*));
+        if (!pool->writers) {
+            fprintf(stderr, "Error: Memory allocation failed for writer registry\n");
+            exit(1);
+        }
+        for (int i = 0; i < old_capacity; i++) {
+            if (!old[i]) continue;
+            int slot = old[i]->hash & (pool->writer_capacity - 1);
+            while (pool->writers[slot]) slot = (slot + 1) & (pool->writer_capacity - 1);
+            pool->writers[slot] = old[i];
+        }
+        free(old);
+    }
+    int slot = w->hash & (pool->writer_capacity - 1);
+    while (pool->writers[slot]) slot = (slot + 1) & (pool->writer_capacity - 1);
+    pool->writers[slot] = w;
+    pool->num_writers++;
+}
+
+static void remove_writer(WriterPool* pool, CsvWriter* w) {
+    CsvWriter** writers = pool->writers;
+    int mask = pool->writer_capacity - 1;
+    int slot = w->hash & mask;
+    while (writers[slot] != w) slot = (slot + 1) & mask;
+    writers[slot] = NULL;
+    pool->num_writers--;
+    // Re-place the rest of the probe run so lookups still find them
+    for (slot = (slot + 1) & mask; writers[slot]; slot = (slot + 1) & mask) {
+        CsvWriter* moved = writers[slot];
+        writers[slot] = NULL;
+        int target = moved->hash & mask;
+        while (writers[target]) target = (target + 1) & mask;
+        writers[target] = moved;
+    }
+}
+
+static int pool_size(WriterPool* pool) {
+    if (pool->max_active == 0) {
+        struct rlimit limit;
+        pool->max_active = CSV_MAX_OPEN_FILES;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+            // Leave room for stdio, the input file and anything else open
+            long usable = (long)limit.rlim_cur - 16;
+            if (usable < pool->max_active) pool->max_active = usable > 1 ? usable : 1;
+        }
+    }
+    return pool->max_active;
+}
+
+static void active_unlink(CsvWriter* w) {
+    WriterPool* pool = w->pool;
+    if (w->prev) w->prev->next = w->next;
+    else pool->active = w->next;
+    if (w->next) w->next->prev = w->prev;
+    w->prev = w->next = NULL;
+}
+
+static void active_push(CsvWriter* w) {
+    WriterPool* pool = w->pool;
+    w->prev = NULL;
+    w->next = pool->active;
+    if (pool->active) pool->active->prev = w;
+    pool->active = w;
+}
+
+// The active writer written least recently. Rows only note the pool clock
+// rather than reorder a list, so they need no pool-wide lock; parking is rare
+// enough to pay for the scan.
+static CsvWriter* least_recent(WriterPool* pool) {
+    CsvWriter* oldest = pool->active;
+    for (CsvWriter* w = pool->active; w; w = w->next) {
+        if (__atomic_load_n(&w->last_use, __ATOMIC_RELAXED) < __atomic_load_n(&oldest->last_use, __ATOMIC_RELAXED)) oldest = w;
+    }
+    return oldest;
+}
+
+static void write_all(CsvWriter* w, const char* path, int fd, const char* data, size_t len) {
+    int phase = stats_enter(PHASE_FLUSH);
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            converter_fail(w->pool->converter, CONVERT_ERROR_OUTPUT, "Cannot write file %s", path);
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    stats_leave(phase);
+}
+
+// Appends a block through the descriptor its writer held when it was queued,
+// and closes the descriptor after the writer's last block before parking;
+// called without the lock held
+static void append_block(CsvWriter* w, CompressJob* job) {
+    if (job->fd < 0) return;
+    if (job->len > 0 && !converter_failed(w->pool->converter)) write_all(w, job->path, job->fd, job->data, job->len);
+    if (job->last && close(job->fd) != 0) {
+        converter_fail(w->pool->converter, CONVERT_ERROR_OUTPUT, "Cannot write file %s", job->path);
+    }
+}
+
+// Writes a finished block if it is the writer's next one, then any parked
+// blocks that follow it; otherwise parks it. Called with the queue lock
+// held; the lock is dropped while writing, and only the thread holding the
+// writer's next block writes, so blocks land in order.
+static void complete_job(CompressJob* job) {
+    CsvWriter* w = job->writer;
+    WriterPool* pool = w->pool;
+    if (job->seq != w->blocks_written) {
+        job->next = w->done;
+        w->done = job;
+        return;
+    }
+    while (job) {
+        pthread_mutex_unlock(&pool->queue_lock);
+        append_block(w, job);
+        free(job->data);
+        free(job);
+        pthread_mutex_lock(&pool->queue_lock);
+        w->blocks_written++;
+        CompressJob** link = &w->done;
+        while (*link && (*link)->seq != w->blocks_written) link = &(*link)->next;
+        job = *link;
+        if (job) *link = job->next;
+    }
+    pthread_cond_broadcast(&pool->block_written);
+}
+
+static void* compress_worker(void* arg) {
+    WriterPool* pool = arg;
+    Converter* c = pool->converter;
+    stats_thread_start(c);
+    Compressor* compressor = compressor_create(pool->compression);
+    if (!compressor) {
+        converter_fail(c, CONVERT_ERROR_OUTPUT, "Cannot initialize %s compression", compression_name(pool->compression));
+    }
+    pthread_mutex_lock(&pool->queue_lock);
+    for (;;) {
+        while (!pool->job_head && !pool->compress_stopping) pthread_cond_wait(&pool->job_ready, &pool->queue_lock);
+        if (!pool->job_head) break;
+        CompressJob* job = pool->job_head;
+        pool->job_head = job->next;
+        if (!pool->job_head) pool->job_tail = NULL;
+        __atomic_sub_fetch(&pool->num_jobs, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&pool->job_space);
+        pthread_mutex_unlock(&pool->queue_lock);
+
+        // After a failure blocks still pass through, unwritten, so the
+        // writers' block counts catch up and closing does not wait forever
+        if (compressor && job->len > 0 && !converter_failed(c)) {
+            int phase = stats_enter(PHASE_FLUSH);
+            size_t cap = compressor_bound(compressor, job->len);
+            char* out = malloc(cap);
+            if (!out) {
+                fprintf(stderr, "Error: Memory allocation failed for compressed block\n");
+                exit(1);
+            }
+            job->len = compressor_run(compressor, job->data, job->len, out, cap);
+            free(job->data);
+            job->data = out;
+            if (job->len == 0) {
+                converter_fail(c, CONVERT_ERROR_OUTPUT, "%s compression failed", compression_name(pool->compression));
+            }
+            stats_leave(phase);
+        }
+
+        pthread_mutex_lock(&pool->queue_lock);
+        complete_job(job);
+    }
+    pthread_mutex_unlock(&pool->queue_lock);
+    if (compressor) compressor_free(compressor);
+    stats_thread_done(c);
+    return NULL;
+}
+
+// Starts the pool on first use, one thread per CPU up to the limit. Called
+// with the queue lock held; if no thread starts, the converter has failed and
+// nothing is queued.
+static void start_compression(WriterPool* pool) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus < 1 ? 1 : cpus > CSV_MAX_COMPRESS_THREADS ? CSV_MAX_COMPRESS_THREADS : cpus;
+    pool->max_jobs = 2 * wanted + 2;
+    pthread_t* threads = malloc(wanted * sizeof(pthread_t));
+    if (!threads) {
+        fprintf(stderr, "Error: Memory allocation failed for compression threads\n");
+        exit(1);
+    }
+    // Rows read it without the queue lock to decide whether to wait
+    __atomic_store_n(&pool->compress_threads, threads, __ATOMIC_RELEASE);
+    pool->num_compress_threads = 0;
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&threads[i], NULL, compress_worker, pool) != 0) {
+            converter_fail(pool->converter, CONVERT_ERROR_RESOURCE, "Cannot start compression thread");
+            break;
+        }
+        pool->num_compress_threads++;
+    }
+}
+
+// Lets the pool drain the queue and exit; called without the lock held
+static void stop_compression(WriterPool* pool) {
+    pthread_mutex_lock(&pool->queue_lock);
+    pool->compress_stopping = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->queue_lock);
+    for (int i = 0; i < pool->num_compress_threads; i++) pthread_join(pool->compress_threads[i], NULL);
+    free(pool->compress_threads);
+    __atomic_store_n(&pool->compress_threads, NULL, __ATOMIC_RELEASE);
+    pool->num_compress_threads = 0;
+    pool->compress_stopping = 0;
+}
+
+static CompressJob* make_job(CsvWriter* w, const char* data, size_t len, int last) {
+    CompressJob* job = malloc(sizeof(CompressJob));
+    if (job) job->data = malloc(len ? len : 1);
+    if (!job || !job->data) {
+        fprintf(stderr, "Error: Memory allocation failed for output block\n");
+        exit(1);
+    }
+    memcpy(job->data, data, len);
+    job->len = len;
+    job->writer = w;
+    job->path = w->file;
+    job->fd = w->fd;
+    job->last = last;
+    job->seq = w->blocks_queued++;
+    job->next = NULL;
+    return job;
+}
+
+// Queues a copy of a block for compression. The copy is made before taking
+// the queue lock, so other writers only wait for the link.
+static void queue_block(CsvWriter* w, const char* data, size_t len, int last) {
+    WriterPool* pool = w->pool;
+    CompressJob* job = make_job(w, data, len, last);
+    pthread_mutex_lock(&pool->queue_lock);
+    if (!pool->compress_threads) start_compression(pool);
+    if (pool->num_compress_threads == 0) {
+        pthread_mutex_unlock(&pool->queue_lock);
+        w->blocks_queued--;
+        if (last && w->fd >= 0) close(w->fd);
+        free(job->data);
+        free(job);
+        return;
+    }
+    if (pool->job_tail) pool->job_tail->next = job;
+    else pool->job_head = job;
+    pool->job_tail = job;
+    __atomic_add_fetch(&pool->num_jobs, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->queue_lock);
+}
+
+// Drains one writer thread's queue until it pops NULL. blocks_written is
+// only ever advanced by the thread that owns the file.
+static void* write_worker(void* arg) {
+    WriteThread* self = arg;
+    stats_thread_start(self->pool->converter);
+    CompressJob* job;
+    for (;;) {
+        spsc_pop(&self->queue, &job);
+        if (!job) break;
+        CsvWriter* w = job->writer;
+        append_block(w, job);
+        free(job->data);
+        free(job);
+        __atomic_fetch_add(&w->blocks_written, 1, __ATOMIC_RELEASE);
+    }
+    stats_thread_done(self->pool->converter);
+    return NULL;
+}
+
+// Starts every writer thread, or none: if one cannot be started, those
+// already running are stopped and the converter fails
+static void start_writers(WriterPool* pool) {
+    pool->write_threads = malloc(pool->threads * sizeof(WriteThread));
+    if (!pool->write_threads) {
+        fprintf(stderr, "Error: Memory allocation failed for writer threads\n");
+        exit(1);
+    }
+    for (int i = 0; i < pool->threads; i++) {
+        WriteThread* t = &pool->write_threads[i];
+        t->pool = pool;
+        spsc_init(&t->queue, CSV_WRITE_QUEUE_SIZE, sizeof(CompressJob*));
+        if (pthread_create(&t->thread, NULL, write_worker, t) != 0) {
+            converter_fail(pool->converter, CONVERT_ERROR_RESOURCE, "Cannot start writer thread");
+            CompressJob* end = NULL;
+            for (int j = 0; j < i; j++) {
+                spsc_push(&pool->write_threads[j].queue, &end);
+                pthread_join(pool->write_threads[j].thread, NULL);
+            }
+            for (int j = 0; j <= i; j++) spsc_free(&pool->write_threads[j].queue);
+            free(pool->write_threads);
+            pool->write_threads = NULL;
+            return;
+        }
+    }
+}
+
+// Lets the writer threads finish their queues and exit
+static void stop_writers(WriterPool* pool) {
+    CompressJob* end = NULL;
+    for (int i = 0; i < pool->threads; i++) spsc_push(&pool->write_threads[i].queue, &end);
+    for (int i = 0; i < pool->threads; i++) {
+        pthread_join(pool->write_threads[i].thread, NULL);
+        spsc_free(&pool->write_threads[i].queue);
+    }
+    free(pool->write_threads);
+    pool->write_threads = NULL;
+}
+
+// Hands a copy of a block to the thread that owns the file, waiting while
+// that thread's queue is full. Consecutive parts of a sharded file belong to
+// different threads.
+static void hand_off(CsvWriter* w, const char* data, size_t len, int last) {
+    WriterPool* pool = w->pool;
+    if (!pool->write_threads) start_writers(pool);
+    if (!pool->write_threads) {
+        if (last && w->fd >= 0) close(w->fd);
+        return;
+    }
+    CompressJob* job = make_job(w, data, len, last);
+    spsc_push(&pool->write_threads[(w->hash + w->num_parts) % pool->threads].queue, &job);
+}
+
+// Sends output to the file, the compression pool or a writer thread. A last
+// block before parking also hands over the descriptor, which the thread that
+// writes it closes. Once the converter has failed, output is dropped, but a
+// descriptor still travels with an empty last block.
+static void emit(CsvWriter* w, const char* data, size_t len, int last) {
+    WriterPool* pool = w->pool;
+    if (converter_failed(pool->converter)) {
+        if (!last || w->fd < 0 || !(pool->compression || pool->threads)) return;
+        len = 0;
+    }
+    if (pool->compression) queue_block(w, data, len, last);
+    else if (pool->threads) hand_off(w, data, len, last);
+    else write_all(w, w->file, w->fd, data, len);
+}
+
+// Called with the writer's lock held
+static void flush(CsvWriter* w) {
+    if (!w->buf || w->len == 0) return;
+    emit(w, w->buf, w->len, 0);
+    w->len = 0;
+    __atomic_store_n(&w->last_use, __atomic_add_fetch(&w->pool->clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+// Flushes and closes an active writer, releasing its descriptor and buffer.
+// With compression or writer threads the descriptor goes with the last
+// block, and is closed once the blocks before it are written. Called with
+// the pool lock and the writer's lock held.
+static void park(CsvWriter* w) {
+    WriterPool* pool = w->pool;
+    if ((pool->compression || pool->threads) && w->fd >= 0) {
+        emit(w, w->buf, w->len, 1);
+        w->len = 0;
+    } else {
+        flush(w);
+        if (w->fd >= 0 && close(w->fd) != 0) {
+            converter_fail(pool->converter, CONVERT_ERROR_OUTPUT, "Cannot write file %s", w->file);
+        }
+    }
+    w->fd = -1;
+    free(w->buf);
+    w->buf = NULL;
+    active_unlink(w);
+    pool->num_active--;
+}
+
+// Parks the least recently written writer other than the one being
+// activated, which is not in the active list yet
+static CsvWriter* park_oldest(WriterPool* pool) {
+    CsvWriter* oldest = least_recent(pool);
+    pthread_mutex_lock(&oldest->lock);
+    park(oldest);
+    pthread_mutex_unlock(&oldest->lock);
+    return oldest;
+}
+
+// Waits until every block queued for the writer is in its file; called with
+// the pool lock held
+static void wait_written(CsvWriter* w) {
+    WriterPool* pool = w->pool;
+    if (pool->threads && !pool->compression) {
+        int phase = stats_enter(PHASE_WAIT);
+        int spins = 0;
+        while (__atomic_load_n(&w->blocks_written, __ATOMIC_ACQUIRE) < w->blocks_queued) spsc_backoff(&spins);
+        stats_leave(phase);
+    } else if (pool->compression) {
+        pthread_mutex_lock(&pool->queue_lock);
+        int phase = stats_enter(PHASE_WAIT);
+        while (w->blocks_written < w->blocks_queued) pthread_cond_wait(&pool->block_written, &pool->queue_lock);
+        stats_leave(phase);
+        pthread_mutex_unlock(&pool->queue_lock);
+    }
+}
+
+// Waits for the blocks of every parked writer, so that the descriptors still
+// travelling with their last blocks are closed. Called with the pool lock
+// held, which keeps parked writers parked.
+static void wait_parked(WriterPool* pool) {
+    for (int i = 0; i < pool->writer_capacity; i++) {
+        if (pool->writers[i] && !pool->writers[i]->buf) wait_written(pool->writers[i]);
+    }
+}
+
+// Gives a parked writer a descriptor and buffer. Called with the pool lock
+// held and no writer's lock.
+static void activate(CsvWriter* w) {
+    WriterPool* pool = w->pool;
+    if (pool->num_active >= pool_size(pool)) park_oldest(pool);
+    if (converter_failed(pool->converter)) {
+        // Nothing more is written; the writer only needs its buffer
+        w->fd = -1;
+    } else {
+        // With compression or writer threads, other threads append the
+        // blocks through this descriptor
+        w->fd = open(w->file, O_WRONLY | O_CREAT | (w->truncated ? O_APPEND : O_TRUNC), 0644);
+        if (w->fd < 0 && (errno == EMFILE || errno == ENFILE) && (pool->compression || pool->threads)) {
+            // Parked writers may still have descriptors on their way
+            wait_parked(pool);
+            w->fd = open(w->file, O_WRONLY | O_CREAT | (w->truncated ? O_APPEND : O_TRUNC), 0644);
+        }
+        if (w->fd < 0 && (errno == EMFILE || errno == ENFILE) && pool->active) {
+            // Something else is holding descriptors; shrink the pool and
+            // retry once the parked writer's blocks have closed its file
+            wait_written(park_oldest(pool));
+            pool->max_active = pool->num_active > 1 ? pool->num_active : 1;
+            w->fd = open(w->file, O_WRONLY | O_CREAT | (w->truncated ? O_APPEND : O_TRUNC), 0644);
+        }
+        if (w->fd < 0) {
+            converter_fail(pool->converter, CONVERT_ERROR_OUTPUT, "Cannot open file %s", w->file);
+        }
+    }
+    w->truncated = 1;
+    char* buf = malloc(CSV_BUFFER_SIZE);
+    if (!buf) {
+        fprintf(stderr, "Error: Memory allocation failed for CSV writer buffer\n");
+        exit(1);
+    }
+    // Rows test the buffer under the writer's lock, so it is published there
+    pthread_mutex_lock(&w->lock);
+    w->len = 0;
+    w->buf = buf;
+    pthread_mutex_unlock(&w->lock);
+    w->last_use = __atomic_add_fetch(&pool->clock, 1, __ATOMIC_RELAXED);
+    active_push(w);
+    pool->num_active++;
+}
+
+// Buffers data for an active writer; called with its lock held
+static void append(CsvWriter* w, const char* data, size_t len) {
+    if (w->len + len > CSV_BUFFER_SIZE) {
+        flush(w);
+        if (len > CSV_BUFFER_SIZE) {
+            emit(w, data, len, 0);
+            return;
+        }
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+// Adds the next part of a sharded writer, named by its number after the
+// stem, and makes it the file being written; it is truncated on first use.
+// The single part of an indexed writer without sharding keeps the path.
+static void start_part(CsvWriter* w) {
+    if (w->num_parts % 16 == 0) {
+        w->parts = realloc(w->parts, (w->num_parts + 16) * sizeof(CsvPart));
+        if (!w->parts) {
+            fprintf(stderr, "Error: Memory allocation failed for part files\n");
+            exit(1);
+        }
+    }
+    CsvPart* part = &w->parts[w->num_parts++];
+    char number[32];
+    int sharded = w->pool->shard_rows || w->pool->shard_bytes;
+    int number_len = sharded ? snprintf(number, sizeof(number), ".part-%05d", w->num_parts) : 0;
+    size_t path_len = strlen(w->path);
+    part->path = malloc(path_len + number_len + 1);
+    if (!part->path) {
+        fprintf(stderr, "Error: Memory allocation failed for part file path\n");
+        exit(1);
+    }
+    memcpy(part->path, w->path, w->stem);
+    memcpy(part->path + w->stem, number, number_len);
+    memcpy(part->path + w->stem + number_len, w->path + w->stem, path_len - w->stem + 1);
+    part->rows = 0;
+    part->bytes = w->header_len;
+    part->first_key = 0;
+    part->last_key = 0;
+    memset(&part->index, 0, sizeof(RowIndexBuilder));
+    w->file = part->path;
+    w->truncated = 0;
+}
+
+// Returns the shared writer for path, creating it if needed. A new writer
+// truncates its file on first use unless existing is set. With sharding on,
+// a new writer writes parts named by inserting the part number into path
+// at stem.
+static CsvWriter* open_shared(WriterPool* pool, const char* path, size_t stem, CsvRow* header, int existing) {
+    unsigned long hash = hash_path(path);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->writer_capacity > 0) {
+        int slot = hash & (pool->writer_capacity - 1);
+        while (pool->writers[slot]) {
+            CsvWriter* w = pool->writers[slot];
+            if (w->hash == hash && strcmp(w->path, path) == 0) {
+                w->refs++;
+                pthread_mutex_unlock(&pool->lock);
+                return w;
+            }
+            slot = (slot + 1) & (pool->writer_capacity - 1);
+        }
+    }
+
+    CsvWriter* w = malloc(sizeof(CsvWriter));
+    if (!w) {
+        fprintf(stderr, "Error: Memory allocation failed for CSV writer\n");
+        exit(1);
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    w->fd = -1;
+    w->path = strdup(path);
+    if (!w->path) {
+        fprintf(stderr, "Error: Memory allocation failed for CSV writer path\n");
+        exit(1);
+    }
+    w->buf = NULL;
+    w->len = 0;
+    w->truncated = existing;
+    w->refs = 1;
+    w->hash = hash;
+    w->last_use = 0;
+    w->prev = w->next = NULL;
+    w->blocks_queued = 0;
+    w->blocks_written = 0;
+    w->done = NULL;
+    w->pool = pool;
+    w->file = w->path;
+    w->stem = stem;
+    w->header = NULL;
+    w->header_len = 0;
+    w->parts = NULL;
+    w->num_parts = 0;
+    if ((pool->shard_rows || pool->shard_bytes || pool->emit_index) && !existing) {
+        if (header) {
+            w->header = malloc(header->len);
+            if (!w->header) {
+                fprintf(stderr, "Error: Memory allocation failed for CSV header\n");
+                exit(1);
+            }
+            memcpy(w->header, header->data, header->len);
+            w->header_len = header->len;
+        }
+        start_part(w);
+    }
+    insert_writer(pool, w);
+    activate(w); // create the file now so open errors surface early
+    if (header) append(w, header->data, header->len);
+    pthread_mutex_unlock(&pool->lock);
+    return w;
+}
+
+// Returns the shared writer for path. The header is written only by the call
+// that creates the file; later tables sharing the file reuse it.
+CsvWriter* csv_open(WriterPool* pool, const char* path, size_t stem, CsvRow* header) {
+    return open_shared(pool, path, stem, header, 0);
+}
+
+// --append: returns the shared writer for a file a previous run wrote, adding
+// rows after what is already there
+CsvWriter* csv_open_existing(WriterPool* pool, const char* path) {
+    return open_shared(pool, path, strlen(path), NULL, 1);
+}
+
+// Whether a row of len bytes would take the current part of a sharded
+// writer past a limit
+static int part_full(CsvWriter* w, size_t len) {
+    WriterPool* pool = w->pool;
+    CsvPart* part = &w->parts[w->num_parts - 1];
+    return part->rows > 0 && ((pool->shard_rows && part->rows >= pool->shard_rows) ||
+                              (pool->shard_bytes && part->bytes + len > pool->shard_bytes));
+}
+
+// Counts a row into the current part of a sharded or indexed writer
+static void count_part_row(CsvWriter* w, size_t len, long key) {
+    WriterPool* pool = w->pool;
+    CsvPart* part = &w->parts[w->num_parts - 1];
+    if (part->rows == 0 || key < part->first_key) part->first_key = key;
+    if (part->rows == 0 || key > part->last_key) part->last_key = key;
+    if (pool->emit_index) row_index_add(&part->index, key, part->bytes, len);
+    part->rows++;
+    part->bytes += len;
+}
+
+// Appends a complete row and resets it for reuse. key is the row's first
+// column, recorded in the part ranges of a sharded writer and in the row
+// index.
+void csv_write_row(CsvWriter* w, CsvRow* row, long key) {
+    WriterPool* pool = w->pool;
+    if (pool->compression && __atomic_load_n(&pool->compress_threads, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&pool->num_jobs, __ATOMIC_RELAXED) >= pool->max_jobs) {
+        // The pool is behind; wait here, holding no writer
+        pthread_mutex_lock(&pool->queue_lock);
+        int phase = stats_enter(PHASE_WAIT);
+        while (pool->num_jobs >= pool->max_jobs && pool->compress_threads) pthread_cond_wait(&pool->job_space, &pool->queue_lock);
+        stats_leave(phase);
+        pthread_mutex_unlock(&pool->queue_lock);
+    }
+    pthread_mutex_lock(&w->lock);
+    if (!w->buf || (w->parts && part_full(w, row->len))) {
+        // Reopening a parked writer or starting a part changes which writers
+        // are active, so it takes the pool lock, which comes first. A row
+        // that would take the part past a limit starts the next one: the
+        // finished part is flushed and closed like a parked writer, and its
+        // blocks may still be on their way while the next part fills.
+        pthread_mutex_unlock(&w->lock);
+        pthread_mutex_lock(&pool->lock);
+        pthread_mutex_lock(&w->lock);
+        int next_part = w->parts && part_full(w, row->len);
+        if (next_part) {
+            if (w->buf) park(w);
+            start_part(w);
+        }
+        if (!w->buf) {
+            // Parked writers are only touched under the pool lock, and
+            // activating may park another writer, so no writer lock is held
+            pthread_mutex_unlock(&w->lock);
+            activate(w);
+            pthread_mutex_lock(&w->lock);
+        }
+        if (next_part && w->header) append(w, w->header, w->header_len);
+        if (w->parts) count_part_row(w, row->len, key);
+        append(w, row->data, row->len);
+        pthread_mutex_unlock(&w->lock);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        if (w->parts) count_part_row(w, row->len, key);
+        append(w, row->data, row->len);
+        __atomic_store_n(&w->last_use, __atomic_load_n(&pool->clock, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&w->lock);
+    }
+    row->len = 0;
+}
+
+void csv_row_reserve(CsvRow* row, size_t extra) {
+    if (row->len + extra <= row->cap) return;
+    size_t cap = row->cap ? row->cap * 2 : 256;
+    while (cap < row->len + extra) cap *= 2;
+    row->data = realloc(row->data, cap);
+    if (!row->data) {
+        fprintf(stderr, "Error: Memory allocation failed for CSV row\n");
+        exit(1);
+    }
+    row->cap = cap;
+}
+
+void csv_row_raw(CsvRow* row, const char* data, size_t len) {
+    csv_row_reserve(row, len);
+    memcpy(row->data + row->len, data, len);
+    row->len += len;
+}
+
+void csv_row_int(CsvRow* row, long value) {
+    char digits[24];
+    int n = sizeof(digits);
+    unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    do {
+        digits[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (value < 0) digits[--n] = '-';
+    csv_row_raw(row, digits + n, sizeof(digits) - n);
+}
+
+void csv_row_free(CsvRow* row) {
+    free(row->data);
+    row->data = NULL;
+    row->len = 0;
+    row->cap = 0;
+}
+
+// Returns nonzero if the field contains a quote, comma, CR or LF
+static int needs_quoting(const char* s, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, comma)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(chunk, lf), _mm_cmpeq_epi8(chunk, cr)));
+        if (_mm_movemask_epi8(hits)) return 1;
+    }
+#endif
+    for (; i < len; i++) {
+        char c = s[i];
+        if (c == '"' || c == ',' || c == '\n' || c == '\r') return 1;
+    }
+    return 0;
+}
+
+// Writes a field in quotes, doubling any embedded quotes
+void csv_row_quoted(CsvRow* row, const char* s, size_t len) {
+    csv_row_reserve(row, len + 2);
+    csv_row_char(row, '"');
+    const char* start = s;
+    const char* end = s + len;
+    const char* q;
+    while ((q = memchr(start, '"', end - start))) {
+        csv_row_raw(row, start, q - start + 1);
+        csv_row_char(row, '"'); // double embedded quotes
+        start = q + 1;
+    }
+    csv_row_raw(row, start, end - start);
+    csv_row_char(row, '"');
+}
+
+void csv_row_field(CsvRow* row, const char* s, size_t len) {
+    if (!needs_quoting(s, len)) {
+        csv_row_raw(row, s, len);
+        return;
+    }
+    csv_row_quoted(row, s, len);
+}
+
+// Flushes every writer and waits for its blocks to land, so each file ends
+// on a whole row (and, compressed, on a whole gzip member or zstd frame).
+// Rows must not be written meanwhile.
+void csv_sync(WriterPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    for (CsvWriter* w = pool->active; w; w = w->next) {
+        pthread_mutex_lock(&w->lock);
+        flush(w);
+        pthread_mutex_unlock(&w->lock);
+    }
+    for (int i = 0; i < pool->writer_capacity; i++) {
+        if (pool->writers[i]) wait_written(pool->writers[i]);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void csv_free_parts(CsvPart* parts, int num_parts) {
+    for (int i = 0; i < num_parts; i++) {
+        free(parts[i].path);
+        row_index_free(&parts[i].index);
+    }
+    free(parts);
+}
+
+// Drops one reference; the last one flushes and frees the writer and
+// returns 1, so the caller knows the file is complete. A sharded or indexed
+// writer then hands its parts to the caller, who frees them with
+// csv_free_parts; parts is set to NULL otherwise.
+int csv_close(CsvWriter* w, CsvPart** parts, int* num_parts) {
+    *parts = NULL;
+    *num_parts = 0;
+    if (!w) return 0;
+    WriterPool* pool = w->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (--w->refs > 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+    pthread_mutex_lock(&w->lock);
+    if (w->buf) park(w);
+    pthread_mutex_unlock(&w->lock);
+    wait_written(w);
+    remove_writer(pool, w);
+    *parts = w->parts;
+    *num_parts = w->num_parts;
+    pthread_mutex_destroy(&w->lock);
+    free(w->header);
+    free(w->path);
+    free(w);
+    int last = pool->num_writers == 0;
+    if (last) {
+        free(pool->writers);
+        pool->writers = NULL;
+        pool->writer_capacity = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (last && pool->compress_threads) stop_compression(pool);
+    if (last && pool->write_threads) stop_writers(pool);
+    return 1;
+}
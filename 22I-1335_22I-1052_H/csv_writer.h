@@ -0,0 +1,144 @@
+#ifndef CSV_WRITER_H
+#define CSV_WRITER_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "compress.h"
+#include "row_index.h"
+
+#define CSV_BUFFER_SIZE (256 * 1024)
+#define CSV_MAX_OPEN_FILES 256
+#define CSV_MAX_COMPRESS_THREADS 8
+#define CSV_WRITE_QUEUE_SIZE 16     // blocks a writer thread may fall behind
+
+// A row (or header) being formatted. Rows are built privately by each thread
+// and handed to a writer whole, so rows from different threads never mix.
+// Fields are written straight from the caller's memory and quoted only when
+// RFC 4180 requires it.
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} CsvRow;
+
+void csv_row_reserve(CsvRow* row, size_t extra);
+void csv_row_raw(CsvRow* row, const char* data, size_t len);
+void csv_row_int(CsvRow* row, long value);
+void csv_row_field(CsvRow* row, const char* s, size_t len);
+void csv_row_quoted(CsvRow* row, const char* s, size_t len);
+void csv_row_free(CsvRow* row);
+
+static inline void csv_row_char(CsvRow* row, char c) {
+    if (row->len == row->cap) csv_row_reserve(row, 1);
+    row->data[row->len++] = c;
+}
+
+// One part file of a sharded table file (--shard-rows, --shard-bytes), or
+// the whole file of an indexed one (--emit-index). The key is the first
+// column of each row: the id, or the parent id of an array table.
+typedef struct {
+    char* path;
+    unsigned long long rows;
+    size_t bytes;       // header and rows, before compression
+    long first_key;     // smallest and largest key, 0 while empty
+    long last_key;
+    RowIndexBuilder index;  // --emit-index only
+} CsvPart;
+
+// Buffered output for one table file. Writers are shared per path within a
+// WriterPool and stay logically open for the whole run. Only the most recently used ones hold a
+// descriptor and buffer; the rest are flushed and closed, then reopened in
+// append mode when written again. All writer calls are thread-safe. A row
+// only takes its writer's lock, so threads writing different files do not
+// wait for each other, even while one of them is in write(2).
+//
+// With compression on, each flushed buffer is queued for a pool of
+// compression threads, and the compressed blocks are appended to the file in
+// the order they were queued. With writer threads (--pipeline) flushed
+// buffers go to the thread that owns the file, and rows may then come from
+// only one thread at a time. Either way the blocks are written through the
+// writer's descriptor, which travels with them; parking hands it over with
+// the last block, and the thread that writes that block closes it.
+//
+// A sharded writer rotates through part files, x.part-00001.csv and on,
+// each starting with the header. The registry still knows it by the
+// unsharded path. An indexed writer that is not sharded has a single part,
+// the file itself.
+typedef struct CsvWriter {
+    pthread_mutex_t lock;   // guards the buffer, the descriptor and the parts
+    int fd;
+    char* path;
+    char* file;     // file being written: path, or the current part's
+    char* buf;      // NULL while the writer is parked
+    size_t len;
+    int truncated;  // first activation truncates, later ones append
+    int refs;
+    unsigned long hash;
+    unsigned long last_use; // pool clock when last written, to pick the writer to park
+    struct CsvWriter* prev; // list of active writers
+    struct CsvWriter* next;
+    unsigned long blocks_queued;    // blocks handed to the pool or a writer thread
+    unsigned long blocks_written;   // blocks appended to the file so far
+    struct CompressJob* done;       // compressed blocks waiting for their turn
+    struct WriterPool* pool;
+    // Sharded and indexed writers only
+    size_t stem;        // part numbers go into the path here
+    char* header;       // repeated at the top of every part
+    size_t header_len;
+    CsvPart* parts;     // every part so far, the last one being written
+    int num_parts;
+} CsvWriter;
+
+// Every writer of one converter, with its compression and writer threads.
+// Write errors are reported through the converter; once it has failed,
+// output is dropped rather than written.
+typedef struct WriterPool {
+    Converter* converter;
+    Compression compression;
+    int threads;            // writer threads, 0 writes on the caller's thread
+    unsigned long long shard_rows;  // rows per part file, 0 for no limit
+    size_t shard_bytes;             // bytes per part file, 0 for no limit
+    int emit_index;                 // collect a row index per part
+    // Guards the registry and the list of active writers. Taken before a
+    // writer's lock, and only to open, park, reopen, sync or close writers.
+    pthread_mutex_t lock;
+    // Guards the compression queue and the blocks waiting for their turn;
+    // taken last
+    pthread_mutex_t queue_lock;
+    // Compression queue and threads
+    struct CompressJob* job_head;
+    struct CompressJob* job_tail;
+    int num_jobs;
+    int max_jobs;
+    pthread_t* compress_threads;
+    int num_compress_threads;
+    int compress_stopping;
+    pthread_cond_t job_ready;
+    pthread_cond_t job_space;
+    pthread_cond_t block_written;
+    // Writer threads: each owns the files whose path hash maps to it and
+    // takes their blocks from its own queue, so every file is written in
+    // flush order
+    struct WriteThread* write_threads;
+    // Writers by path, so every table sharing a file shares one stream
+    CsvWriter** writers;
+    int writer_capacity;
+    int num_writers;
+    // Writers holding a descriptor and buffer
+    CsvWriter* active;
+    int num_active;
+    int max_active;
+    unsigned long clock;    // advanced by every flush and reopening
+} WriterPool;
+
+void csv_pool_init(WriterPool* pool, Converter* converter, Compression compression, int threads,
+                   unsigned long long shard_rows, size_t shard_bytes, int emit_index);
+void csv_pool_destroy(WriterPool* pool);
+CsvWriter* csv_open(WriterPool* pool, const char* path, size_t stem, CsvRow* header);
+CsvWriter* csv_open_existing(WriterPool* pool, const char* path);
+void csv_sync(WriterPool* pool);
+void csv_write_row(CsvWriter* w, CsvRow* row, long key);
+int csv_close(CsvWriter* w, CsvPart** parts, int* num_parts);
+void csv_free_parts(CsvPart* parts, int num_parts);
+
+#endif
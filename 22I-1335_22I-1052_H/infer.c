@@ -0,0 +1,337 @@
+#include "infer.h"
+#include "converter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Pending nodes of the walk; a node is either a standalone object (array
+// NULL), an element object of array, or an array stored under key
+typedef struct InferItem {
+    ASTNode* node;
+    char* key;
+    TableSchema* array;
+} InferItem;
+
+void infer_init(Converter* c) {
+    memset(&c->infer, 0, sizeof(InferState));
+    pthread_mutex_init(&c->infer.lock, NULL);
+}
+
+static unsigned long hash_string(const char* s, unsigned long hash) {
+    for (const unsigned char* p = (const unsigned char*)s; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static unsigned long hash_schema(const char* name, int is_array) {
+    return hash_string(name, 14695981039346656037UL) ^ (unsigned long)is_array;
+}
+
+// Column keys are interned object keys, so they hash and compare by pointer
+static unsigned long hash_column(const char* key, int is_ref) {
+    unsigned long hash = ((unsigned long)key ^ (unsigned long)is_ref) * 0x9e3779b97f4a7c15UL;
+    return hash ^ (hash >> 32);
+}
+
+ColumnType value_column_type(ASTNode* node) {
+    switch (node->type) {
+        case NUM:
+            for (uint32_t i = 0; i < node->count; i++) {
+                char c = ast_text(node)[i];
+                if (c == '.' || c == 'e' || c == 'E') return COLUMN_FLOAT;
+            }
+            return COLUMN_INT;
+        case TRU:
+        case FALS:
+            return COLUMN_BOOL;
+        case STR:
+            return COLUMN_STRING;
+        default:
+            return COLUMN_NONE;
+    }
+}
+
+static ColumnType merge_types(ColumnType a, ColumnType b) {
+    if (a == COLUMN_NONE || a == b) return b;
+    if (b == COLUMN_NONE) return a;
+    if ((a == COLUMN_INT && b == COLUMN_FLOAT) || (a == COLUMN_FLOAT && b == COLUMN_INT)) return COLUMN_FLOAT;
+    return COLUMN_STRING;
+}
+
+static TableSchema* map_find(InferState* s, const char* name, int is_array, unsigned long hash) {
+    if (s->capacity == 0) return NULL;
+    int slot = hash & (s->capacity - 1);
+    while (s->schemas[slot]) {
+        TableSchema* schema = s->schemas[slot];
+        if (schema->hash == hash && schema->is_array == is_array && strcmp(schema->name, name) == 0) return schema;
+        slot = (slot + 1) & (s->capacity - 1);
+    }
+    return NULL;
+}
+
+static void map_insert(InferState* s, TableSchema* schema) {
+    if ((s->count + 1) * 2 > s->capacity) {
+        int old_capacity = s->capacity;
+        TableSchema** old = s->schemas;
+        s->capacity = old_capacity ? old_capacity * 2 : 64;
+        s->schemas = calloc(s->capacity, sizeof(TableSchema*));
+        if (!s->schemas) {
+            fprintf(stderr, "Error: Memory allocation failed for schema map\n");
+            exit(1);
+        }
+        for (int i = 0; i < old_capacity; i++) {
+            if (!old[i]) continue;
+            int slot = old[i]->hash & (s->capacity - 1);
+            while (s->schemas[slot]) slot = (slot + 1) & (s->capacity - 1);
+            s->schemas[slot] = old[i];
+        }
+        free(old);
+    }
+    int slot = schema->hash & (s->capacity - 1);
+    while (s->schemas[slot]) slot = (slot + 1) & (s->capacity - 1);
+    s->schemas[slot] = schema;
+    s->count++;
+}
+
+static TableSchema* get_schema(InferState* s, const char* name, int is_array) {
+    unsigned long hash = hash_schema(name, is_array);
+    TableSchema* schema = map_find(s, name, is_array, hash);
+    if (schema) return schema;
+
+    schema = calloc(1, sizeof(TableSchema));
+    if (!schema || !(schema->name = strdup(name))) {
+        fprintf(stderr, "Error: Memory allocation failed for table schema\n");
+        exit(1);
+    }
+    schema->is_array = is_array;
+    schema->table_index = -1;
+    schema->hash = hash;
+    map_insert(s, schema);
+    return schema;
+}
+
+static void index_columns(TableSchema* schema) {
+    free(schema->slots);
+    schema->num_slots = 16;
+    while (schema->num_slots < schema->num_columns * 2) schema->num_slots *= 2;
+    schema->slots = malloc(schema->num_slots * sizeof(int));
+    if (!schema->slots) {
+        fprintf(stderr, "Error: Memory allocation failed for schema columns\n");
+        exit(1);
+    }
+    memset(schema->slots, -1, schema->num_slots * sizeof(int));
+    for (int i = 0; i < schema->num_columns; i++) {
+        Column* column = &schema->columns[i];
+        int slot = hash_column(column->key, column->is_ref) & (schema->num_slots - 1);
+        while (schema->slots[slot] != -1) slot = (slot + 1) & (schema->num_slots - 1);
+        schema->slots[slot] = i;
+    }
+}
+
+// Returns the column for key, or -1. Safe without the lock once frozen.
+int schema_column(TableSchema* schema, const char* key, int is_ref) {
+    if (schema->num_slots == 0) return -1;
+    int slot = hash_column(key, is_ref) & (schema->num_slots - 1);
+    while (schema->slots[slot] != -1) {
+        Column* column = &schema->columns[schema->slots[slot]];
+        if (column->is_ref == is_ref && column->key == key) return schema->slots[slot];
+        slot = (slot + 1) & (schema->num_slots - 1);
+    }
+    return -1;
+}
+
+static void add_column(TableSchema* schema, const char* key, int is_ref, ColumnType type) {
+    int index = schema_column(schema, key, is_ref);
+    if (index >= 0) {
+        schema->columns[index].type = merge_types(schema->columns[index].type, type);
+        return;
+    }
+    if (schema->num_columns == schema->capacity) {
+        schema->capacity = schema->capacity ? schema->capacity * 2 : 8;
+        schema->columns = realloc(schema->columns, schema->capacity * sizeof(Column));
+        if (!schema->columns) {
+            fprintf(stderr, "Error: Memory allocation failed for schema columns\n");
+            exit(1);
+        }
+    }
+    Column* column = &schema->columns[schema->num_columns++];
+    column->key = (char*)key;
+    column->is_ref = is_ref;
+    column->type = type;
+    if (schema->num_columns * 2 > schema->num_slots) {
+        index_columns(schema);
+    } else {
+        int slot = hash_column(key, is_ref) & (schema->num_slots - 1);
+        while (schema->slots[slot] != -1) slot = (slot + 1) & (schema->num_slots - 1);
+        schema->slots[slot] = schema->num_columns - 1;
+    }
+}
+
+// Table file name for an object or array stored under key
+static char* table_name(InferState* s, char* key, const char* fallback) {
+    if (!key) key = (char*)fallback;
+    size_t len = strlen(key) + 5;
+    if (len > s->name_capacity) {
+        s->name_capacity = len * 2;
+        s->name_buffer = realloc(s->name_buffer, s->name_capacity);
+        if (!s->name_buffer) {
+            fprintf(stderr, "Error: Memory allocation failed for table name\n");
+            exit(1);
+        }
+    }
+    sprintf(s->name_buffer, "%s.csv", key);
+    return s->name_buffer;
+}
+
+static void push_item(InferState* s, ASTNode* node, char* key, TableSchema* array) {
+    if (s->num_items == s->max_items) {
+        s->max_items = s->max_items ? s->max_items * 2 : 64;
+        s->items = realloc(s->items, s->max_items * sizeof(InferItem));
+        if (!s->items) {
+            fprintf(stderr, "Error: Memory allocation failed for inference stack\n");
+            exit(1);
+        }
+    }
+    s->items[s->num_items].node = node;
+    s->items[s->num_items].key = key;
+    s->items[s->num_items].array = array;
+    s->num_items++;
+}
+
+// Adds an object's members to its table's schema; nested objects and arrays
+// are queued when descend is set
+static void infer_object(InferState* s, TableSchema* schema, ASTNode* object, int descend) {
+    ASTNode* values = ast_children(object);
+    char** keys = ast_keys(object);
+    for (uint32_t i = 0; i < object->count; i++) {
+        ASTNode* value = &values[i];
+        char* key = keys[i] ? keys[i] : "unknown";
+        if (value->type == OBJ) {
+            if (!schema->frozen) add_column(schema, key, 1, COLUMN_INT);
+            if (descend) push_item(s, value, key, NULL);
+        } else if (value->type == ARR) {
+            if (descend) push_item(s, value, key, NULL);
+        } else if (!schema->frozen) {
+            add_column(schema, key, 0, value_column_type(value));
+        }
+    }
+}
+
+static void infer_element(InferState* s, TableSchema* schema, ASTNode* element, int descend) {
+    if (!element) return;
+    if (element->type == OBJ) {
+        if (!schema->frozen) schema->has_objects = 1;
+        if (descend) push_item(s, element, NULL, schema);
+    } else if (element->type != ARR && !schema->frozen) {
+        schema->has_scalars = 1;
+        schema->value_type = merge_types(schema->value_type, value_column_type(element));
+    }
+}
+
+// Walks the queued nodes with an explicit stack, like CSV generation
+static void run_items(Converter* c) {
+    InferState* s = &c->infer;
+    while (s->num_items > 0) {
+        InferItem item = s->items[--s->num_items];
+        ASTNode* node = item.node;
+        if (node->type == OBJ) {
+            TableSchema* schema = item.array ? item.array : get_schema(s, table_name(s, item.key, "main"), 0);
+            infer_object(s, schema, node, 1);
+        } else if (node->type == ARR) {
+            TableSchema* schema = get_schema(s, table_name(s, item.key, "array"), 1);
+            int count = node->count;
+            if (c->options.infer == INFER_SAMPLE && count > INFER_SAMPLE_ROWS) count = INFER_SAMPLE_ROWS;
+            // Queued last to first so elements are seen in order
+            for (int i = count - 1; i >= 0; i--) {
+                infer_element(s, schema, ast_children(node) + i, 1);
+            }
+        }
+    }
+}
+
+// Merges everything a document would write into the table schemas
+void infer_document(Converter* c, ASTNode* root) {
+    if (!root) return;
+    pthread_mutex_lock(&c->infer.lock);
+    push_item(&c->infer, root, root->type == ARR ? "root" : NULL, NULL);
+    run_items(c);
+    pthread_mutex_unlock(&c->infer.lock);
+}
+
+// Same for one element of a streamed array
+void infer_array_element(Converter* c, char* array_key, ASTNode* element) {
+    InferState* s = &c->infer;
+    pthread_mutex_lock(&s->lock);
+    infer_element(s, get_schema(s, table_name(s, array_key, "array"), 1), element, 1);
+    run_items(c);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Fallback for a table that inference never saw (outside the sample): takes
+// the columns from the object, or first array element, that creates it
+void infer_creating_node(Converter* c, TableSchema* schema, ASTNode* node) {
+    pthread_mutex_lock(&c->infer.lock);
+    if (!schema->frozen && node) {
+        if (schema->is_array) infer_element(&c->infer, schema, node, 0);
+        else if (node->type == OBJ) infer_object(&c->infer, schema, node, 0);
+    }
+    pthread_mutex_unlock(&c->infer.lock);
+}
+
+TableSchema* find_table_schema(Converter* c, const char* name, int is_array) {
+    pthread_mutex_lock(&c->infer.lock);
+    TableSchema* schema = map_find(&c->infer, name, is_array, hash_schema(name, is_array));
+    pthread_mutex_unlock(&c->infer.lock);
+    return schema;
+}
+
+TableSchema* lookup_table_schema(Converter* c, const char* name, int is_array) {
+    pthread_mutex_lock(&c->infer.lock);
+    TableSchema* schema = get_schema(&c->infer, name, is_array);
+    pthread_mutex_unlock(&c->infer.lock);
+    return schema;
+}
+
+static int compare_columns(const void* a, const void* b) {
+    const Column* x = a;
+    const Column* y = b;
+    int order = strcmp(x->key, y->key);
+    return order ? order : x->is_ref - y->is_ref;
+}
+
+// Sorts the columns into key order, the order rows have always used, and
+// stops further inference into this table
+void freeze_schema(Converter* c, TableSchema* schema) {
+    pthread_mutex_lock(&c->infer.lock);
+    if (!schema->frozen) {
+        if (schema->num_columns > 0) qsort(schema->columns, schema->num_columns, sizeof(Column), compare_columns);
+        index_columns(schema);
+        schema->frozen = 1;
+    }
+    pthread_mutex_unlock(&c->infer.lock);
+}
+
+void free_table_schemas(Converter* c) {
+    InferState* s = &c->infer;
+    for (int i = 0; i < s->capacity; i++) {
+        TableSchema* schema = s->schemas[i];
+        if (!schema) continue;
+        free(schema->columns);
+        free(schema->slots);
+        free(schema->name);
+        free(schema);
+    }
+    free(s->schemas);
+    s->schemas = NULL;
+    s->capacity = 0;
+    s->count = 0;
+    free(s->items);
+    s->items = NULL;
+    s->max_items = 0;
+    free(s->name_buffer);
+    s->name_buffer = NULL;
+    s->name_capacity = 0;
+}
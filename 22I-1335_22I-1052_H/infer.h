@@ -0,0 +1,72 @@
+#ifndef INFER_H
+#define INFER_H
+
+#include <pthread.h>
+#include "ast.h"
+
+// Schema inference (--infer): before rows are written, documents are walked
+// to collect one union schema per table file. Every object stored in a table
+// contributes its keys, and each column gets the narrowest type that holds
+// all of its values. A table's schema is frozen when the table is created;
+// keys first seen after that are dropped with a warning.
+#define INFER_SAMPLE_ROWS 1000
+
+// Ordered so that merging two types is a max, except that BOOL and the
+// numeric types only meet at STRING
+typedef enum {
+    COLUMN_NONE,    // only nulls seen so far
+    COLUMN_INT,
+    COLUMN_FLOAT,
+    COLUMN_BOOL,
+    COLUMN_STRING
+} ColumnType;
+
+typedef struct {
+    char* key;          // interned
+    int is_ref;         // nested object, written as the key_id foreign key
+    ColumnType type;
+} Column;
+
+typedef struct TableSchema {
+    char* name;         // table file name, e.g. items.csv
+    int is_array;
+    Column* columns;    // in key order once frozen
+    int num_columns;
+    int capacity;
+    int* slots;         // open-addressing index into columns
+    int num_slots;
+    int has_objects;    // arrays: elements that are objects
+    int has_scalars;    // arrays: elements that are scalars
+    ColumnType value_type;  // arrays: type of the scalar elements
+    int frozen;
+    int table_index;    // -1 until the table is created
+    unsigned long hash;
+} TableSchema;
+
+// A conversion's schemas. The lock guards the map, the walk and every
+// schema that is not frozen yet; frozen schemas never change again and are
+// read without it.
+typedef struct {
+    pthread_mutex_t lock;
+    TableSchema** schemas;      // open addressing by name and kind
+    int capacity;
+    int count;
+    struct InferItem* items;    // pending nodes of the walk
+    int num_items;
+    int max_items;
+    char* name_buffer;
+    size_t name_capacity;
+} InferState;
+
+void infer_init(Converter* c);
+void infer_document(Converter* c, ASTNode* root);
+void infer_array_element(Converter* c, char* array_key, ASTNode* element);
+void infer_creating_node(Converter* c, TableSchema* schema, ASTNode* node);
+TableSchema* find_table_schema(Converter* c, const char* name, int is_array);
+TableSchema* lookup_table_schema(Converter* c, const char* name, int is_array);
+void freeze_schema(Converter* c, TableSchema* schema);
+int schema_column(TableSchema* schema, const char* key, int is_ref);
+ColumnType value_column_type(ASTNode* node);
+void free_table_schemas(Converter* c);
+
+#endif
@@ -0,0 +1,307 @@
+#include "intern.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// The pool is split into shards by hash, each with its own lock, so parser
+// threads interning at the same time rarely meet
+#define INTERN_SHARDS 64
+#define INTERN_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+    const char* text;
+    unsigned len;
+    unsigned hash;      // low bits of the full hash, checked before memcmp
+} InternEntry;
+
+// Strings are bump-allocated from chunks, NUL-terminated
+typedef struct InternChunk {
+    struct InternChunk* next;
+    size_t used;
+    size_t size;
+    char data[];
+} InternChunk;
+
+typedef struct {
+    pthread_mutex_t lock;
+    InternEntry* slots;
+    int capacity;
+    int count;
+    InternChunk* chunks;
+    // Where the shard stood at intern_mark
+    int mark_count;
+    InternChunk* mark_chunk;
+    size_t mark_used;
+} InternShard;
+
+static InternShard shards[INTERN_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static int num_users = 0;      // converters holding the pool
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+static int num_values = 0;
+static int num_keys = 0;
+static int mark_values = 0;
+static int mark_keys = 0;
+static int value_misses = 0;    // values not found once the value pool was full
+
+// Once the value pool is full and this many values have missed it, only the
+// per-thread caches are checked for values; the shards are not searched
+#define INTERN_MAX_MISSES 4096
+
+// Each thread keeps the strings it found or added last in a small
+// direct-mapped cache, so repeated keys and values skip the shard lock.
+// intern_cleanup bumps the generation, which empties every cache on its
+// next use.
+#define INTERN_CACHE_SIZE 256
+
+static unsigned generation = 1;
+static __thread InternEntry cache[INTERN_CACHE_SIZE];
+static __thread unsigned cache_generation = 0;
+
+static void init_shards() {
+    for (int i = 0; i < INTERN_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].slots = NULL;
+        shards[i].capacity = 0;
+        shards[i].count = 0;
+        shards[i].chunks = NULL;
+    }
+}
+
+static unsigned long hash_bytes(const char* s, size_t len) {
+    unsigned long hash = 0x9e3779b97f4a7c15UL ^ len;
+    while (len >= 8) {
+        unsigned long word;
+        memcpy(&word, s, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdUL;
+        hash ^= hash >> 32;
+        s += 8;
+        len -= 8;
+    }
+    unsigned long word = 0;
+    for (size_t i = 0; i < len; i++) word |= (unsigned long)(unsigned char)s[i] << (i * 8);
+    hash = (hash ^ word) * 0xc4ceb9fe1a85ec53UL;
+    return hash ^ (hash >> 29);
+}
+
+static char* store(InternShard* shard, const char* s, size_t len) {
+    InternChunk* chunk = shard->chunks;
+    if (!chunk || chunk->used + len + 1 > chunk->size) {
+        size_t size = len + 1 > INTERN_CHUNK_SIZE ? len + 1 : INTERN_CHUNK_SIZE;
+        chunk = malloc(sizeof(InternChunk) + size);
+        stats_count_alloc(sizeof(InternChunk) + size);
+        if (!chunk) {
+            fprintf(stderr, "Error: Memory allocation failed for string pool\n");
+            exit(1);
+        }
+        chunk->next = shard->chunks;
+        chunk->used = 0;
+        chunk->size = size;
+        shard->chunks = chunk;
+    }
+    char* text = chunk->data + chunk->used;
+    memcpy(text, s, len);
+    text[len] = '\0';
+    chunk->used += len + 1;
+    return text;
+}
+
+static void grow(InternShard* shard) {
+    int old_capacity = shard->capacity;
+    InternEntry* old = shard->slots;
+    shard->capacity = old_capacity ? old_capacity * 2 : 256;
+    shard->slots = calloc(shard->capacity, sizeof(InternEntry));
+    if (!shard->slots) {
+        fprintf(stderr, "Error: Memory allocation failed for string pool\n");
+        exit(1);
+    }
+    for (int i = 0; i < old_capacity; i++) {
+        if (!old[i].text) continue;
+        int slot = old[i].hash & (shard->capacity - 1);
+        while (shard->slots[slot].text) slot = (slot + 1) & (shard->capacity - 1);
+        shard->slots[slot] = old[i];
+    }
+    free(old);
+}
+
+// Finds s in its shard, adding it unless is_value is set and the value pool
+// is full; returns NULL only in that case
+static char* intern(const char* s, size_t len, int is_value) {
+    unsigned long hash = hash_bytes(s, len);
+    unsigned short_hash = (unsigned)hash;
+    unsigned current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    if (cache_generation != current) {
+        memset(cache, 0, sizeof(cache));
+        cache_generation = current;
+    }
+    InternEntry* cached = &cache[short_hash & (INTERN_CACHE_SIZE - 1)];
+    if (cached->text && cached->hash == short_hash && cached->len == len && memcmp(cached->text, s, len) == 0) {
+        return (char*)cached->text;
+    }
+    if (is_value && __atomic_load_n(&value_misses, __ATOMIC_RELAXED) >= INTERN_MAX_MISSES) {
+        return NULL;
+    }
+
+    pthread_once(&shards_once, init_shards);
+    InternShard* shard = &shards[hash >> 58];
+    pthread_mutex_lock(&shard->lock);
+    if (shard->capacity > 0) {
+        int slot = short_hash & (shard->capacity - 1);
+        while (shard->slots[slot].text) {
+            InternEntry* entry = &shard->slots[slot];
+            if (entry->hash == short_hash && entry->len == len && memcmp(entry->text, s, len) == 0) {
+                char* text = (char*)entry->text;
+                pthread_mutex_unlock(&shard->lock);
+                *cached = (InternEntry){ text, len, short_hash };
+                return text;
+            }
+            slot = (slot + 1) & (shard->capacity - 1);
+        }
+    }
+    if (is_value) {
+        if (__atomic_load_n(&num_values, __ATOMIC_RELAXED) >= INTERN_MAX_VALUES) {
+            pthread_mutex_unlock(&shard->lock);
+            __atomic_fetch_add(&value_misses, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        __atomic_fetch_add(&num_values, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&num_keys, 1, __ATOMIC_RELAXED);
+    }
+    if ((shard->count + 1) * 2 > shard->capacity) grow(shard);
+    char* text = store(shard, s, len);
+    int slot = short_hash & (shard->capacity - 1);
+    while (shard->slots[slot].text) slot = (slot + 1) & (shard->capacity - 1);
+    shard->slots[slot].text = text;
+    shard->slots[slot].len = len;
+    shard->slots[slot].hash = short_hash;
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+    // A new value is likely unique; keep it from evicting a key
+    if (!is_value) *cached = (InternEntry){ text, len, short_hash };
+    return text;
+}
+
+char* intern_string(const char* s, size_t len) {
+    return intern(s, len, 0);
+}
+
+// Returns the pooled copy of a scalar value, or NULL if it is too long or
+// the value pool is full
+const char* intern_value(const char* s, size_t len) {
+    if (len > INTERN_MAX_VALUE_LEN) return NULL;
+    return intern(s, len, 1);
+}
+
+void intern_cleanup() {
+    pthread_once(&shards_once, init_shards);
+    for (int i = 0; i < INTERN_SHARDS; i++) {
+        InternChunk* chunk = shards[i].chunks;
+        while (chunk) {
+            InternChunk* next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        free(shards[i].slots);
+        shards[i].slots = NULL;
+        shards[i].capacity = 0;
+        shards[i].count = 0;
+        shards[i].chunks = NULL;
+        shards[i].mark_count = 0;
+        shards[i].mark_chunk = NULL;
+        shards[i].mark_used = 0;
+    }
+    num_values = 0;
+    num_keys = 0;
+    mark_values = 0;
+    mark_keys = 0;
+    value_misses = 0;
+    __atomic_fetch_add(&generation, 1, __ATOMIC_RELEASE);
+}
+
+int intern_keys() {
+    return __atomic_load_n(&num_keys, __ATOMIC_RELAXED);
+}
+
+// Both are only done while one converter holds the pool, since another
+// could be using the strings added since the mark
+void intern_mark() {
+    pthread_once(&shards_once, init_shards);
+    pthread_mutex_lock(&users_lock);
+    if (num_users == 1) {
+        for (int i = 0; i < INTERN_SHARDS; i++) {
+            InternShard* shard = &shards[i];
+            shard->mark_count = shard->count;
+            shard->mark_chunk = shard->chunks;
+            shard->mark_used = shard->chunks ? shard->chunks->used : 0;
+        }
+        mark_values = num_values;
+        mark_keys = num_keys;
+    }
+    pthread_mutex_unlock(&users_lock);
+}
+
+// Whether text was stored after the mark: in a chunk added since, or past
+// the marked end of the chunk that was current then
+static int after_mark(InternShard* shard, const char* text) {
+    for (InternChunk* chunk = shard->chunks; chunk != shard->mark_chunk; chunk = chunk->next) {
+        if (text >= chunk->data && text < chunk->data + chunk->size) return 1;
+    }
+    return shard->mark_chunk && text >= shard->mark_chunk->data + shard->mark_used &&
+           text < shard->mark_chunk->data + shard->mark_chunk->size;
+}
+
+// Drops every string added since intern_mark. Shards that grew are rebuilt
+// without them, since removing entries would break the probe runs of
+// others. Every thread's cache is emptied, as it may point at them.
+void intern_rollback() {
+    pthread_mutex_lock(&users_lock);
+    if (num_users == 1) {
+        for (int i = 0; i < INTERN_SHARDS; i++) {
+            InternShard* shard = &shards[i];
+            if (shard->count == shard->mark_count) continue;
+            pthread_mutex_lock(&shard->lock);
+            InternEntry* old = shard->slots;
+            shard->slots = calloc(shard->capacity, sizeof(InternEntry));
+            if (!shard->slots) {
+                fprintf(stderr, "Error: Memory allocation failed for string pool\n");
+                exit(1);
+            }
+            for (int j = 0; j < shard->capacity; j++) {
+                if (!old[j].text || after_mark(shard, old[j].text)) continue;
+                int slot = old[j].hash & (shard->capacity - 1);
+                while (shard->slots[slot].text) slot = (slot + 1) & (shard->capacity - 1);
+                shard->slots[slot] = old[j];
+            }
+            free(old);
+            while (shard->chunks != shard->mark_chunk) {
+                InternChunk* next = shard->chunks->next;
+                free(shard->chunks);
+                shard->chunks = next;
+            }
+            if (shard->chunks) shard->chunks->used = shard->mark_used;
+            shard->count = shard->mark_count;
+            pthread_mutex_unlock(&shard->lock);
+        }
+        num_values = mark_values;
+        num_keys = mark_keys;
+        __atomic_fetch_add(&generation, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&users_lock);
+}
+
+void intern_retain() {
+    pthread_mutex_lock(&users_lock);
+    num_users++;
+    pthread_mutex_unlock(&users_lock);
+}
+
+// Frees the pool once no converter holds it; a string interned by one
+// converter may be in use by another until then
+void intern_release() {
+    pthread_mutex_lock(&users_lock);
+    if (--num_users == 0) intern_cleanup();
+    pthread_mutex_unlock(&users_lock);
+}
@@ -0,0 +1,31 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+// String pool shared by every thread. Equal strings intern to the same
+// pointer, so interned strings compare with == and are never freed
+// individually; they all go at once in intern_cleanup. Converters hold the
+// pool with intern_retain and intern_release, and the last release cleans
+// it up.
+//
+// Object keys are always interned. Short scalar values are interned only
+// while the value pool has room, which keeps memory bounded on streams of
+// unique values; once it is full and stops getting hits, values are no
+// longer looked up at all.
+#define INTERN_MAX_VALUE_LEN 64
+#define INTERN_MAX_VALUES (1 << 16)
+
+char* intern_string(const char* s, size_t len);
+const char* intern_value(const char* s, size_t len);
+int intern_keys();
+// A converter that holds the pool alone can take back the strings of a
+// document nothing kept: intern_rollback drops everything interned since
+// intern_mark. With other converters holding the pool, neither does anything.
+void intern_mark();
+void intern_rollback();
+void intern_retain();
+void intern_release();
+void intern_cleanup();
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef JSON2RELCSV_H
+#define JSON2RELCSV_H
+
+#include <stddef.h>
+
+// libjson2relcsv: converts JSON documents into relational CSV tables.
+//
+// A Converter holds everything one conversion needs: its options, tables,
+// schema catalog, open writers and threads. Nothing is kept in process
+// globals apart from the string pool, which is thread-safe and shared, so
+// several conversions can run at once in one process. Each Converter runs
+// one conversion; create a new one for the next.
+//
+// Errors are returned, not fatal: converter_run gives back a status and
+// converter_error the message. Only a failed memory allocation still ends
+// the process.
+typedef struct Converter Converter;
+
+typedef enum {
+    FORMAT_CSV,
+    FORMAT_ARROW
+} OutputFormat;
+
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,  // needs zlib (built with -DHAVE_ZLIB)
+    COMPRESS_ZSTD   // needs libzstd (built with -DHAVE_ZSTD)
+} Compression;
+
+typedef enum {
+    INFER_OFF,
+    INFER_SAMPLE,   // only the first INFER_SAMPLE_ROWS elements of each array
+    INFER_FULL      // every element
+} InferMode;
+
+typedef enum {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON
+} StatsFormat;
+
+typedef enum {
+    CONVERT_OK,
+    CONVERT_ERROR_OPTIONS,  // invalid or conflicting options
+    CONVERT_ERROR_INPUT,    // an input cannot be read, or converted as asked
+    CONVERT_ERROR_SYNTAX,   // malformed JSON, or nesting past max_depth
+    CONVERT_ERROR_OUTPUT,   // an output file cannot be written
+    CONVERT_ERROR_MANIFEST, // the --append manifest does not fit this run
+    CONVERT_ERROR_RESOURCE  // a thread cannot be started
+} ConvertStatus;
+
+// The command-line options, one field each; see README.md. Fill in with
+// converter_default_options first. The paths and the include and exclude
+// selector lists are not copied and must outlive the converter.
+typedef struct {
+    const char* out_dir;        // "." by default
+    int print_ast;
+    int stream;
+    int ndjson;
+    int pipeline;
+    int writers;                // --pipeline writer threads, 0 for the default
+    int simd_lexer;
+    OutputFormat format;
+    Compression compression;
+    InferMode infer;
+    int max_depth;              // 0 for no limit
+    int jobs;                   // batch worker threads, 0 unless --jobs
+    int split_jobs;             // --split parser threads, 0 for none
+    int append;
+    size_t checkpoint_interval; // input bytes between checkpoints, 0 for none
+    unsigned long long shard_rows;  // rows per part file, 0 for no limit
+    size_t shard_bytes;         // bytes per part file, 0 for no limit
+    int emit_index;             // a row index next to every table file
+    const char* emit_cache;     // save the parsed tree here (see ast_cache.h)
+    const char* from_cache;     // convert this saved tree instead of an input
+    const char** include;       // --include selectors (see selector.h)
+    int num_include;
+    const char** exclude;       // --exclude selectors
+    int num_exclude;
+    StatsFormat stats;          // printed to stderr at the end of the run
+    int flush_interval_ms;      // --serve: longest a converted row waits to be flushed
+    size_t flush_bytes;         // --serve: request bytes that trigger a flush sooner
+} ConverterOptions;
+
+void converter_default_options(ConverterOptions* options);
+Converter* converter_create(const ConverterOptions* options);
+ConvertStatus converter_run(Converter* converter, char** inputs, int num_inputs);
+
+// Serves conversion requests on a Unix domain socket instead of converting
+// files (see serve.h), until converter_stop is called or an output fails.
+// Like converter_run, it can be called once per converter.
+ConvertStatus converter_serve(Converter* converter, const char* socket_path);
+// Makes converter_serve finish the requests in hand, close the tables and
+// return. Safe to call from a signal handler or another thread.
+void converter_stop(Converter* converter);
+const char* converter_error(Converter* converter);
+void converter_free(Converter* converter);
+
+#endif
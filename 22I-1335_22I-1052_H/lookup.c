@@ -0,0 +1,70 @@
+// Point lookups in a table written with --emit-index.
+//
+// Usage: json2relcsv-lookup <table.csv> <key>...
+//
+// Prints the rows whose first column (the id, or an array table's parent
+// id) is one of the keys, in the order of the keys and then of the file,
+// without the header. Each key costs a binary search in the mapped index
+// and one pread per run of rows. Exits with 0 if any row was found, 1 if
+// none was, and 2 on an error.
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "row_index.h"
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <table.csv> <key>...\n", argv[0]);
+        return 2;
+    }
+    const char* error;
+    RowIndex* index = row_index_open(argv[1], &error);
+    if (!index) {
+        fprintf(stderr, "Error: Cannot use the index of %s: %s\n", argv[1], error);
+        return 2;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+        row_index_close(index);
+        return 2;
+    }
+
+    int found = 0;
+    char* buf = NULL;
+    size_t cap = 0;
+    for (int i = 2; i < argc; i++) {
+        char* end;
+        long key = strtol(argv[i], &end, 10);
+        if (end == argv[i] || *end != '\0') {
+            fprintf(stderr, "Error: Invalid key %s\n", argv[i]);
+            found = -1;
+            break;
+        }
+        size_t count;
+        const RowIndexEntry* entries = row_index_find(index, key, &count);
+        for (size_t j = 0; j < count; j++) {
+            if (entries[j].bytes > cap) {
+                cap = entries[j].bytes;
+                buf = realloc(buf, cap);
+                if (!buf) {
+                    fprintf(stderr, "Error: Memory allocation failed for rows\n");
+                    exit(1);
+                }
+            }
+            if (pread(fd, buf, entries[j].bytes, entries[j].offset) != (ssize_t)entries[j].bytes) {
+                fprintf(stderr, "Error: Cannot read rows of %s\n", argv[1]);
+                found = -1;
+                break;
+            }
+            fwrite(buf, 1, entries[j].bytes, stdout);
+            found = 1;
+        }
+        if (found < 0) break;
+    }
+    free(buf);
+    close(fd);
+    row_index_close(index);
+    return found < 0 ? 2 : found ? 0 : 1;
+}
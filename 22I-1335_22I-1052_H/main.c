@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include "json2relcsv.h"
+#include "compress.h"
+
+// --serve runs until SIGINT or SIGTERM, then closes the tables cleanly
+static Converter* serving = NULL;
+
+static void stop_serving(int signal) {
+    (void)signal;
+    if (serving) converter_stop(serving);
+}
+
+// The json2relcsv command: turns its arguments into ConverterOptions and runs
+// one conversion through libjson2relcsv
+int main(int argc, char* argv[]) {
+    ConverterOptions options;
+    converter_default_options(&options);
+    char** inputs = malloc(argc * sizeof(char*));
+    int num_inputs = 0;
+    const char* socket_path = NULL;
+    int flush_set = 0;
+    const char** include = malloc(argc * sizeof(char*));
+    const char** exclude = malloc(argc * sizeof(char*));
+    if (!inputs || !include || !exclude) {
+        fprintf(stderr, "Error: Memory allocation failed for inputs\n");
+        exit(1);
+    }
+    options.include = include;
+    options.exclude = exclude;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--print-ast") == 0) {
+            options.print_ast = 1;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            options.stream = 1;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            options.pipeline = 1;
+        } else if (strcmp(argv[i], "--writers") == 0 && i + 1 < argc) {
+            options.writers = atoi(argv[++i]);
+            if (options.writers < 1) {
+                fprintf(stderr, "Error: --writers needs a positive count\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--ndjson") == 0) {
+            options.ndjson = 1;
+        } else if (strcmp(argv[i], "--out-dir") == 0 && i + 1 < argc) {
+            options.out_dir = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options.stats = STATS_TEXT;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            options.stats = STATS_JSON;
+        } else if (strcmp(argv[i], "--lexer") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "simd") == 0) {
+                options.simd_lexer = 1;
+            } else if (strcmp(argv[i], "flex") == 0) {
+                options.simd_lexer = 0;
+            } else {
+                fprintf(stderr, "Error: Unknown lexer %s (expected flex or simd)\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "csv") == 0) {
+                options.format = FORMAT_CSV;
+            } else if (strcmp(argv[i], "arrow") == 0) {
+                options.format = FORMAT_ARROW;
+            } else {
+                fprintf(stderr, "Error: Unknown format %s (expected csv or arrow)\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "gzip") == 0) {
+                options.compression = COMPRESS_GZIP;
+            } else if (strcmp(argv[i], "zstd") == 0) {
+                options.compression = COMPRESS_ZSTD;
+            } else if (strcmp(argv[i], "none") == 0) {
+                options.compression = COMPRESS_NONE;
+            } else {
+                fprintf(stderr, "Error: Unknown compression %s (expected gzip, zstd or none)\n", argv[i]);
+                exit(1);
+            }
+            if (!compression_available(options.compression)) {
+                fprintf(stderr, "Error: json2relcsv was built without %s support\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--infer") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "sample") == 0) {
+                options.infer = INFER_SAMPLE;
+            } else if (strcmp(argv[i], "full") == 0) {
+                options.infer = INFER_FULL;
+            } else if (strcmp(argv[i], "none") == 0) {
+                options.infer = INFER_OFF;
+            } else {
+                fprintf(stderr, "Error: Unknown inference mode %s (expected sample, full or none)\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+            options.max_depth = atoi(argv[++i]);
+            if (options.max_depth < 1) {
+                fprintf(stderr, "Error: --max-depth needs a positive count\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            options.jobs = atoi(argv[++i]);
+            if (options.jobs < 1) {
+                fprintf(stderr, "Error: --jobs needs a positive count\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--split") == 0 && i + 1 < argc) {
+            options.split_jobs = atoi(argv[++i]);
+            if (options.split_jobs < 1) {
+                fprintf(stderr, "Error: --split needs a positive count\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--flush-ms") == 0 && i + 1 < argc) {
+            options.flush_interval_ms = atoi(argv[++i]);
+            if (options.flush_interval_ms < 1) {
+                fprintf(stderr, "Error: --flush-ms needs a positive count\n");
+                exit(1);
+            }
+            flush_set = 1;
+        } else if (strcmp(argv[i], "--flush-kb") == 0 && i + 1 < argc) {
+            long kilobytes = atol(argv[++i]);
+            if (kilobytes < 1) {
+                fprintf(stderr, "Error: --flush-kb needs a positive size in KB\n");
+                exit(1);
+            }
+            options.flush_bytes = (size_t)kilobytes << 10;
+            flush_set = 1;
+        } else if (strcmp(argv[i], "--shard-rows") == 0 && i + 1 < argc) {
+            long long rows = atoll(argv[++i]);
+            if (rows < 1) {
+                fprintf(stderr, "Error: --shard-rows needs a positive count\n");
+                exit(1);
+            }
+            options.shard_rows = rows;
+        } else if (strcmp(argv[i], "--shard-bytes") == 0 && i + 1 < argc) {
+            // A plain byte count, or with a K, M or G suffix
+            char* end;
+            long long bytes = strtoll(argv[++i], &end, 10);
+            int shift = *end == 'K' || *end == 'k' ? 10 : *end == 'M' || *end == 'm' ? 20 : *end == 'G' || *end == 'g' ? 30 : 0;
+            if (shift) end++;
+            if (bytes < 1 || *end != '\0') {
+                fprintf(stderr, "Error: --shard-bytes needs a positive size in bytes, or with a K, M or G suffix\n");
+                exit(1);
+            }
+            options.shard_bytes = (size_t)bytes << shift;
+        } else if (strcmp(argv[i], "--emit-cache") == 0 && i + 1 < argc) {
+            options.emit_cache = argv[++i];
+        } else if (strcmp(argv[i], "--from-cache") == 0 && i + 1 < argc) {
+            options.from_cache = argv[++i];
+        } else if (strcmp(argv[i], "--emit-index") == 0) {
+            options.emit_index = 1;
+        } else if (strcmp(argv[i], "--include") == 0 && i + 1 < argc) {
+            include[options.num_include++] = argv[++i];
+        } else if (strcmp(argv[i], "--exclude") == 0 && i + 1 < argc) {
+            exclude[options.num_exclude++] = argv[++i];
+        } else if (strcmp(argv[i], "--append") == 0) {
+            options.append = 1;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            long megabytes = atol(argv[++i]);
+            if (megabytes < 1) {
+                fprintf(stderr, "Error: --checkpoint needs a positive size in MB\n");
+                exit(1);
+            }
+            options.checkpoint_interval = (size_t)megabytes << 20;
+        } else {
+            inputs[num_inputs++] = argv[i];
+        }
+    }
+
+    if (socket_path && num_inputs > 0) {
+        fprintf(stderr, "Error: --serve takes no input files\n");
+        exit(1);
+    }
+    if (flush_set && !socket_path) {
+        fprintf(stderr, "Error: --flush-ms and --flush-kb need --serve\n");
+        exit(1);
+    }
+
+    Converter* converter = converter_create(&options);
+    ConvertStatus status;
+    if (socket_path) {
+        serving = converter;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = stop_serving;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        status = converter_serve(converter, socket_path);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        serving = NULL;
+    } else {
+        status = converter_run(converter, inputs, num_inputs);
+    }
+    if (status != CONVERT_OK) {
+        fprintf(stderr, "Error: %s\n", converter_error(converter));
+    }
+    converter_free(converter);
+    free(inputs);
+    free(include);
+    free(exclude);
+    return status == CONVERT_OK ? 0 : 1;
+}
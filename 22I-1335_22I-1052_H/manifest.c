@@ -0,0 +1,322 @@
+#include "manifest.h"
+#include "converter.h"
+#include "ast.h"
+#include "schema.h"
+#include "intern.h"
+#include "csv_writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// The manifest is a text file, one record per line:
+//   json2relcsv-manifest <version>
+//   compression <method>
+//   input <complete> <ndjson> <offset> <index> <size> <path>
+//   table <next_id> <file size> <columns> <name> <ids> <column>...
+// (file size -1: an array table only seen empty so far, with no file; ids:
+// the name whose id counter it takes from)
+//   keys <table> <count> <member> <key>...
+// (member: the key the objects are stored under, - for the root)
+//   array <table> <name>
+// Strings are written as <length>:<bytes>, so keys may hold any character.
+// Tables are listed in registry order; keys and array records refer to them
+// by position. It is rewritten through a temporary file and renamed, so an
+// interrupted write leaves the previous one in place.
+#define MANIFEST_VERSION 3
+
+int manifest_enabled(Converter* c) {
+    return c->options.append || c->options.checkpoint_interval > 0;
+}
+
+static char* manifest_path(Converter* c, int temporary) {
+    char* path = malloc(strlen(c->output_dir) + strlen(MANIFEST_NAME) + 6);
+    if (!path) {
+        fprintf(stderr, "Error: Memory allocation failed for manifest path\n");
+        exit(1);
+    }
+    sprintf(path, "%s/%s%s", c->output_dir, MANIFEST_NAME, temporary ? ".tmp" : "");
+    return path;
+}
+
+static void write_text(FILE* f, const char* s) {
+    fprintf(f, " %zu:%s", strlen(s), s);
+}
+
+static int write_manifest(Converter* c, size_t offset, int index, int complete) {
+    ManifestState* m = &c->manifest;
+    char* path = manifest_path(c, 0);
+    char* temporary = manifest_path(c, 1);
+    FILE* f = fopen(temporary, "w");
+    if (!f) {
+        converter_fail(c, CONVERT_ERROR_OUTPUT, "Cannot write manifest %s", temporary);
+        free(temporary);
+        free(path);
+        return -1;
+    }
+    fprintf(f, "json2relcsv-manifest %d\n", MANIFEST_VERSION);
+    fprintf(f, "compression %d\n", (int)c->options.compression);
+    fprintf(f, "input %d %d %zu %d %lld", complete, m->input_ndjson, offset, index, m->input_size);
+    write_text(f, m->input_path);
+    fputc('\n', f);
+
+    const char* name;
+    const char* ids;
+    char** columns;
+    int num_columns;
+    int next_id;
+    int pending;
+    for (int i = 0; get_table_state(c, i, &name, &ids, &columns, &num_columns, &next_id, &pending); i++) {
+        char* file = table_file_path(c, i);
+        struct stat st;
+        long long size = pending ? -1 : stat(file, &st) == 0 ? (long long)st.st_size : 0;
+        free(file);
+        fprintf(f, "table %d %lld %d", next_id, size, num_columns);
+        write_text(f, name);
+        write_text(f, ids);
+        for (int j = 0; j < num_columns; j++) write_text(f, columns[j] ? columns[j] : "unknown");
+        fputc('\n', f);
+    }
+
+    int slot = 0;
+    Shape* shape;
+    while ((shape = next_catalog_entry(&c->catalog, 0, &slot))) {
+        fprintf(f, "keys %d %d", shape->table_index, shape->count);
+        if (shape->table_key) write_text(f, shape->table_key);
+        else fputs(" -", f);
+        for (int j = 0; j < shape->count; j++) write_text(f, shape->keys[j]);
+        fputc('\n', f);
+    }
+    slot = 0;
+    while ((shape = next_catalog_entry(&c->catalog, 1, &slot))) {
+        fprintf(f, "array %d", shape->table_index);
+        write_text(f, shape->keys[0]);
+        fputc('\n', f);
+    }
+
+    int status = 0;
+    if (fclose(f) != 0 || rename(temporary, path) != 0) {
+        converter_fail(c, CONVERT_ERROR_OUTPUT, "Cannot write manifest %s", path);
+        status = -1;
+    }
+    free(temporary);
+    free(path);
+    return status;
+}
+
+static int bad_manifest(Converter* c, const char* path) {
+    converter_fail(c, CONVERT_ERROR_MANIFEST, "Manifest %s is damaged or from another version", path);
+    return -1;
+}
+
+// Reads one <length>:<bytes> string; *len receives its length. Returns NULL
+// if the manifest is cut short.
+static char* read_text(FILE* f, size_t* len) {
+    char colon;
+    if (fscanf(f, " %zu%c", len, &colon) != 2 || colon != ':') return NULL;
+    char* s = malloc(*len + 1);
+    if (!s) {
+        fprintf(stderr, "Error: Memory allocation failed for manifest\n");
+        exit(1);
+    }
+    if (fread(s, 1, *len, f) != *len) {
+        free(s);
+        return NULL;
+    }
+    s[*len] = '\0';
+    return s;
+}
+
+// Checks a table file is still there, and when resuming cuts it back to the
+// size it had at the checkpoint
+static int restore_file(Converter* c, int index, long long size, int resuming) {
+    char* file = table_file_path(c, index);
+    struct stat st;
+    int status = -1;
+    if (stat(file, &st) != 0) {
+        converter_fail(c, CONVERT_ERROR_MANIFEST, "%s listed in the manifest is missing", file);
+    } else if (resuming && st.st_size < size) {
+        converter_fail(c, CONVERT_ERROR_MANIFEST, "%s is shorter than the manifest records", file);
+    } else if (resuming && truncate(file, size) != 0) {
+        converter_fail(c, CONVERT_ERROR_OUTPUT, "Cannot truncate %s", file);
+    } else {
+        status = 0;
+    }
+    free(file);
+    return status;
+}
+
+// Reads the catalog records that follow the input line. resuming cuts the
+// table files back to their recorded sizes.
+static int load_catalog(Converter* c, FILE* f, const char* path, int resuming) {
+    int num_restored = 0;
+    size_t len;
+    char kind[16];
+    while (fscanf(f, " %15s", kind) == 1) {
+        if (strcmp(kind, "table") == 0) {
+            int next_id;
+            long long file_size;
+            int num_columns;
+            if (fscanf(f, "%d %lld %d", &next_id, &file_size, &num_columns) != 3 || num_columns < 0) return bad_manifest(c, path);
+            char* name = read_text(f, &len);
+            if (!name) return bad_manifest(c, path);
+            char* ids = read_text(f, &len);
+            if (!ids) {
+                free(name);
+                return bad_manifest(c, path);
+            }
+            char** columns = malloc((num_columns ? num_columns : 1) * sizeof(char*));
+            if (!columns) {
+                fprintf(stderr, "Error: Memory allocation failed for columns\n");
+                exit(1);
+            }
+            for (int i = 0; i < num_columns; i++) {
+                columns[i] = read_text(f, &len);
+                if (!columns[i]) {
+                    while (i-- > 0) free(columns[i]);
+                    free(columns);
+                    free(name);
+                    free(ids);
+                    return bad_manifest(c, path);
+                }
+            }
+            // The registry owns name and columns from here. A table that had
+            // no file yet stays pending.
+            int table_index = restore_table(c, name, ids, columns, num_columns, next_id);
+            free(ids);
+            if (file_size >= 0) {
+                if (restore_file(c, table_index, file_size, resuming) != 0) return -1;
+                reopen_table(c, table_index);
+            }
+            num_restored++;
+        } else if (strcmp(kind, "keys") == 0) {
+            int table_index;
+            int count;
+            if (fscanf(f, "%d %d", &table_index, &count) != 2 || count < 0) return bad_manifest(c, path);
+            if (table_index < 0 || table_index >= num_restored) return bad_manifest(c, path);
+            char* member = NULL;
+            char root;
+            if (fscanf(f, " %c", &root) != 1) return bad_manifest(c, path);
+            if (root != '-') {
+                ungetc(root, f);
+                char* text = read_text(f, &len);
+                if (!text) return bad_manifest(c, path);
+                member = intern_string(text, len);
+                free(text);
+            }
+            char** keys = malloc((count ? count : 1) * sizeof(char*));
+            if (!keys) {
+                fprintf(stderr, "Error: Memory allocation failed for shape keys\n");
+                exit(1);
+            }
+            for (int i = 0; i < count; i++) {
+                char* key = read_text(f, &len);
+                if (!key) {
+                    free(keys);
+                    return bad_manifest(c, path);
+                }
+                keys[i] = intern_string(key, len);
+                free(key);
+            }
+            restore_key_set(&c->catalog, keys, count, member, table_index);
+            free(keys);
+        } else if (strcmp(kind, "array") == 0) {
+            int table_index;
+            if (fscanf(f, "%d", &table_index) != 1) return bad_manifest(c, path);
+            if (table_index < 0 || table_index >= num_restored) return bad_manifest(c, path);
+            char* name = read_text(f, &len);
+            if (!name) return bad_manifest(c, path);
+            lookup_array_table(&c->catalog, name)->table_index = table_index;
+            free(name);
+        } else {
+            return bad_manifest(c, path);
+        }
+    }
+    return 0;
+}
+
+// Restores the catalog of the previous run into this directory. A complete
+// run is appended to; an interrupted one over the same input resumes.
+static int load_manifest(Converter* c, ResumePoint* resume) {
+    ManifestState* m = &c->manifest;
+    char* path = manifest_path(c, 0);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        free(path);     // first run into this directory
+        return 0;
+    }
+    int status = -1;
+    int version;
+    int compression;
+    int complete;
+    int ndjson;
+    size_t offset;
+    int index;
+    long long size;
+    size_t len;
+    char* previous = NULL;
+    if (fscanf(f, "json2relcsv-manifest %d", &version) != 1 || version != MANIFEST_VERSION ||
+        fscanf(f, " compression %d", &compression) != 1) {
+        bad_manifest(c, path);
+    } else if (compression != (int)c->options.compression) {
+        converter_fail(c, CONVERT_ERROR_MANIFEST, "%s was written with another --compress; append with the same one", path);
+    } else if (fscanf(f, " input %d %d %zu %d %lld", &complete, &ndjson, &offset, &index, &size) != 5 ||
+               !(previous = read_text(f, &len))) {
+        bad_manifest(c, path);
+    } else if (!complete && (strcmp(previous, m->input_path) != 0 || size != m->input_size || ndjson != m->input_ndjson)) {
+        converter_fail(c, CONVERT_ERROR_MANIFEST, "%s holds an interrupted run over %s; resume it with the same input and options, or remove it to start over", path, previous);
+    } else {
+        if (!complete) {
+            resume->offset = offset;
+            resume->index = index;
+        }
+        status = load_catalog(c, f, path, !complete);
+    }
+    free(previous);
+    fclose(f);
+    free(path);
+    return status;
+}
+
+// Called once the output directory is set, before any row is written.
+// --append reloads the previous run; either way the manifest then records
+// this run as under way, so it can be resumed from the start if it stops
+// before its first checkpoint. Returns -1 if the run cannot go ahead.
+int begin_manifest(Converter* c, const char* input, int ndjson, ResumePoint* resume) {
+    ManifestState* m = &c->manifest;
+    struct stat st;
+    if (stat(input, &st) != 0) {
+        converter_fail(c, CONVERT_ERROR_INPUT, "Cannot open input file %s", input);
+        return -1;
+    }
+    m->input_path = input;
+    m->input_size = st.st_size;
+    m->input_ndjson = ndjson;
+    resume->offset = 0;
+    resume->index = 0;
+    if (c->options.append && load_manifest(c, resume) != 0) return -1;
+    m->next_checkpoint = resume->offset + c->options.checkpoint_interval;
+    return write_manifest(c, resume->offset, resume->index, 0);
+}
+
+// Called by the parser at every point it could resume from; returns 1 once
+// checkpoint_interval more bytes have been read since the last checkpoint
+int checkpoint_due(Converter* c, size_t offset) {
+    if (offset < c->manifest.next_checkpoint) return 0;
+    c->manifest.next_checkpoint = offset + c->options.checkpoint_interval;
+    return 1;
+}
+
+// Runs in order with the rows (as an EVENT_CHECKPOINT), once every row from
+// before offset has been written: the files are synced and their sizes
+// recorded. index is the number of root array elements converted.
+void save_checkpoint(Converter* c, size_t offset, int index) {
+    csv_sync(&c->writers);
+    if (!converter_failed(c)) write_manifest(c, offset, index, 0);
+}
+
+// Records the finished run, after the tables are closed
+void save_manifest(Converter* c) {
+    write_manifest(c, c->manifest.input_size, 0, 1);
+}
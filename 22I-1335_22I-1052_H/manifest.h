@@ -0,0 +1,34 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include "json2relcsv.h"
+
+// --append and --checkpoint: a manifest in the output directory records the
+// table catalog (headers, key sets, array tables and next ids), each table
+// file's size and how much of the input was converted. --append reloads it
+// and adds rows after the previous run's; if that run was interrupted, the
+// files are cut back to its last checkpoint and the input resumes from there.
+// Checkpoints fall between NDJSON records or elements of a root array.
+#define MANIFEST_NAME "json2relcsv.manifest"
+
+typedef struct {
+    size_t offset;      // input bytes already converted
+    int index;          // root array elements already converted
+} ResumePoint;
+
+// The input a converter's manifest describes
+typedef struct {
+    const char* input_path;
+    long long input_size;
+    int input_ndjson;
+    size_t next_checkpoint;
+} ManifestState;
+
+int manifest_enabled(Converter* c);
+int begin_manifest(Converter* c, const char* input, int ndjson, ResumePoint* resume);
+int checkpoint_due(Converter* c, size_t offset);
+void save_checkpoint(Converter* c, size_t offset, int index);
+void save_manifest(Converter* c);
+
+#endif
@@ -1,99 +1,445 @@
+%code requires {
+#include "ast.h"
+
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void* yyscan_t;
+#endif
+
+// Everything one parse needs, so several files can be parsed at once
+typedef struct ParseState {
+    Converter* converter;   // receives errors and the rows
+    const char* filename;
+    int line;
+    int column;
+    int start_token;    // returned once before any input, to select a start rule
+    ASTNode* root;
+    struct SimdLexer* simd;    // set when the SIMD lexer replaces flex
+    int depth;          // currently open objects and arrays
+    int stream;         // report containers to the streaming layer
+    size_t offset;      // input bytes up to the end of the last token
+    struct SelectState* select; // --include/--exclude, NULL without them
+    int skip;           // kinds of value the lexer skips next, as SKIPPED
+    int skip_depth;     // flex: brackets open in the value being skipped
+    AstBuilder builder; // the trees being built
+    uint32_t element_mark;  // builder cells from where the current element starts
+    ElementList* detached;  // --split: the chunk's elements, as trees of their own
+} ParseState;
+
+#define SKIP_OBJECT 1
+#define SKIP_ARRAY 2
+#define SKIP_SCALAR 4
+}
+
+%code provides {
+int parse_file(Converter* c, const char* filename, int ndjson, size_t start, ASTNode** root, struct SimdLexer** input);
+ElementList* parse_chunk(Converter* c, const char* filename, struct SimdLexer* whole, size_t start, size_t end, int line, int column, int elements);
+ASTNode* parse_buffer(Converter* c, const char* data, size_t size);
+}
+
 %{
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "ast.h"
+#include "converter.h"
+#include "stream.h"
+#include "manifest.h"
+#include "simd_lexer.h"
+#include "stats.h"
+#include "selector.h"
+#include <sys/stat.h>
+#include <limits.h>
 
-extern FILE* yyin;
-extern int yylex();
-void yyerror(const char* s);
-ASTNode* root;
-int print_ast_flag = 0;
-char* output_directory = ".";
+// Bison's stack lives on the heap and grows on demand; the default cap of
+// 10000 entries would reject documents only a few thousand levels deep.
+// --max-depth is the user-facing limit.
+#define YYMAXDEPTH 100000000
 %}
 
+%code {
+int flex_lex(YYSTYPE* yylval_param, yyscan_t scanner);
+int yylex_init_extra(ParseState* extra, yyscan_t* scanner);
+void yyset_in(FILE* in, yyscan_t scanner);
+struct yy_buffer_state* yy_scan_bytes(const char* bytes, int len, yyscan_t scanner);
+int yylex_destroy(yyscan_t scanner);
+void yyerror(yyscan_t scanner, ParseState* state, const char* s);
+
+// Tracks nesting for --max-depth as objects and arrays open; returns -1 once
+// the limit is passed
+static int enter_container(yyscan_t scanner, ParseState* state) {
+    int max_depth = state->converter->options.max_depth;
+    state->depth++;
+    if (max_depth && state->depth > max_depth) {
+        char message[64];
+        snprintf(message, sizeof(message), "nesting deeper than --max-depth %d", max_depth);
+        yyerror(scanner, state, message);
+        return -1;
+    }
+    return 0;
+}
+
+// A tree outgrew its node arena (see reserve_cells); returns -1 so the
+// parser stops
+static int arena_full(ParseState* state) {
+    if (state->filename) {
+        converter_fail(state->converter, CONVERT_ERROR_INPUT, "A value in %s is too large for the node arena", state->filename);
+    } else {
+        converter_fail(state->converter, CONVERT_ERROR_INPUT, "A document is too large for the node arena");
+    }
+    return -1;
+}
+
+// Hands the parser tokens from whichever lexer this parse was set up with
+static int yylex(YYSTYPE* lval, yyscan_t scanner, ParseState* state) {
+    if (!stats_active) {
+        if (state->simd) return simd_lex(lval, state->simd);
+        return flex_lex(lval, scanner);
+    }
+    int phase = stats_enter(PHASE_LEX);
+    int token = state->simd ? simd_lex(lval, state->simd) : flex_lex(lval, scanner);
+    stats_leave(phase);
+    stats_count_token();
+    return token;
+}
+
+// Lengths of strings and numbers are 32-bit in the tree; returns -1 for a
+// longer one
+static int push_text(yyscan_t scanner, ParseState* state, NodeType type, Span text) {
+    if (text.len > UINT32_MAX) {
+        if (text.owned) free((char*)text.ptr);
+        yyerror(scanner, state, "string or number longer than 4 GiB");
+        return -1;
+    }
+    if (type == STR) push_string(&state->builder, text);
+    else push_number(&state->builder, text);
+    if (state->builder.too_large) return arena_full(state);
+    return 0;
+}
+
+// Members the selectors leave out are dropped again
+static void add_member(ParseState* state, char* key, int pushed) {
+    ASTNode* value = pushed ? last_value(&state->builder) : NULL;
+    if (state->select && !select_member(state, value)) {
+        if (value) drop_value(&state->builder);
+    } else if (value) {
+        set_key(&state->builder, key);
+    }
+}
+
+// Elements directly inside a --split chunk's root array, and those of spine
+// arrays while streaming, leave as trees of their own once reduced, and
+// their cells are reused for the next one
+static void add_element(ParseState* state, int pushed) {
+    if (!pushed) return;
+    if (state->detached && state->depth == 1) {
+        append_element(state->detached, take_tree(&state->builder, state->element_mark));
+    } else if (state->stream && stream_spine_open(state->converter)) {
+        stream_take_element(state->converter, take_tree(&state->builder, state->element_mark), state->offset);
+    }
+}
+
+// NDJSON: each record is converted into the shared tables, then freed. The
+// end of a record is a point a checkpointed run can resume from.
+static void convert_record(Converter* c, ASTNode* record, size_t offset) {
+    if (c->options.print_ast) {
+        print_ast_node(record, 0);
+    }
+    StreamEvent event = { EVENT_RECORD, NULL, record, 0, 0 };
+    stream_dispatch(c, &event);
+    if (c->options.checkpoint_interval && checkpoint_due(c, offset)) {
+        StreamEvent checkpoint = { EVENT_CHECKPOINT, NULL, NULL, 0, offset };
+        stream_dispatch(c, &checkpoint);
+    }
+}
+}
+
+%define api.pure full
+%parse-param {yyscan_t scanner} {ParseState* state}
+%lex-param {yyscan_t scanner} {ParseState* state}
+
 %union {
-    ASTNode* node;
+    int pushed;         // whether the value left a node on the builder's stack
+    uint32_t start;     // where an open container's children start on that stack
+    Span span;
     char* string;
 }
 
-%token <string> STRING NUMBER
+%token <span> STRING NUMBER
 %token TRUE FALSE NULL_VAL
-%type <node> json value object members pair array elements
+%token NDJSON_START ELEMENTS_START CLOSE_START
+%token INVALID      // an invalid character, already reported by the lexer
+%token SKIPPED      // a value the selectors leave out, skipped unparsed
+%type <pushed> value
+%type <start> object_open array_open
+%type <string> pair_key
+
+// Tokens left on the stack when a parse is abandoned; keys are interned and
+// nodes go with the builder
+%destructor { if ($$.owned) free((char*)$$.ptr); } <span>
 
 %%
-json: value { root = $1; }
+json: value { state->root = $1 ? take_tree(&state->builder, 1) : NULL; }
+    | NDJSON_START records { state->root = NULL; }
+    | ELEMENTS_START elements ','
+    | ELEMENTS_START elements ']'
+    | CLOSE_START ']'
 ;
 
-value: object { $$ = $1; }
-     | array { $$ = $1; }
-     | STRING { $$ = make_string($1); free($1); }
-     | NUMBER { $$ = make_number($1); free($1); }
-     | TRUE { $$ = make_true(); }
-     | FALSE { $$ = make_false(); }
-     | NULL_VAL { $$ = make_null(); }
+records: /* empty */
+       | records value {
+            if ($2) convert_record(state->converter, take_tree(&state->builder, 1), state->offset);
+            if (converter_failed(state->converter)) YYABORT;
+        }
 ;
 
-object: '{' '}' { $$ = make_object(NULL); }
-      | '{' members '}' { $$ = make_object($2); }
+value: object { $$ = 1; }
+     | array { $$ = 1; }
+     | STRING {
+            if (push_text(scanner, state, STR, $1) != 0) YYABORT;
+            $$ = 1;
+        }
+     | NUMBER {
+            if (push_text(scanner, state, NUM, $1) != 0) YYABORT;
+            $$ = 1;
+        }
+     | TRUE { push_literal(&state->builder, TRU); $$ = 1; }
+     | FALSE { push_literal(&state->builder, FALS); $$ = 1; }
+     | NULL_VAL { push_literal(&state->builder, NUL); $$ = 1; }
+     | SKIPPED { $$ = 0; }
+;
+
+object_open: '{' {
+                if (enter_container(scanner, state) != 0) YYABORT;
+                if (state->select) select_open(state, 0);
+                if (state->stream) stream_open_object(state->converter);
+                $$ = state->builder.num_pending;
+            }
+;
+
+object: object_open '}' {
+            state->depth--;
+            if (state->select) select_close(state);
+            close_object(&state->builder, $1);
+            if (state->builder.too_large && arena_full(state) != 0) YYABORT;
+            if (state->stream) stream_close_object(state->converter);
+        }
+      | object_open members '}' {
+            state->depth--;
+            if (state->select) select_close(state);
+            close_object(&state->builder, $1);
+            if (state->builder.too_large && arena_full(state) != 0) YYABORT;
+            if (state->stream) stream_close_object(state->converter);
+        }
 ;
 
-members: pair { $$ = $1; }
-       | members ',' pair { $$ = make_pair_list($3, $1); }
+members: pair_key value { add_member(state, $1, $2); }
+       | members ',' pair_key value { add_member(state, $3, $4); }
 ;
 
-pair: STRING ':' value { $$ = make_pair($1, $3); free($1); }
+// Reduced before the value's first token is read, so the lexer can still
+// skip it
+pair_key: STRING ':' {
+            $$ = span_string($1);
+            if (state->select) select_key(state, $$);
+            if (state->stream) stream_set_key(state->converter, $$);
+        }
 ;
 
-array: '[' ']' { $$ = make_array(NULL); }
-     | '[' elements ']' { $$ = make_array($2); }
+array_open: '[' {
+               if (enter_container(scanner, state) != 0) YYABORT;
+               if (state->select) select_open(state, 1);
+               if (state->stream && stream_open_array(state->converter)) state->element_mark = arena_mark(&state->builder);
+               $$ = state->builder.num_pending;
+           }
 ;
 
-elements: value { $$ = make_element_list($1, NULL); }
-        | elements ',' value { $$ = make_element_list($3, $1); }
+array: array_open ']' {
+           state->depth--;
+           if (state->select) select_close(state);
+           close_array(&state->builder, $1);
+           if (state->builder.too_large && arena_full(state) != 0) YYABORT;
+           if (state->stream) stream_close_array(state->converter);
+       }
+     | array_open elements ']' {
+           state->depth--;
+           if (state->select) select_close(state);
+           close_array(&state->builder, $1);
+           if (state->builder.too_large && arena_full(state) != 0) YYABORT;
+           if (state->stream) stream_close_array(state->converter);
+       }
+;
+
+elements: value {
+            add_element(state, $1);
+            if (converter_failed(state->converter)) YYABORT;
+        }
+        | elements ',' value {
+            add_element(state, $3);
+            if (converter_failed(state->converter)) YYABORT;
+        }
 ;
 
 %%
 
-int main(int argc, char* argv[]) {
-    char* input_file = NULL;
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--print-ast") == 0) {
-            print_ast_flag = 1;
-        } else if (strcmp(argv[i], "--out-dir") == 0 && i + 1 < argc) {
-            output_directory = argv[++i];
-        } else if (!input_file) {
-            input_file = argv[i];
-        } else {
-            fprintf(stderr, "Error: Invalid arguments\n");
-            exit(1);
+// Moves a flex parse to byte offset start, keeping its line and column right
+static int skip_input(FILE* in, size_t start, ParseState* state) {
+    char buffer[65536];
+    size_t left = start;
+    while (left > 0) {
+        size_t n = fread(buffer, 1, left < sizeof(buffer) ? left : sizeof(buffer), in);
+        if (n == 0) {
+            converter_fail(state->converter, CONVERT_ERROR_INPUT, "%s is shorter than the resume offset", state->filename);
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (buffer[i] == '\n') {
+                state->line++;
+                state->column = 1;
+            } else {
+                state->column++;
+            }
         }
+        left -= n;
     }
+    state->offset = start;
+    return 0;
+}
 
-    if (!input_file) {
-        fprintf(stderr, "Error: No input file provided\n");
-        exit(1);
-    }
+// The tree of a parse that stopped on an error, or that converted rows
+// after the converter failed, is not used; nodes never taken from the
+// builder go with it
+static int finish_parse(ParseState* state, int status) {
+    free_builder(&state->builder);
+    if (status == 0 && !converter_failed(state->converter)) return 0;
+    free_ast(state->root);
+    state->root = NULL;
+    return -1;
+}
 
-    yyin = fopen(input_file, "r");
-    if (!yyin) {
-        fprintf(stderr, "Error: Cannot open input file %s\n", input_file);
-        exit(1);
+// Parses one file from byte offset start (0 for the whole file) into *root.
+// NDJSON records are converted as they are read and *root is NULL;
+// otherwise the caller owns the tree. With the SIMD lexer the tree's strings
+// point into the mapped file, which is handed back in *input and must be
+// closed only after the tree is freed (NULL for flex). Returns -1, with
+// nothing to free, once the converter has failed.
+int parse_file(Converter* c, const char* filename, int ndjson, size_t start, ASTNode** root, struct SimdLexer** input) {
+    ParseState state = { c, filename, 1, 1, ndjson ? NDJSON_START : 0, NULL, NULL, 0, c->options.stream, 0 };
+    SelectState select;
+    state.select = select_start(c, &select, 0);
+    *root = NULL;
+    *input = NULL;
+    if (stats_active) {
+        struct stat st;
+        if (stat(filename, &st) == 0) stats_count_input(st.st_size - start);
     }
-
-    if (yyparse() != 0) {
-        fclose(yyin);
-        exit(1);
+    int phase = stats_enter(PHASE_PARSE);
+    int status = -1;
+    if (c->options.simd_lexer) {
+        state.simd = simd_lexer_open(filename, &state);
+        if (state.simd && (!start || simd_lexer_seek(state.simd, start) == 0)) {
+            status = finish_parse(&state, yyparse(NULL, &state));
+        }
+        if (status == 0) {
+            *input = state.simd;
+        } else {
+            simd_lexer_close(state.simd);
+        }
+        select_finish(state.select);
+        stats_leave(phase);
+        *root = state.root;
+        return status;
     }
-    fclose(yyin);
 
-    if (print_ast_flag) {
-        print_ast_node(root, 0);
+    FILE* in = fopen(filename, "r");
+    if (!in) {
+        converter_fail(c, CONVERT_ERROR_INPUT, "Cannot open input file %s", filename);
+        select_finish(state.select);
+        stats_leave(phase);
+        return -1;
     }
+    yyscan_t scanner;
+    if (!start || skip_input(in, start, &state) == 0) {
+        if (yylex_init_extra(&state, &scanner) != 0) {
+            converter_fail(c, CONVERT_ERROR_RESOURCE, "Cannot create scanner for %s", filename);
+        } else {
+            yyset_in(in, scanner);
+            status = finish_parse(&state, yyparse(scanner, &state));
+            yylex_destroy(scanner);
+        }
+    }
+    fclose(in);
+    select_finish(state.select);
+    stats_leave(phase);
+    *root = state.root;
+    return status;
+}
 
-    generate_csv(root, output_directory);
+// --split: parses bytes [start, end) of the input mapped by whole into a
+// list of element trees. The range holds elements that sit directly inside
+// the root array, followed by the comma after them or, for the last chunk,
+// by the closing bracket and the rest of the input. With elements unset it holds
+// only the closing bracket and what follows. line and column give the
+// position of start for flex's messages; the SIMD lexer works positions out
+// from the mapping. Nothing is streamed: the caller hands the elements on in
+// input order. Returns NULL once the converter has failed.
+ElementList* parse_chunk(Converter* c, const char* filename, struct SimdLexer* whole, size_t start, size_t end, int line, int column, int elements) {
+    ParseState state = { c, filename, line, column, elements ? ELEMENTS_START : CLOSE_START, NULL, NULL, 1, 0, start };
+    SelectState select;
+    state.select = select_start(c, &select, 1);
+    state.detached = make_element_list();
+    state.element_mark = arena_mark(&state.builder);
+    int status = -1;
+    if (c->options.simd_lexer) {
+        state.simd = simd_lexer_slice(whole, start, end, &state);
+        status = finish_parse(&state, yyparse(NULL, &state));
+        simd_lexer_close(state.simd);
+    } else if (end - start > INT_MAX) {
+        converter_fail(c, CONVERT_ERROR_INPUT, "An element of %s is too large for --split with the flex lexer", filename);
+    } else {
+        size_t size;
+        const char* data = simd_lexer_input(whole, &size);
+        yyscan_t scanner;
+        if (yylex_init_extra(&state, &scanner) != 0) {
+            converter_fail(c, CONVERT_ERROR_RESOURCE, "Cannot create scanner for %s", filename);
+        } else {
+            yy_scan_bytes(data + start, end - start, scanner);   // freed with the scanner
+            status = finish_parse(&state, yyparse(scanner, &state));
+            yylex_destroy(scanner);
+        }
+    }
+    select_finish(state.select);
+    if (status != 0) {
+        free_element_list(state.detached);
+        return NULL;
+    }
+    return state.detached;
+}
 
-    free_ast(root);
-    cleanup_tables();
-    return 0;
-}
\ No newline at end of file
+// --serve: parses one document held in memory. Positions in error messages
+// count from its start. Returns NULL once the converter has failed.
+ASTNode* parse_buffer(Converter* c, const char* data, size_t size) {
+    ParseState state = { c, NULL, 1, 1, 0, NULL, NULL, 0, 0, 0 };
+    SelectState select;
+    state.select = select_start(c, &select, 0);
+    stats_count_input(size);
+    int phase = stats_enter(PHASE_PARSE);
+    if (c->options.simd_lexer) {
+        state.simd = simd_lexer_buffer(data, size, &state);
+        finish_parse(&state, yyparse(NULL, &state));
+        simd_lexer_close(state.simd);
+    } else if (size > INT_MAX) {
+        converter_fail(c, CONVERT_ERROR_INPUT, "A document is too large for the flex lexer");
+    } else {
+        yyscan_t scanner;
+        if (yylex_init_extra(&state, &scanner) != 0) {
+            converter_fail(c, CONVERT_ERROR_RESOURCE, "Cannot create scanner");
+        } else {
+            yy_scan_bytes(data, size, scanner);
+            finish_parse(&state, yyparse(scanner, &state));
+            yylex_destroy(scanner);
+        }
+    }
+    select_finish(state.select);
+    stats_leave(phase);
+    return state.root;
+}
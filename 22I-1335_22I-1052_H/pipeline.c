@@ -0,0 +1,54 @@
+#include "pipeline.h"
+#include "converter.h"
+#include "spsc.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// Events the parser may run ahead of the generator before it has to wait
+#define PIPELINE_QUEUE_SIZE 1024
+
+// Generator stage: runs the parser's events one at a time, in order, so every
+// table gets its rows in the same order as a sequential run
+static void* generator_main(void* arg) {
+    Converter* c = arg;
+    stats_thread_start(c);
+    StreamEvent event;
+    for (;;) {
+        spsc_pop(&c->pipeline.events, &event);
+        stream_run_event(c, &event);
+        if (event.kind == EVENT_END) break;
+    }
+    release_row_buffer();
+    stats_thread_done(c);
+    return NULL;
+}
+
+// Starts the generator thread under --pipeline; returns -1 if it cannot be
+// started. Until it is running, events run on the parser's thread.
+int pipeline_start(Converter* c) {
+    if (!c->options.pipeline || c->pipeline.running) return 0;
+    spsc_init(&c->pipeline.events, PIPELINE_QUEUE_SIZE, sizeof(StreamEvent));
+    if (pthread_create(&c->pipeline.generator, NULL, generator_main, c) != 0) {
+        spsc_free(&c->pipeline.events);
+        converter_fail(c, CONVERT_ERROR_RESOURCE, "Cannot start generator thread");
+        return -1;
+    }
+    c->pipeline.running = 1;
+    return 0;
+}
+
+void pipeline_push(Converter* c, StreamEvent* event) {
+    spsc_push(&c->pipeline.events, event);
+}
+
+// Waits until every queued event has been written out
+void pipeline_finish(Converter* c) {
+    if (!c->pipeline.running) return;
+    StreamEvent end = { EVENT_END, NULL, NULL, 0, 0 };
+    spsc_push(&c->pipeline.events, &end);
+    pthread_join(c->pipeline.generator, NULL);
+    spsc_free(&c->pipeline.events);
+    c->pipeline.running = 0;
+}
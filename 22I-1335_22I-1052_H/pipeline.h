@@ -0,0 +1,20 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include "stream.h"
+#include "spsc.h"
+
+// --pipeline: the parser, the row generator and the file writers each run on
+// their own threads, joined by bounded single-producer queues.
+typedef struct {
+    SpscQueue events;
+    pthread_t generator;
+    int running;
+} Pipeline;
+
+int pipeline_start(Converter* c);
+void pipeline_push(Converter* c, StreamEvent* event);
+void pipeline_finish(Converter* c);
+
+#endif
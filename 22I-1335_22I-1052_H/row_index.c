@@ -0,0 +1,164 @@
+#include "row_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct RowIndex {
+    const char* map;
+    size_t size;
+    const RowIndexEntry* entries;
+    size_t count;
+};
+
+// Adds a row written at offset, extending the last entry when the row
+// directly follows it with the same key
+void row_index_add(RowIndexBuilder* b, long key, uint64_t offset, size_t len) {
+    if (len > UINT32_MAX) {
+        b->overflow = 1;
+        return;
+    }
+    if (b->count > 0) {
+        RowIndexEntry* last = &b->entries[b->count - 1];
+        if (last->key == key && last->offset + last->bytes == offset &&
+            last->rows < UINT32_MAX && (uint64_t)last->bytes + len <= UINT32_MAX) {
+            last->rows++;
+            last->bytes += len;
+            return;
+        }
+        if (key < last->key) b->unsorted = 1;
+    }
+    if (b->count == b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 256;
+        b->entries = realloc(b->entries, b->capacity * sizeof(RowIndexEntry));
+        if (!b->entries) {
+            fprintf(stderr, "Error: Memory allocation failed for row index\n");
+            exit(1);
+        }
+    }
+    b->entries[b->count++] = (RowIndexEntry){ key, offset, 1, (uint32_t)len };
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const RowIndexEntry* x = a;
+    const RowIndexEntry* y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Writes data_path's sidecar through a temporary file renamed into place.
+// Returns -1 if it cannot be written or a row was too long to index.
+int row_index_save(RowIndexBuilder* b, const char* data_path, uint64_t file_bytes) {
+    if (b->overflow) return -1;
+    if (b->unsorted) qsort(b->entries, b->count, sizeof(RowIndexEntry), compare_entries);
+    size_t len = strlen(data_path);
+    char* path = malloc(len + sizeof(ROW_INDEX_SUFFIX));
+    char* temporary = malloc(len + sizeof(ROW_INDEX_SUFFIX) + 4);
+    if (!path || !temporary) {
+        fprintf(stderr, "Error: Memory allocation failed for row index path\n");
+        exit(1);
+    }
+    sprintf(path, "%s%s", data_path, ROW_INDEX_SUFFIX);
+    sprintf(temporary, "%s.tmp", path);
+
+    int status = -1;
+    FILE* f = fopen(temporary, "wb");
+    if (f) {
+        RowIndexHeader header;
+        memcpy(header.magic, ROW_INDEX_MAGIC, sizeof(header.magic));
+        header.count = b->count;
+        header.file_bytes = file_bytes;
+        int written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                      fwrite(b->entries, sizeof(RowIndexEntry), b->count, f) == b->count;
+        if (fclose(f) == 0 && written && rename(temporary, path) == 0) status = 0;
+    }
+    if (status != 0) unlink(temporary);
+    free(temporary);
+    free(path);
+    return status;
+}
+
+void row_index_free(RowIndexBuilder* b) {
+    free(b->entries);
+    memset(b, 0, sizeof(RowIndexBuilder));
+}
+
+RowIndex* row_index_open(const char* data_path, const char** error) {
+    size_t len = strlen(data_path);
+    char* path = malloc(len + sizeof(ROW_INDEX_SUFFIX));
+    if (!path) {
+        fprintf(stderr, "Error: Memory allocation failed for row index path\n");
+        exit(1);
+    }
+    sprintf(path, "%s%s", data_path, ROW_INDEX_SUFFIX);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    struct stat index_st, data_st;
+    if (fd < 0 || fstat(fd, &index_st) != 0) {
+        if (fd >= 0) close(fd);
+        *error = "cannot open the index";
+        return NULL;
+    }
+    if (stat(data_path, &data_st) != 0) {
+        close(fd);
+        *error = "cannot open the table file";
+        return NULL;
+    }
+    size_t size = index_st.st_size;
+    const char* map = size >= sizeof(RowIndexHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        *error = "the index is too short";
+        return NULL;
+    }
+
+    const RowIndexHeader* header = (const RowIndexHeader*)map;
+    if (memcmp(header->magic, ROW_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->count > (size - sizeof(RowIndexHeader)) / sizeof(RowIndexEntry) ||
+        size != sizeof(RowIndexHeader) + header->count * sizeof(RowIndexEntry)) {
+        *error = "the index is malformed";
+    } else if (header->file_bytes != (uint64_t)data_st.st_size) {
+        *error = "the index does not match the table file";
+    } else {
+        RowIndex* index = malloc(sizeof(RowIndex));
+        if (!index) {
+            fprintf(stderr, "Error: Memory allocation failed for row index\n");
+            exit(1);
+        }
+        index->map = map;
+        index->size = size;
+        index->entries = (const RowIndexEntry*)(map + sizeof(RowIndexHeader));
+        index->count = header->count;
+        return index;
+    }
+    munmap((void*)map, size);
+    return NULL;
+}
+
+// Returns the entries for key, in file order, and their number in count
+// (0 if there are none)
+const RowIndexEntry* row_index_find(const RowIndex* index, long key, size_t* count) {
+    size_t low = 0;
+    size_t high = index->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (index->entries[middle].key < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    size_t end = low;
+    while (end < index->count && index->entries[end].key == key) end++;
+    *count = end - low;
+    return index->entries + low;
+}
+
+void row_index_close(RowIndex* index) {
+    if (!index) return;
+    munmap((void*)index->map, index->size);
+    free(index);
+}
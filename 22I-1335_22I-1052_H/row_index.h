@@ -0,0 +1,53 @@
+#ifndef ROW_INDEX_H
+#define ROW_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// --emit-index: a binary sidecar next to every table file (x.csv.idx, or
+// x.part-00001.csv.idx per part) that maps the first column of its rows
+// (the id, or an array table's parent id) to where they are in the file:
+//   RowIndexHeader, then RowIndexEntry[count] sorted by key, then offset
+// in native byte order. Consecutive rows with the same key, such as the
+// elements of one array, share an entry, so a lookup is a binary search in
+// the mapped index and one pread of the rows. A key can have several
+// entries when its rows are not adjacent (tables sharing a file, --jobs).
+#define ROW_INDEX_MAGIC "J2RIDX1\n"
+#define ROW_INDEX_SUFFIX ".idx"
+
+typedef struct {
+    char magic[8];
+    uint64_t count;         // entries
+    uint64_t file_bytes;    // size of the indexed file, to spot a stale index
+} RowIndexHeader;
+
+typedef struct {
+    int64_t key;
+    uint64_t offset;        // of the first row, from the start of the file
+    uint32_t rows;
+    uint32_t bytes;         // of all the rows
+} RowIndexEntry;
+
+// The entries of one file, collected while it is written
+typedef struct {
+    RowIndexEntry* entries;
+    size_t count;
+    size_t capacity;
+    int unsorted;           // a key came after a larger one
+    int overflow;           // a row too long for an entry
+} RowIndexBuilder;
+
+void row_index_add(RowIndexBuilder* builder, long key, uint64_t offset, size_t len);
+int row_index_save(RowIndexBuilder* builder, const char* data_path, uint64_t file_bytes);
+void row_index_free(RowIndexBuilder* builder);
+
+// Reading an index back: row_index_open maps data_path's sidecar and
+// returns NULL, with the reason in error, if it is missing, malformed, or
+// does not match the file's size.
+typedef struct RowIndex RowIndex;
+
+RowIndex* row_index_open(const char* data_path, const char** error);
+const RowIndexEntry* row_index_find(const RowIndex* index, long key, size_t* count);
+void row_index_close(RowIndex* index);
+
+#endif
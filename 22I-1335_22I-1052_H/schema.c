@@ -0,0 +1,212 @@
+#include "schema.h"
+#include "intern.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Keys of the shape being sorted, for qsort's comparison; per thread, as
+// converters on other threads sort their own shapes
+static __thread char** sort_keys;
+
+// Keys are interned, so a key sequence is fingerprinted and compared by
+// pointer, one word per key, without reading the strings
+static unsigned long hash_keys(char** keys, int* order, int count) {
+    unsigned long hash = 14695981039346656037UL;
+    for (int i = 0; i < count; i++) {
+        hash ^= (unsigned long)keys[order ? order[i] : i];
+        hash *= 0x100000001b3UL;
+        hash ^= hash >> 29;
+    }
+    return hash ^ (unsigned long)count;
+}
+
+static int keys_equal(Shape* shape, char** keys, int* order, int count) {
+    if (shape->count != count) return 0;
+    for (int i = 0; i < count; i++) {
+        if (shape->keys[i] != keys[order ? order[i] : i]) return 0;
+    }
+    return 1;
+}
+
+static void map_insert(ShapeMap* map, Shape* shape) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        int old_capacity = map->capacity;
+        Shape** old_slots = map->slots;
+        map->capacity = old_capacity ? old_capacity * 2 : 64;
+        map->slots = calloc(map->capacity, sizeof(Shape*));
+        if (!map->slots) {
+            fprintf(stderr, "Error: Memory allocation failed for schema catalog\n");
+            exit(1);
+        }
+        for (int i = 0; i < old_capacity; i++) {
+            if (!old_slots[i]) continue;
+            int slot = old_slots[i]->hash & (map->capacity - 1);
+            while (map->slots[slot]) slot = (slot + 1) & (map->capacity - 1);
+            map->slots[slot] = old_slots[i];
+        }
+        free(old_slots);
+    }
+    int slot = shape->hash & (map->capacity - 1);
+    while (map->slots[slot]) slot = (slot + 1) & (map->capacity - 1);
+    map->slots[slot] = shape;
+    map->count++;
+}
+
+// Key sets also match on their member key; other maps pass table_key NULL
+static Shape* map_find(ShapeMap* map, unsigned long hash, char** keys, int* order, int count, char** table_key) {
+    if (map->capacity == 0) return NULL;
+    int slot = hash & (map->capacity - 1);
+    while (map->slots[slot]) {
+        Shape* shape = map->slots[slot];
+        if (shape->hash == hash && keys_equal(shape, keys, order, count) && (!table_key || shape->table_key == *table_key)) return shape;
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    return NULL;
+}
+
+static int compare_key_indices(const void* a, const void* b) {
+    return strcmp(sort_keys[*(int*)a], sort_keys[*(int*)b]);
+}
+
+static Shape* new_shape(char** keys, int* order, int count, unsigned long hash) {
+    Shape* shape = malloc(sizeof(Shape));
+    if (!shape) {
+        fprintf(stderr, "Error: Memory allocation failed for shape\n");
+        exit(1);
+    }
+    shape->keys = malloc((count ? count : 1) * sizeof(char*));
+    shape->order = malloc((count ? count : 1) * sizeof(int));
+    if (!shape->keys || !shape->order) {
+        fprintf(stderr, "Error: Memory allocation failed for shape keys\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        shape->keys[i] = keys[order ? order[i] : i];
+        shape->order[i] = i;
+    }
+    shape->count = count;
+    shape->hash = hash;
+    shape->table_index = -1;
+    shape->table_key = NULL;
+    shape->next_id = 1;
+    return shape;
+}
+
+// Read-only lookup of a key order; safe to run concurrently with other finds
+Shape* find_shape(Catalog* catalog, char** keys, int count) {
+    return map_find(&catalog->shapes_by_order, hash_keys(keys, NULL, count), keys, NULL, count, NULL);
+}
+
+Shape* lookup_shape(Catalog* catalog, char** keys, int count) {
+    unsigned long hash = hash_keys(keys, NULL, count);
+    Shape* shape = map_find(&catalog->shapes_by_order, hash, keys, NULL, count, NULL);
+    if (shape) return shape;
+
+    shape = new_shape(keys, NULL, count, hash);
+    sort_keys = shape->keys;
+    qsort(shape->order, count, sizeof(int), compare_key_indices);
+    map_insert(&catalog->shapes_by_order, shape);
+    return shape;
+}
+
+// Objects stored under different keys go to different files, so a key set
+// is told apart by its member key too
+static unsigned long hash_key_set(char** keys, int* order, int count, char* table_key) {
+    return hash_keys(keys, order, count) ^ ((unsigned long)table_key >> 4) * 0x9e3779b97f4a7c15UL;
+}
+
+// Read-only lookup of the entry shared by every key order of the same key set
+Shape* find_key_set(Catalog* catalog, Shape* shape, char* table_key) {
+    unsigned long hash = hash_key_set(shape->keys, shape->order, shape->count, table_key);
+    return map_find(&catalog->shapes_by_key_set, hash, shape->keys, shape->order, shape->count, &table_key);
+}
+
+Shape* lookup_key_set(Catalog* catalog, Shape* shape, char* table_key) {
+    unsigned long hash = hash_key_set(shape->keys, shape->order, shape->count, table_key);
+    Shape* key_set = map_find(&catalog->shapes_by_key_set, hash, shape->keys, shape->order, shape->count, &table_key);
+    if (key_set) return key_set;
+
+    key_set = new_shape(shape->keys, shape->order, shape->count, hash);
+    key_set->table_key = table_key;
+    map_insert(&catalog->shapes_by_key_set, key_set);
+    return key_set;
+}
+
+// Array tables are catalogued by (interned) file name, so every array stored
+// under the same key appends to one table
+Shape* find_array_table(Catalog* catalog, char* name) {
+    name = intern_string(name, strlen(name));
+    return map_find(&catalog->array_tables, hash_keys(&name, NULL, 1), &name, NULL, 1, NULL);
+}
+
+Shape* lookup_array_table(Catalog* catalog, char* name) {
+    name = intern_string(name, strlen(name));
+    unsigned long hash = hash_keys(&name, NULL, 1);
+    Shape* shape = map_find(&catalog->array_tables, hash, &name, NULL, 1, NULL);
+    if (shape) return shape;
+
+    shape = new_shape(&name, NULL, 1, hash);
+    map_insert(&catalog->array_tables, shape);
+    return shape;
+}
+
+// Several tables can write one file, such as main.csv for roots whose key
+// sets give the same header. They all take ids from the file's entry, and so
+// do the tables split off into main_2.csv and so on, so ids stay unique
+// across all of them. Needs exclusive access.
+Shape* lookup_table_file(Catalog* catalog, const char* name) {
+    char* file = intern_string(name, strlen(name));
+    unsigned long hash = hash_keys(&file, NULL, 1);
+    Shape* shape = map_find(&catalog->table_files, hash, &file, NULL, 1, NULL);
+    if (shape) return shape;
+
+    shape = new_shape(&file, NULL, 1, hash);
+    map_insert(&catalog->table_files, shape);
+    return shape;
+}
+
+// Walks the key sets (arrays 0) or array tables (arrays 1) for a manifest.
+// *slot starts at 0; returns NULL after the last entry.
+Shape* next_catalog_entry(Catalog* catalog, int arrays, int* slot) {
+    ShapeMap* map = arrays ? &catalog->array_tables : &catalog->shapes_by_key_set;
+    while (*slot < map->capacity) {
+        Shape* shape = map->slots[(*slot)++];
+        if (shape && shape->table_index != -1) return shape;
+    }
+    return NULL;
+}
+
+// --append: re-adds a key set read back from a manifest. keys are interned
+// and already sorted.
+void restore_key_set(Catalog* catalog, char** keys, int count, char* table_key, int table_index) {
+    unsigned long hash = hash_key_set(keys, NULL, count, table_key);
+    Shape* key_set = map_find(&catalog->shapes_by_key_set, hash, keys, NULL, count, &table_key);
+    if (!key_set) {
+        key_set = new_shape(keys, NULL, count, hash);
+        key_set->table_key = table_key;
+        map_insert(&catalog->shapes_by_key_set, key_set);
+    }
+    key_set->table_index = table_index;
+}
+
+static void free_map(ShapeMap* map) {
+
+    for (int i = 0; i < map->capacity; i++) {
+        Shape* shape = map->slots[i];
+        if (!shape) continue;
+        free(shape->keys);
+        free(shape->order);
+        free(shape);
+    }
+    free(map->slots);
+    map->slots = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+void free_schema_catalog(Catalog* catalog) {
+    free_map(&catalog->shapes_by_order);
+    free_map(&catalog->shapes_by_key_set);
+    free_map(&catalog->array_tables);
+    free_map(&catalog->table_files);
+}
@@ -0,0 +1,49 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+// Schema catalog: maps an object's key sequence, and the member key it is
+// stored under, to the table it belongs to. Every distinct key order is cached
+// with its sorted permutation and its last table, so rows with a known shape
+// are placed with one hash lookup and never re-sorted. Keys must be interned:
+// shapes are matched by key pointer.
+// The catalog does no locking: find_* calls may run concurrently with each
+// other, but lookup_* calls (which insert) need exclusive access.
+typedef struct Shape {
+    char** keys;        // interned, in the order they were looked up
+    int count;
+    int* order;         // order[i] = index of the i-th key in sorted order
+    unsigned long hash;
+    int table_index;    // -1 until a table is assigned; for table files, the first table writing it
+    // Key sets: the member key their objects are stored under, NULL for the
+    // root. Key orders: the key table_index was last looked up for.
+    char* table_key;
+    int next_id;        // table files: next row id, taken by every table writing the file
+} Shape;
+
+// Open-addressing hash map of shapes, grown at half load
+typedef struct {
+    Shape** slots;
+    int capacity;
+    int count;
+} ShapeMap;
+
+// One per converter; zeroed memory is an empty catalog
+typedef struct {
+    ShapeMap shapes_by_order;   // exact key order -> shape
+    ShapeMap shapes_by_key_set; // member key and sorted keys -> key set
+    ShapeMap array_tables;      // array table file name
+    ShapeMap table_files;       // output file name -> its row ids
+} Catalog;
+
+Shape* find_shape(Catalog* catalog, char** keys, int count);
+Shape* lookup_shape(Catalog* catalog, char** keys, int count);
+Shape* find_key_set(Catalog* catalog, Shape* shape, char* table_key);
+Shape* lookup_key_set(Catalog* catalog, Shape* shape, char* table_key);
+Shape* find_array_table(Catalog* catalog, char* name);
+Shape* lookup_array_table(Catalog* catalog, char* name);
+Shape* lookup_table_file(Catalog* catalog, const char* name);
+Shape* next_catalog_entry(Catalog* catalog, int arrays, int* slot);
+void restore_key_set(Catalog* catalog, char** keys, int count, char* table_key, int table_index);
+void free_schema_catalog(Catalog* catalog);
+
+#endif
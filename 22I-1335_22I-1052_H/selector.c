@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "converter.h"
+#include "selector.h"
+
+// What becomes of a value, given where it stands against the selectors
+typedef enum {
+    CLASS_SKIP,     // outside every include, or inside an exclude
+    CLASS_PATH,     // on the way to an include: only objects and arrays
+                    // that can lead on are kept
+    CLASS_KEEP      // at or below an include
+} SelectClass;
+
+static int bad_selector(Converter* c, const char* text) {
+    converter_fail(c, CONVERT_ERROR_OPTIONS, "Invalid selector %s (expected $ followed by .name, [\"name\"], .* or [*])", text);
+    return -1;
+}
+
+static Segment* add_segment(Selector* selector, SegmentKind kind, const char* name, size_t len) {
+    selector->segments = realloc(selector->segments, (selector->count + 1) * sizeof(Segment));
+    if (!selector->segments) {
+        fprintf(stderr, "Error: Memory allocation failed for selector\n");
+        exit(1);
+    }
+    Segment* segment = &selector->segments[selector->count++];
+    segment->kind = kind;
+    segment->name = NULL;
+    if (name) {
+        segment->name = malloc(len + 1);
+        if (!segment->name) {
+            fprintf(stderr, "Error: Memory allocation failed for selector\n");
+            exit(1);
+        }
+        memcpy(segment->name, name, len);
+        segment->name[len] = '\0';
+    }
+    return segment;
+}
+
+// Reads a quoted member name, undoing backslash escapes; p is at the
+// opening quote. Returns the position after the closing quote, or NULL.
+static const char* parse_quoted(Selector* selector, const char* p) {
+    char quote = *p++;
+    size_t len = 0;
+    char* name = malloc(strlen(p) + 1);
+    if (!name) {
+        fprintf(stderr, "Error: Memory allocation failed for selector\n");
+        exit(1);
+    }
+    for (; *p && *p != quote; p++) {
+        if (*p == '\\' && p[1]) p++;
+        name[len++] = *p;
+    }
+    if (*p == quote) add_segment(selector, SEGMENT_MEMBER, name, len);
+    free(name);
+    return *p == quote ? p + 1 : NULL;
+}
+
+static int parse_selector(Converter* c, Selector* selector, const char* text) {
+    const char* p = text;
+    if (*p++ != '$') return bad_selector(c, text);
+    while (*p) {
+        if (p[0] == '.' && p[1] == '*' && (p[2] == '\0' || p[2] == '.' || p[2] == '[')) {
+            add_segment(selector, SEGMENT_ANY, NULL, 0);
+            p += 2;
+        } else if (p[0] == '.') {
+            size_t len = strcspn(p + 1, ".[");
+            if (len == 0) return bad_selector(c, text);
+            add_segment(selector, SEGMENT_MEMBER, p + 1, len);
+            p += 1 + len;
+        } else if (strncmp(p, "[*]", 3) == 0) {
+            add_segment(selector, SEGMENT_ELEMENTS, NULL, 0);
+            p += 3;
+        } else if (p[0] == '[' && (p[1] == '"' || p[1] == '\'')) {
+            p = parse_quoted(selector, p + 1);
+            if (!p || *p++ != ']') return bad_selector(c, text);
+        } else {
+            return bad_selector(c, text);
+        }
+    }
+    // Elements go together, so [*] at the end selects the same as the array
+    while (selector->count > 0 && selector->segments[selector->count - 1].kind == SEGMENT_ELEMENTS) selector->count--;
+    return 0;
+}
+
+static int add_selectors(Converter* c, const char** texts, int count, int exclude) {
+    Selectors* s = &c->selectors;
+    for (int i = 0; i < count; i++) {
+        Selector* selector = &s->selectors[s->count++];
+        selector->segments = NULL;
+        selector->count = 0;
+        selector->exclude = exclude;
+        if (parse_selector(c, selector, texts[i]) != 0) return -1;
+        if (exclude && selector->count == 0) {
+            converter_fail(c, CONVERT_ERROR_OPTIONS, "--exclude %s would skip every document", texts[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Parses the --include and --exclude options into the converter's selectors
+int compile_selectors(Converter* c) {
+    ConverterOptions* o = &c->options;
+    if (o->num_include + o->num_exclude == 0) return 0;
+    c->selectors.selectors = calloc(o->num_include + o->num_exclude, sizeof(Selector));
+    if (!c->selectors.selectors) {
+        fprintf(stderr, "Error: Memory allocation failed for selectors\n");
+        exit(1);
+    }
+    c->selectors.num_includes = o->num_include;
+    if (add_selectors(c, o->include, o->num_include, 0) != 0) return -1;
+    return add_selectors(c, o->exclude, o->num_exclude, 1);
+}
+
+void free_selectors(Selectors* selectors) {
+    for (int i = 0; i < selectors->count; i++) {
+        for (int j = 0; j < selectors->selectors[i].count; j++) free(selectors->selectors[i].segments[j].name);
+        free(selectors->selectors[i].segments);
+    }
+    free(selectors->selectors);
+    memset(selectors, 0, sizeof(Selectors));
+}
+
+// Positions count the segments of each selector matched so far: -1 once the
+// path has left it, and its length once the path is at or below it
+static void advance(const Selectors* s, const int* from, int* to, const char* key) {
+    for (int i = 0; i < s->count; i++) {
+        Selector* selector = &s->selectors[i];
+        int p = from[i];
+        if (p < 0 || p == selector->count) {
+            to[i] = p;
+            continue;
+        }
+        Segment* segment = &selector->segments[p];
+        int match = key ? segment->kind == SEGMENT_ANY || (segment->kind == SEGMENT_MEMBER && strcmp(segment->name, key) == 0)
+                        : segment->kind == SEGMENT_ELEMENTS;
+        to[i] = match ? p + 1 : -1;
+    }
+}
+
+static SelectClass classify(const Selectors* s, const int* positions) {
+    for (int i = s->num_includes; i < s->count; i++) {
+        if (positions[i] == s->selectors[i].count) return CLASS_SKIP;
+    }
+    if (s->num_includes == 0) return CLASS_KEEP;
+    SelectClass class = CLASS_SKIP;
+    for (int i = 0; i < s->num_includes; i++) {
+        if (positions[i] == s->selectors[i].count) return CLASS_KEEP;
+        if (positions[i] >= 0) class = CLASS_PATH;
+    }
+    return class;
+}
+
+// The kinds of value the lexer skips in place of one at positions
+static int skip_mask(const Selectors* s, const int* positions) {
+    switch (classify(s, positions)) {
+        case CLASS_SKIP: return SKIP_OBJECT | SKIP_ARRAY | SKIP_SCALAR;
+        case CLASS_KEEP: return 0;
+        case CLASS_PATH: break;
+    }
+    int mask = SKIP_OBJECT | SKIP_ARRAY | SKIP_SCALAR;
+    for (int i = 0; i < s->num_includes; i++) {
+        int p = positions[i];
+        if (p < 0 || p == s->selectors[i].count) continue;
+        if (s->selectors[i].segments[p].kind == SEGMENT_ELEMENTS) mask &= ~SKIP_ARRAY;
+        else mask &= ~SKIP_OBJECT;
+    }
+    return mask;
+}
+
+static int* level_positions(SelectState* select, int level) {
+    return select->positions + (size_t)level * 2 * select->selectors->count;
+}
+
+static void push_level(SelectState* select, int is_array) {
+    int n = select->selectors->count;
+    if (select->depth + 1 == select->capacity) {
+        select->capacity *= 2;
+        select->positions = realloc(select->positions, (size_t)select->capacity * 2 * n * sizeof(int));
+        select->classes = realloc(select->classes, select->capacity * sizeof(int));
+        if (!select->positions || !select->classes) {
+            fprintf(stderr, "Error: Memory allocation failed for selector state\n");
+            exit(1);
+        }
+    }
+    int* parent = level_positions(select, select->depth);
+    int* level = level_positions(select, ++select->depth);
+    memcpy(level, parent + n, n * sizeof(int));
+    if (is_array) {
+        // Every element stands in the same place
+        advance(select->selectors, level, level + n, NULL);
+        select->classes[select->depth] = classify(select->selectors, level + n);
+    }
+}
+
+// Sets up the selectors for one parse; returns NULL when there are none.
+// Level 0 stands for the document, whose root value starts every path.
+// Chunks of --split start inside the root array.
+SelectState* select_start(Converter* c, SelectState* select, int in_root_array) {
+    const Selectors* s = &c->selectors;
+    if (s->count == 0) return NULL;
+    select->selectors = s;
+    select->depth = 0;
+    select->capacity = 16;
+    select->positions = calloc((size_t)select->capacity * 2 * s->count, sizeof(int));
+    select->classes = calloc(select->capacity, sizeof(int));
+    if (!select->positions || !select->classes) {
+        fprintf(stderr, "Error: Memory allocation failed for selector state\n");
+        exit(1);
+    }
+    select->classes[0] = classify(s, select->positions + s->count);
+    if (in_root_array) push_level(select, 1);
+    return select;
+}
+
+void select_finish(SelectState* select) {
+    if (!select) return;
+    free(select->positions);
+    free(select->classes);
+}
+
+void select_open(ParseState* state, int is_array) {
+    push_level(state->select, is_array);
+}
+
+void select_close(ParseState* state) {
+    state->select->depth--;
+}
+
+// Works out where the member named key stands, and has the lexer skip its
+// value unless it is a kind that is kept there
+void select_key(ParseState* state, const char* key) {
+    SelectState* select = state->select;
+    int n = select->selectors->count;
+    int* level = level_positions(select, select->depth);
+    advance(select->selectors, level, level + n, key);
+    select->classes[select->depth] = classify(select->selectors, level + n);
+    state->skip = skip_mask(select->selectors, level + n);
+}
+
+// Decides whether a member value is added to its object: skipped values
+// are gone already, and objects on the way to an include that ended up
+// with no members are dropped with their subtree by the caller
+int select_member(ParseState* state, ASTNode* value) {
+    SelectState* select = state->select;
+    if (!value) return 0;
+    if (select->classes[select->depth] != CLASS_PATH) return 1;
+    return value->type == OBJ ? value->count > 0 : value->type == ARR;
+}
@@ -0,0 +1,63 @@
+#ifndef SELECTOR_H
+#define SELECTOR_H
+
+#include "json2relcsv.h"
+#include "parser.tab.h"
+
+// --include and --exclude: JSONPath-like selectors that pick the parts of
+// each document to convert. A selector starts at the document ($) and goes
+// down through members (.name, ["name"], or .* for any member) and array
+// elements ([*]); elements are always taken together, so a trailing [*]
+// changes nothing.
+//
+// A value is converted when it lies at or below an --include path (every
+// value, without one) and not at or below an --exclude path. Objects on the
+// way to an included path are kept too, with only the members leading on,
+// so the selected tables keep their parent ids. Everything else is skipped
+// by the lexer, which matches brackets over the raw input without making
+// tokens, so skipped subtrees cost neither nodes nor rows. Skipped text is
+// only checked for balanced brackets and closed strings.
+typedef enum {
+    SEGMENT_MEMBER,     // .name
+    SEGMENT_ANY,        // .*
+    SEGMENT_ELEMENTS    // [*]
+} SegmentKind;
+
+typedef struct {
+    SegmentKind kind;
+    char* name;
+} Segment;
+
+typedef struct {
+    Segment* segments;
+    int count;
+    int exclude;
+} Selector;
+
+typedef struct {
+    Selector* selectors;
+    int count;
+    int num_includes;
+} Selectors;
+
+// Where the containers open in one parse stand against each selector
+typedef struct SelectState {
+    const Selectors* selectors;
+    int* positions;     // per level: segments matched by the container,
+                        // then by its next child
+    int* classes;       // per level: what to do with the next child
+    int depth;
+    int capacity;
+} SelectState;
+
+int compile_selectors(Converter* c);
+void free_selectors(Selectors* selectors);
+
+SelectState* select_start(Converter* c, SelectState* select, int in_root_array);
+void select_finish(SelectState* select);
+void select_open(ParseState* state, int is_array);
+void select_close(ParseState* state);
+void select_key(ParseState* state, const char* key);
+int select_member(ParseState* state, ASTNode* value);
+
+#endif
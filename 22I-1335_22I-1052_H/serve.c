@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "converter.h"
+#include "compress.h"
+#include "intern.h"
+#include "parser.tab.h"
+#include "serve.h"
+
+typedef struct {
+    int fd;
+    char* data;         // bytes received and not yet taken as documents
+    size_t len;
+    size_t cap;
+} Client;
+
+// A table's row count and next id before a request, to work out what the
+// request added
+typedef struct {
+    unsigned long long rows;
+    int next_id;
+} TableMark;
+
+typedef struct {
+    Converter* converter;
+    const char* path;
+    int listen_fd;
+    int wake[2];        // converter_stop writes to wake[1]
+    Client* clients;
+    int num_clients;
+    int max_clients;
+    struct pollfd* polls;
+    TableMark* marks;
+    int max_marks;
+    size_t unflushed;   // request bytes converted since the last flush
+    long long flush_at; // when the oldest unflushed rows must be flushed
+    CsvRow reply;
+} Server;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// --serve converts documents one at a time on one thread, so it only works
+// with the modes that build a whole tree per document
+static int check_serve_options(Converter* c) {
+    ConverterOptions* o = &c->options;
+    if (!compression_available(o->compression)) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "json2relcsv was built without %s support", compression_name(o->compression));
+        return -1;
+    }
+    if (o->compression && o->format == FORMAT_ARROW) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--compress cannot be used with --format arrow");
+        return -1;
+    }
+    if (o->emit_index && (o->compression || o->format == FORMAT_ARROW)) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--emit-index cannot be used with --compress or --format arrow");
+        return -1;
+    }
+    if (o->stream || o->pipeline || o->writers || o->split_jobs || o->ndjson || o->print_ast) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--serve cannot be used with --stream, --pipeline, --split, --ndjson or --print-ast");
+        return -1;
+    }
+    if (o->jobs || o->append || o->checkpoint_interval) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--serve cannot be used with --jobs, --append or --checkpoint");
+        return -1;
+    }
+    if (o->emit_cache || o->from_cache) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--serve cannot be used with --emit-cache or --from-cache");
+        return -1;
+    }
+    if (o->flush_interval_ms < 1 || o->flush_bytes < 1) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "--serve needs a positive flush interval and size");
+        return -1;
+    }
+    return compile_selectors(c);
+}
+
+// Binds the socket, replacing a stale one left by a server that is gone
+static int open_socket(Server* s) {
+    Converter* c = s->converter;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(s->path) >= sizeof(addr.sun_path)) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "Socket path %s is too long", s->path);
+        return -1;
+    }
+    strcpy(addr.sun_path, s->path);
+
+    struct stat st;
+    if (lstat(s->path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            converter_fail(c, CONVERT_ERROR_INPUT, "%s exists and is not a socket", s->path);
+            return -1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (live) {
+            converter_fail(c, CONVERT_ERROR_INPUT, "Another server is listening on %s", s->path);
+            return -1;
+        }
+        unlink(s->path);
+    }
+
+    s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (s->listen_fd < 0 || bind(s->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(s->listen_fd, 64) != 0) {
+        converter_fail(c, CONVERT_ERROR_RESOURCE, "Cannot listen on %s", s->path);
+        return -1;
+    }
+    return 0;
+}
+
+static void add_client(Server* s, int fd) {
+    if (s->num_clients == s->max_clients) {
+        s->max_clients = s->max_clients ? s->max_clients * 2 : 16;
+        s->clients = realloc(s->clients, s->max_clients * sizeof(Client));
+        s->polls = realloc(s->polls, (s->max_clients + 2) * sizeof(struct pollfd));
+        if (!s->clients || !s->polls) {
+            fprintf(stderr, "Error: Memory allocation failed for clients\n");
+            exit(1);
+        }
+    }
+    Client* client = &s->clients[s->num_clients++];
+    client->fd = fd;
+    client->data = NULL;
+    client->len = 0;
+    client->cap = 0;
+}
+
+static void drop_client(Server* s, int i) {
+    close(s->clients[i].fd);
+    free(s->clients[i].data);
+    s->clients[i] = s->clients[--s->num_clients];
+}
+
+static void accept_clients(Server* s) {
+    int fd;
+    while ((fd = accept(s->listen_fd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        add_client(s, fd);
+    }
+}
+
+// Sends the reply line; returns -1 if the client has gone
+static int send_reply(Server* s, Client* client) {
+    csv_row_char(&s->reply, '\n');
+    size_t sent = 0;
+    while (sent < s->reply.len) {
+        ssize_t n = send(client->fd, s->reply.data + sent, s->reply.len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+static void reply_string(CsvRow* reply, const char* s) {
+    csv_row_char(reply, '"');
+    for (; *s; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            csv_row_char(reply, '\\');
+            csv_row_char(reply, ch);
+        } else if (ch < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", ch);
+            csv_row_raw(reply, escape, 6);
+        } else {
+            csv_row_char(reply, ch);
+        }
+    }
+    csv_row_char(reply, '"');
+}
+
+static void reply_error(Server* s, const char* message) {
+    s->reply.len = 0;
+    csv_row_raw(&s->reply, "{\"status\": \"error\", \"error\": ", 29);
+    reply_string(&s->reply, message);
+    csv_row_char(&s->reply, '}');
+}
+
+// Remembers every table's row count and next id before a request
+static void mark_tables(Server* s) {
+    Converter* c = s->converter;
+    if (c->num_tables > s->max_marks) {
+        s->max_marks = c->num_tables * 2;
+        s->marks = realloc(s->marks, s->max_marks * sizeof(TableMark));
+        if (!s->marks) {
+            fprintf(stderr, "Error: Memory allocation failed for table marks\n");
+            exit(1);
+        }
+    }
+    const char* name;
+    const char* ids;
+    char** columns;
+    int num_columns;
+    int pending;
+    unsigned long long bytes;
+    for (int i = 0; i < c->num_tables; i++) {
+        get_table_stats(c, i, &name, &num_columns, &s->marks[i].rows, &bytes);
+        get_table_state(c, i, &name, &ids, &columns, &num_columns, &s->marks[i].next_id, &pending);
+    }
+}
+
+// What a request added to table index: rows, and the ids from first to
+// last (first > last if none)
+static unsigned long long table_delta(Server* s, int index, int num_marked, int* first, int* last) {
+    const char* name;
+    const char* ids;
+    char** columns;
+    int num_columns;
+    unsigned long long rows;
+    unsigned long long bytes;
+    int next_id;
+    int pending;
+    get_table_stats(s->converter, index, &name, &num_columns, &rows, &bytes);
+    get_table_state(s->converter, index, &name, &ids, &columns, &num_columns, &next_id, &pending);
+    *first = 1;
+    if (index < num_marked) {
+        rows -= s->marks[index].rows;
+        *first = s->marks[index].next_id;
+    } else {
+        // A new table takes ids from its family's counter, which may be older
+        for (int i = 0; i < num_marked; i++) {
+            const char* marked_ids;
+            int marked_next;
+            get_table_state(s->converter, i, &name, &marked_ids, &columns, &num_columns, &marked_next, &pending);
+            if (strcmp(marked_ids, ids) == 0) {
+                *first = s->marks[i].next_id;
+                break;
+            }
+        }
+    }
+    *last = next_id - 1;
+    return rows;
+}
+
+static const char* table_name(Converter* c, int index) {
+    const char* name;
+    int num_columns;
+    unsigned long long rows;
+    unsigned long long bytes;
+    get_table_stats(c, index, &name, &num_columns, &rows, &bytes);
+    return name;
+}
+
+// Lists the rows the request added per table file (several key sets may
+// share one), in the order the files were created
+static void reply_summary(Server* s, int num_marked) {
+    Converter* c = s->converter;
+    unsigned long long total = 0;
+    CsvRow tables = { NULL, 0, 0 };
+    for (int i = 0; i < c->num_tables; i++) {
+        const char* name = table_name(c, i);
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) seen = strcmp(table_name(c, j), name) == 0;
+        if (seen) continue;
+
+        unsigned long long rows = 0;
+        int first_id = 1;
+        int last_id = 0;
+        for (int j = i; j < c->num_tables; j++) {
+            if (j > i && strcmp(table_name(c, j), name) != 0) continue;
+            int first;
+            int last;
+            unsigned long long added = table_delta(s, j, num_marked, &first, &last);
+            if (added == 0) continue;
+            rows += added;
+            if (first > last) continue;
+            if (first_id > last_id || first < first_id) first_id = first;
+            if (first_id > last_id || last > last_id) last_id = last;
+        }
+        if (rows == 0) continue;
+
+        total += rows;
+        csv_row_raw(&tables, "{\"table\": ", 10);
+        reply_string(&tables, name);
+        csv_row_raw(&tables, ", \"rows\": ", 10);
+        csv_row_int(&tables, (long)rows);
+        if (first_id <= last_id) {
+            csv_row_raw(&tables, ", \"first_id\": ", 14);
+            csv_row_int(&tables, first_id);
+            csv_row_raw(&tables, ", \"last_id\": ", 13);
+            csv_row_int(&tables, last_id);
+        }
+        csv_row_raw(&tables, "}, ", 3);
+    }
+
+    s->reply.len = 0;
+    csv_row_raw(&s->reply, "{\"status\": \"ok\", \"rows\": ", 25);
+    csv_row_int(&s->reply, (long)total);
+    csv_row_raw(&s->reply, ", \"tables\": [", 13);
+    csv_row_raw(&s->reply, tables.data, tables.len ? tables.len - 2 : 0);
+    csv_row_raw(&s->reply, "]}", 2);
+    csv_row_free(&tables);
+}
+
+static void flush_tables(Server* s) {
+    csv_sync(&s->converter->writers);
+    s->unflushed = 0;
+}
+
+// Converts one document and leaves the answer in s->reply. A document that
+// does not parse only fails its request; anything else fails the server.
+// The keys of a converted document stay in the catalog, but those of a
+// rejected one are taken back out of the string pool, so the pool only
+// grows with the catalog, and stops at SERVE_MAX_KEYS.
+static void convert_request(Server* s, const char* data, size_t len) {
+    Converter* c = s->converter;
+    int keys = intern_keys();
+    intern_mark();
+    ASTNode* root = parse_buffer(c, data, len);
+    if (!root) {
+        reply_error(s, converter_error(c));
+        ConvertStatus status = c->status;
+        if (status == CONVERT_ERROR_SYNTAX || status == CONVERT_ERROR_INPUT) converter_clear_error(c);
+        intern_rollback();
+        return;
+    }
+    if (root->type != OBJ && root->type != ARR) {
+        reply_error(s, "the document must be an object or an array");
+        free_ast(root);
+        intern_rollback();
+        return;
+    }
+    if (intern_keys() > keys && intern_keys() > SERVE_MAX_KEYS) {
+        reply_error(s, "the document has keys the server has no room left for");
+        free_ast(root);
+        intern_rollback();
+        return;
+    }
+
+    int num_marked = c->num_tables;
+    mark_tables(s);
+    generate_csv(c, root);
+    free_ast(root);
+    if (converter_failed(c)) {
+        reply_error(s, converter_error(c));
+        return;
+    }
+    reply_summary(s, num_marked);
+
+    if (s->unflushed == 0) s->flush_at = now_ms() + c->options.flush_interval_ms;
+    s->unflushed += len ? len : 1;
+    if (s->unflushed >= c->options.flush_bytes) flush_tables(s);
+}
+
+// Finds the next whole document in the client's buffer. Returns 1 with its
+// bounds and the bytes it used up, 0 if more input is needed, or -1 if the
+// framing is broken.
+static int next_document(Client* client, int at_end, size_t* start, size_t* len, size_t* used) {
+    const char* data = client->data;
+    size_t pos = 0;
+    while (pos < client->len && (data[pos] == '\n' || data[pos] == '\r' || data[pos] == ' ' || data[pos] == '\t')) pos++;
+    if (pos == client->len) {
+        *used = pos;
+        return 0;
+    }
+
+    const char* nl = memchr(data + pos, '\n', client->len - pos);
+    if (data[pos] == '@') {
+        if (!nl) return client->len - pos > 24 ? -1 : 0;
+        char* end;
+        unsigned long long length = strtoull(data + pos + 1, &end, 10);
+        if (end == data + pos + 1 || (*end != '\n' && *end != '\r') || length > SERVE_MAX_DOCUMENT) return -1;
+        size_t body = nl + 1 - data;
+        if (client->len - body < length) return 0;
+        *start = body;
+        *len = length;
+        *used = body + length;
+        return 1;
+    }
+
+    size_t end = nl ? (size_t)(nl - data) : client->len;
+    if (!nl && !at_end) return client->len - pos > SERVE_MAX_DOCUMENT ? -1 : 0;
+    *start = pos;
+    *len = end - pos;
+    if (*len > 0 && data[end - 1] == '\r') (*len)--;
+    *used = nl ? end + 1 : end;
+    return 1;
+}
+
+// Reads what the client sent and answers every whole document in it.
+// Returns -1 once the client is done or gone.
+static int serve_client(Server* s, Client* client) {
+    if (client->cap - client->len < 65536) {
+        client->cap = client->cap ? client->cap * 2 : 131072;
+        client->data = realloc(client->data, client->cap);
+        if (!client->data) {
+            fprintf(stderr, "Error: Memory allocation failed for request\n");
+            exit(1);
+        }
+    }
+    ssize_t n = recv(client->fd, client->data + client->len, client->cap - client->len, 0);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+    int at_end = n <= 0;
+    if (n > 0) client->len += n;
+
+    size_t start = 0;
+    size_t len = 0;
+    size_t used = 0;
+    int found;
+    while (!converter_failed(s->converter) && (found = next_document(client, at_end, &start, &len, &used)) != 0) {
+        if (found < 0) {
+            reply_error(s, "malformed request framing");
+            send_reply(s, client);
+            return -1;
+        }
+        convert_request(s, client->data + start, len);
+        if (send_reply(s, client) != 0) return -1;
+        memmove(client->data, client->data + used, client->len - used);
+        client->len -= used;
+    }
+    return at_end ? -1 : 0;
+}
+
+// Waits for requests until converter_stop or a failed write
+static void serve_clients(Server* s) {
+    Converter* c = s->converter;
+    while (!__atomic_load_n(&c->stopping, __ATOMIC_ACQUIRE) && !converter_failed(c)) {
+        struct pollfd* polls = s->polls;
+        polls[0] = (struct pollfd){ s->listen_fd, POLLIN, 0 };
+        polls[1] = (struct pollfd){ s->wake[0], POLLIN, 0 };
+        for (int i = 0; i < s->num_clients; i++) polls[i + 2] = (struct pollfd){ s->clients[i].fd, POLLIN, 0 };
+        int num_polls = s->num_clients + 2;
+
+        int timeout = -1;
+        if (s->unflushed) {
+            long long wait = s->flush_at - now_ms();
+            timeout = wait > 0 ? (int)wait : 0;
+        }
+        int ready = poll(polls, num_polls, timeout);
+        if (ready < 0 && errno != EINTR) {
+            converter_fail(c, CONVERT_ERROR_RESOURCE, "Cannot wait for requests on %s", s->path);
+            break;
+        }
+        if (s->unflushed && now_ms() >= s->flush_at) flush_tables(s);
+        if (ready <= 0) continue;
+
+        if (polls[1].revents) {
+            char drain[64];
+            while (read(s->wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        // Clients are served before new ones are accepted, which may move them
+        for (int i = num_polls - 3; i >= 0; i--) {
+            if (polls[i + 2].revents && serve_client(s, &s->clients[i]) != 0) drop_client(s, i);
+        }
+        if (polls[0].revents) accept_clients(s);
+    }
+}
+
+ConvertStatus converter_serve(Converter* c, const char* socket_path) {
+    if (c->ran) {
+        converter_fail(c, CONVERT_ERROR_OPTIONS, "A converter runs only once");
+        return c->status;
+    }
+    c->ran = 1;
+    if (check_serve_options(c) != 0) return c->status;
+
+    Server s;
+    memset(&s, 0, sizeof(Server));
+    s.converter = c;
+    s.path = socket_path;
+    s.listen_fd = -1;
+    s.polls = malloc(2 * sizeof(struct pollfd));
+    if (!s.polls) {
+        fprintf(stderr, "Error: Memory allocation failed for clients\n");
+        exit(1);
+    }
+    if (open_socket(&s) != 0) {
+        if (s.listen_fd >= 0) close(s.listen_fd);
+        free(s.polls);
+        return c->status;
+    }
+    if (pipe(s.wake) != 0) {
+        converter_fail(c, CONVERT_ERROR_RESOURCE, "Cannot create the wake-up pipe for %s", socket_path);
+        close(s.listen_fd);
+        unlink(socket_path);
+        free(s.polls);
+        return c->status;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(s.wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(s.wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    __atomic_store_n(&c->wake_fd, s.wake[1], __ATOMIC_RELEASE);
+    c->count_rows = 1;
+
+    stats_start(c);
+    serve_clients(&s);
+
+    __atomic_store_n(&c->wake_fd, -1, __ATOMIC_RELEASE);
+    while (s.num_clients > 0) drop_client(&s, s.num_clients - 1);
+    close(s.listen_fd);
+    unlink(socket_path);
+    close(s.wake[0]);
+    close(s.wake[1]);
+    free(s.clients);
+    free(s.polls);
+    free(s.marks);
+    csv_row_free(&s.reply);
+    release_row_buffer();
+    finish_tables(c);
+    return c->status;
+}
@@ -0,0 +1,34 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "json2relcsv.h"
+
+// --serve: a long-running converter listening on a Unix domain socket. Tables,
+// the schema catalog and the open writers stay warm across requests, so a
+// small document costs a parse and a few row writes.
+//
+// A client sends any number of documents on one connection, each either
+//   - one line of NDJSON, ending at a newline (or at the end of the
+//     connection), or
+//   - a line "@<length>" followed by exactly <length> bytes of JSON, which
+//     may span lines.
+// Blank lines between documents are skipped. For every document the server
+// answers with one line of JSON, in order:
+//   {"status": "ok", "rows": 3, "tables": [{"table": "main.csv", "rows": 1, "first_id": 7, "last_id": 7}, ...]}
+//   {"status": "error", "error": "syntax error at line 1, column 9"}
+// first_id and last_id are left out for tables without an id column. A
+// document that does not parse is rejected on its own; a failed write stops
+// the server.
+//
+// Rows are buffered and reach the files when the writers flush: at the
+// latest flush_interval_ms after a request, or once flush_bytes of
+// documents have arrived since the last flush.
+//
+// Every key the server has converted stays in the string pool for the
+// catalog. A document that adds keys once the pool holds SERVE_MAX_KEYS
+// (short keys the bounded value pool already holds aside) is rejected, and
+// the strings of any rejected document are dropped again.
+#define SERVE_MAX_DOCUMENT (1 << 30)
+#define SERVE_MAX_KEYS (1 << 20)
+
+#endif
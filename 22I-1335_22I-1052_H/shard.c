@@ -0,0 +1,82 @@
+#include "shard.h"
+#include "converter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int sharding_enabled(Converter* c) {
+    return c->options.shard_rows > 0 || c->options.shard_bytes > 0;
+}
+
+static void manifest_string(CsvRow* out, const char* s) {
+    csv_row_char(out, '"');
+    for (; *s; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            csv_row_char(out, '\\');
+            csv_row_char(out, ch);
+        } else if (ch < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", ch);
+            csv_row_raw(out, escape, 6);
+        } else {
+            csv_row_char(out, ch);
+        }
+    }
+    csv_row_char(out, '"');
+}
+
+// Adds the parts of a closed table file to the manifest, named relative to
+// the output directory
+void record_shards(Converter* c, const char* table, const char* key, CsvPart* parts, int num_parts) {
+    CsvRow* out = &c->shards;
+    char number[96];
+    if (out->len > 0) csv_row_raw(out, ",\n", 2);
+    csv_row_raw(out, "  {\"table\": ", 12);
+    manifest_string(out, table);
+    csv_row_raw(out, ", \"key\": ", 9);
+    manifest_string(out, key);
+    csv_row_raw(out, ", \"parts\": [", 12);
+    for (int i = 0; i < num_parts; i++) {
+        const char* file = strrchr(parts[i].path, '/');
+        csv_row_raw(out, i ? ",\n    {\"file\": " : "\n    {\"file\": ", i ? 15 : 14);
+        manifest_string(out, file ? file + 1 : parts[i].path);
+        int len = snprintf(number, sizeof(number), ", \"rows\": %llu", parts[i].rows);
+        csv_row_raw(out, number, len);
+        if (parts[i].rows > 0) {
+            len = snprintf(number, sizeof(number), ", \"first_id\": %ld, \"last_id\": %ld", parts[i].first_key, parts[i].last_key);
+            csv_row_raw(out, number, len);
+        }
+        csv_row_char(out, '}');
+    }
+    csv_row_raw(out, "]}", 2);
+}
+
+// Writes the manifest once every table is closed, through a temporary file
+// renamed into place like the --append manifest
+void save_shard_manifest(Converter* c) {
+    char* path = malloc(strlen(c->output_dir) + strlen(SHARD_MANIFEST_NAME) + 6);
+    char* temporary = malloc(strlen(c->output_dir) + strlen(SHARD_MANIFEST_NAME) + 6);
+    if (!path || !temporary) {
+        fprintf(stderr, "Error: Memory allocation failed for shard manifest path\n");
+        exit(1);
+    }
+    sprintf(path, "%s/%s", c->output_dir, SHARD_MANIFEST_NAME);
+    sprintf(temporary, "%s/%s.tmp", c->output_dir, SHARD_MANIFEST_NAME);
+    FILE* f = fopen(temporary, "w");
+    if (!f) {
+        converter_fail(c, CONVERT_ERROR_OUTPUT, "Cannot write shard manifest %s", temporary);
+    } else {
+        fprintf(f, "{\"tables\": [\n");
+        if (c->shards.len > 0) {
+            fwrite(c->shards.data, 1, c->shards.len, f);
+            fputc('\n', f);
+        }
+        fprintf(f, "]}\n");
+        if (fclose(f) != 0 || rename(temporary, path) != 0) {
+            converter_fail(c, CONVERT_ERROR_OUTPUT, "Cannot write shard manifest %s", path);
+        }
+    }
+    free(temporary);
+    free(path);
+}
@@ -0,0 +1,27 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "json2relcsv.h"
+#include "csv_writer.h"
+
+// --shard-rows and --shard-bytes: every table file is written as numbered
+// parts, x.part-00001.csv and on, each starting with the header, so loaders
+// can take the parts of one table in parallel. Once the tables are closed,
+// the output directory gets a manifest of the parts:
+//   {"tables": [
+//     {"table": "main.csv", "key": "id", "parts": [
+//       {"file": "main.part-00001.csv", "rows": 1000, "first_id": 1, "last_id": 1000},
+//       ...]},
+//     ...]}
+// key is the first column of the table, the id or an array table's parent
+// id; first_id and last_id are its smallest and largest values in the part,
+// left out for an empty part. When several threads write one table (--jobs,
+// --split), its ids are not written in order and the ranges of its parts
+// may overlap.
+#define SHARD_MANIFEST_NAME "json2relcsv.shards.json"
+
+int sharding_enabled(Converter* c);
+void record_shards(Converter* c, const char* table, const char* key, CsvPart* parts, int num_parts);
+void save_shard_manifest(Converter* c);
+
+#endif
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "converter.h"
+#include "simd_lexer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_LEXER_X86 1
+#include <immintrin.h>
+#endif
+
+struct SimdLexer {
+    const char* data;
+    size_t size;
+    size_t pos;         // next unread byte
+    size_t mark;        // where line/column are reported from
+    int mapped;
+    ParseState* state;
+};
+
+// Scanning kernels: each returns the first position at or after p (and
+// before end) that is not JSON whitespace, or that holds '"' or '\\'
+typedef const char* (*ScanFn)(const char* p, const char* end);
+
+static const char* skip_whitespace_scalar(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+static const char* find_string_special_scalar(const char* p, const char* end) {
+    while (p < end && *p != '"' && *p != '\\') p++;
+    return p;
+}
+
+// For skipping subtrees: the next quote or bracket
+static const char* find_structural_scalar(const char* p, const char* end) {
+    while (p < end && *p != '"' && *p != '{' && *p != '}' && *p != '[' && *p != ']') p++;
+    return p;
+}
+
+#ifdef SIMD_LEXER_X86
+__attribute__((target("sse2")))
+static const char* skip_whitespace_sse2(const char* p, const char* end) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; p + 16 <= end; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+        unsigned mask = ~_mm_movemask_epi8(ws) & 0xffff;
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return skip_whitespace_scalar(p, end);
+}
+
+__attribute__((target("sse2")))
+static const char* find_string_special_sse2(const char* p, const char* end) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; p + 16 <= end; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_string_special_scalar(p, end);
+}
+
+__attribute__((target("sse2")))
+static const char* find_structural_sse2(const char* p, const char* end) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i open_brace = _mm_set1_epi8('{');
+    const __m128i close_brace = _mm_set1_epi8('}');
+    const __m128i open_bracket = _mm_set1_epi8('[');
+    const __m128i close_bracket = _mm_set1_epi8(']');
+    for (; p + 16 <= end; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, open_brace), _mm_cmpeq_epi8(chunk, close_brace)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(chunk, open_bracket), _mm_cmpeq_epi8(chunk, close_bracket)));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(hit, _mm_cmpeq_epi8(chunk, quote)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_structural_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* skip_whitespace_avx2(const char* p, const char* end) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    for (; p + 32 <= end; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+        __m256i ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, tab)),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr), _mm256_cmpeq_epi8(chunk, lf)));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(ws);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return skip_whitespace_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* find_string_special_avx2(const char* p, const char* end) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    for (; p + 32 <= end; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_string_special_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* find_structural_avx2(const char* p, const char* end) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i open_brace = _mm256_set1_epi8('{');
+    const __m256i close_brace = _mm256_set1_epi8('}');
+    const __m256i open_bracket = _mm256_set1_epi8('[');
+    const __m256i close_bracket = _mm256_set1_epi8(']');
+    for (; p + 32 <= end; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, open_brace), _mm256_cmpeq_epi8(chunk, close_brace)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(chunk, open_bracket), _mm256_cmpeq_epi8(chunk, close_bracket)));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, quote)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_structural_sse2(p, end);
+}
+#endif
+
+static ScanFn skip_whitespace = NULL;
+static ScanFn find_string_special = NULL;
+static ScanFn find_structural = NULL;
+
+// Picks the widest kernels the CPU supports, once per process
+static void select_kernels() {
+    ScanFn skip = skip_whitespace_scalar;
+    ScanFn special = find_string_special_scalar;
+    ScanFn structural = find_structural_scalar;
+#ifdef SIMD_LEXER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        skip = skip_whitespace_avx2;
+        special = find_string_special_avx2;
+        structural = find_structural_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        skip = skip_whitespace_sse2;
+        special = find_string_special_sse2;
+        structural = find_structural_sse2;
+    }
+#endif
+    __atomic_store_n(&find_string_special, special, __ATOMIC_RELAXED);
+    __atomic_store_n(&find_structural, structural, __ATOMIC_RELAXED);
+    __atomic_store_n(&skip_whitespace, skip, __ATOMIC_RELEASE);
+}
+
+SimdLexer* simd_lexer_open(const char* filename, ParseState* state) {
+    if (!__atomic_load_n(&skip_whitespace, __ATOMIC_ACQUIRE)) select_kernels();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        converter_fail(state->converter, CONVERT_ERROR_INPUT, "Cannot open input file %s", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        converter_fail(state->converter, CONVERT_ERROR_INPUT, "Cannot stat input file %s", filename);
+        close(fd);
+        return NULL;
+    }
+
+    SimdLexer* lexer = malloc(sizeof(SimdLexer));
+    if (!lexer) {
+        fprintf(stderr, "Error: Memory allocation failed for lexer\n");
+        exit(1);
+    }
+    lexer->size = st.st_size;
+    lexer->pos = 0;
+    lexer->mark = 0;
+    lexer->state = state;
+    lexer->mapped = lexer->size > 0;
+    if (lexer->mapped) {
+        void* data = mmap(NULL, lexer->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            converter_fail(state->converter, CONVERT_ERROR_INPUT, "Cannot map input file %s", filename);
+            free(lexer);
+            close(fd);
+            return NULL;
+        }
+        madvise(data, lexer->size, MADV_SEQUENTIAL);
+        lexer->data = data;
+    } else {
+        lexer->data = "";
+    }
+    close(fd);
+    return lexer;
+}
+
+void simd_lexer_close(SimdLexer* lexer) {
+    if (!lexer) return;
+    if (lexer->mapped) munmap((void*)lexer->data, lexer->size);
+    free(lexer);
+}
+
+// A lexer over bytes [start, end) of whole's mapping, for parsing one chunk
+// of a split input. Tokens borrow from the same mapping, and positions are
+// still counted from the start of the file.
+SimdLexer* simd_lexer_slice(SimdLexer* whole, size_t start, size_t end, ParseState* state) {
+    SimdLexer* lexer = malloc(sizeof(SimdLexer));
+    if (!lexer) {
+        fprintf(stderr, "Error: Memory allocation failed for lexer\n");
+        exit(1);
+    }
+    lexer->data = whole->data;
+    lexer->size = end;
+    lexer->pos = start;
+    lexer->mark = start;
+    lexer->state = state;
+    lexer->mapped = 0;      // the mapping stays with whole
+    return lexer;
+}
+
+// A lexer over a document already in memory, for --serve. Tokens borrow
+// from data, which the caller keeps until the nodes are freed.
+SimdLexer* simd_lexer_buffer(const char* data, size_t size, ParseState* state) {
+    if (!__atomic_load_n(&skip_whitespace, __ATOMIC_ACQUIRE)) select_kernels();
+    SimdLexer* lexer = malloc(sizeof(SimdLexer));
+    if (!lexer) {
+        fprintf(stderr, "Error: Memory allocation failed for lexer\n");
+        exit(1);
+    }
+    lexer->data = data;
+    lexer->size = size;
+    lexer->pos = 0;
+    lexer->mark = 0;
+    lexer->state = state;
+    lexer->mapped = 0;
+    return lexer;
+}
+
+// Continues lexing from byte offset pos, where a previous run stopped
+int simd_lexer_seek(SimdLexer* lexer, size_t pos) {
+    if (pos > lexer->size) {
+        converter_fail(lexer->state->converter, CONVERT_ERROR_INPUT, "%s is shorter than the resume offset",
+                       lexer->state->filename);
+        return -1;
+    }
+    lexer->pos = pos;
+    lexer->mark = pos;
+    lexer->state->offset = pos;
+    return 0;
+}
+
+// The mapped input and its size
+const char* simd_lexer_input(SimdLexer* lexer, size_t* size) {
+    *size = lexer->size;
+    return lexer->data;
+}
+
+// Fills in the parse state's line and column for the marked position. Only
+// needed for error messages, so positions are not tracked while scanning.
+void simd_lexer_locate(SimdLexer* lexer) {
+    int line = 1;
+    const char* line_start = lexer->data;
+    const char* end = lexer->data + lexer->mark;
+    const char* nl;
+    while ((nl = memchr(line_start, '\n', end - line_start))) {
+        line++;
+        line_start = nl + 1;
+    }
+    lexer->state->line = line;
+    lexer->state->column = 1 + (int)(end - line_start);
+}
+
+static int invalid_character(SimdLexer* lexer, size_t at) {
+    lexer->mark = at;
+    simd_lexer_locate(lexer);
+    converter_fail(lexer->state->converter, CONVERT_ERROR_SYNTAX, "Invalid character '%c' at line %d, column %d",
+                   lexer->data[at], lexer->state->line, lexer->state->column);
+    return INVALID;
+}
+
+// Lexes the string whose opening quote is at start. Only strings containing
+// a backslash are copied, decoding the same escapes as process_string.
+static int lex_string(YYSTYPE* lval, SimdLexer* lexer, size_t start) {
+    const char* data = lexer->data;
+    const char* end = data + lexer->size;
+    const char* p = data + start + 1;
+    const char* q = find_string_special(p, end);
+    if (q < end && *q == '"') {
+        // No escapes: the token borrows its bytes from the mapping
+        lval->span = (Span){ p, q - p, 0 };
+        lexer->pos = q + 1 - data;
+        return STRING;
+    }
+
+    size_t cap = (q - p) + 16;
+    size_t len = 0;
+    char* str = malloc(cap);
+    for (;;) {
+        if (q >= end) break;
+        size_t run = q - p;
+        if (len + run + 2 > cap) {
+            cap = (len + run + 2) * 2;
+            str = realloc(str, cap);
+        }
+        memcpy(str + len, p, run);
+        len += run;
+        if (*q == '"') {
+            str[len] = '\0';
+            lval->span = (Span){ str, len, 1 };
+            lexer->pos = q + 1 - data;
+            return STRING;
+        }
+        // Backslash: flex's \\. does not match a newline or end of input
+        if (q + 1 >= end || q[1] == '\n') break;
+        char c = q[1];
+        switch (c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+        }
+        str[len++] = c;
+        p = q + 2;
+        q = find_string_special(p, end);
+    }
+    // Unterminated: flex falls back to the catch-all rule on the quote
+    free(str);
+    return invalid_character(lexer, start);
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Matches -?[0-9]+(\.[0-9]+)?([eE][-+]?[0-9]+)? with flex's longest-match rule
+static int lex_number(YYSTYPE* lval, SimdLexer* lexer, size_t start) {
+    const char* data = lexer->data;
+    size_t size = lexer->size;
+    size_t i = start;
+    if (data[i] == '-') i++;
+    if (i >= size || !is_digit(data[i])) return invalid_character(lexer, start);
+    while (i < size && is_digit(data[i])) i++;
+    if (i + 1 < size && data[i] == '.' && is_digit(data[i + 1])) {
+        i += 2;
+        while (i < size && is_digit(data[i])) i++;
+    }
+    if (i < size && (data[i] == 'e' || data[i] == 'E')) {
+        size_t j = i + 1;
+        if (j < size && (data[j] == '+' || data[j] == '-')) j++;
+        if (j < size && is_digit(data[j])) {
+            while (j < size && is_digit(data[j])) j++;
+            i = j;
+        }
+    }
+    lval->span = (Span){ data + start, i - start, 0 };
+    lexer->pos = i;
+    return NUMBER;
+}
+
+static int lex_keyword(SimdLexer* lexer, size_t start, const char* word, int len, int token) {
+    if (lexer->size - start < (size_t)len || memcmp(lexer->data + start, word, len) != 0) {
+        return invalid_character(lexer, start);
+    }
+    lexer->pos = start + len;
+    return token;
+}
+
+static int next_token(YYSTYPE* lval, SimdLexer* lexer) {
+    const char* data = lexer->data;
+    size_t start = skip_whitespace(data + lexer->pos, data + lexer->size) - data;
+    if (start >= lexer->size) {
+        lexer->pos = lexer->size;
+        return 0;
+    }
+    switch (data[start]) {
+        case '{': case '}': case '[': case ']': case ',': case ':':
+            lexer->pos = start + 1;
+            return data[start];
+        case '"':
+            return lex_string(lval, lexer, start);
+        case 't':
+            return lex_keyword(lexer, start, "true", 4, TRUE);
+        case 'f':
+            return lex_keyword(lexer, start, "false", 5, FALSE);
+        case 'n':
+            return lex_keyword(lexer, start, "null", 4, NULL_VAL);
+        case '-':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            return lex_number(lval, lexer, start);
+    }
+    return invalid_character(lexer, start);
+}
+
+// Returns the position after the string whose opening quote is at p, or
+// NULL if it is not closed
+static const char* skip_string(const char* p, const char* end) {
+    p = find_string_special(p + 1, end);
+    while (p < end && *p == '\\') {
+        if (p + 1 >= end) return NULL;
+        p = find_string_special(p + 2, end);
+    }
+    return p < end ? p + 1 : NULL;
+}
+
+// --include/--exclude: skips the next value, if it is of a kind the parser
+// asked for, as one SKIPPED token. Containers are skipped by matching
+// brackets, stepping over strings. Returns -1 if the next value is kept.
+static int skip_value(SimdLexer* lexer, int kinds) {
+    const char* data = lexer->data;
+    const char* end = data + lexer->size;
+    const char* p = skip_whitespace(data + lexer->pos, end);
+    if (p >= end) return -1;
+    int kind;
+    switch (*p) {
+        case '{': kind = SKIP_OBJECT; break;
+        case '[': kind = SKIP_ARRAY; break;
+        case '"': case '-': case 't': case 'f': case 'n':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            kind = SKIP_SCALAR;
+            break;
+        default:
+            return -1;
+    }
+    if (!(kinds & kind)) return -1;
+
+    if (*p == '"') {
+        p = skip_string(p, end);
+    } else if (kind == SKIP_SCALAR) {
+        while (p < end && !strchr(",:}] \t\r\n", *p)) p++;
+    } else {
+        int depth = 0;
+        do {
+            p = find_structural(p, end);
+            if (p >= end) {
+                p = NULL;
+            } else if (*p == '"') {
+                p = skip_string(p, end);
+            } else {
+                depth += *p == '{' || *p == '[' ? 1 : -1;
+                p++;
+            }
+        } while (p && depth > 0);
+    }
+    // Unclosed: the parser reports the end of input
+    if (!p) {
+        lexer->pos = lexer->size;
+        return 0;
+    }
+    lexer->pos = p - data;
+    return SKIPPED;
+}
+
+int simd_lex(YYSTYPE* lval, SimdLexer* lexer) {
+    // Returned once before any input, to select a start rule
+    if (lexer->state->start_token) {
+        int token = lexer->state->start_token;
+        lexer->state->start_token = 0;
+        return token;
+    }
+    int token = -1;
+    if (lexer->state->skip) {
+        token = skip_value(lexer, lexer->state->skip);
+        lexer->state->skip = 0;
+    }
+    if (token < 0) token = next_token(lval, lexer);
+    lexer->mark = lexer->pos; // flex reports errors from the end of the last token
+    lexer->state->offset = lexer->pos;
+    return token;
+}
@@ -0,0 +1,23 @@
+#ifndef SIMD_LEXER_H
+#define SIMD_LEXER_H
+
+#include "parser.tab.h"
+
+// Alternative to the flex scanner: reads an mmapped file and produces the same
+// tokens, finding whitespace and string bounds with vector compares. String
+// and number tokens borrow from the mapping, so close the lexer only once the
+// nodes built from them are freed. Errors are recorded in the parse
+// state's converter: open returns NULL, and an invalid character comes back
+// as the INVALID token.
+typedef struct SimdLexer SimdLexer;
+
+SimdLexer* simd_lexer_open(const char* filename, ParseState* state);
+SimdLexer* simd_lexer_slice(SimdLexer* whole, size_t start, size_t end, ParseState* state);
+SimdLexer* simd_lexer_buffer(const char* data, size_t size, ParseState* state);
+int simd_lexer_seek(SimdLexer* lexer, size_t pos);
+const char* simd_lexer_input(SimdLexer* lexer, size_t* size);
+int simd_lex(YYSTYPE* lval, SimdLexer* lexer);
+void simd_lexer_locate(SimdLexer* lexer);
+void simd_lexer_close(SimdLexer* lexer);
+
+#endif
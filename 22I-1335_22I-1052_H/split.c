@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ast.h"
+#include "converter.h"
+#include "parser.tab.h"
+#include "simd_lexer.h"
+#include "stream.h"
+#include "manifest.h"
+#include "split.h"
+#include "stats.h"
+
+// Chunks in flight: claimed by a worker, parsed, or waiting to be written
+#define SPLIT_WINDOW_PER_JOB 4
+
+typedef struct {
+    size_t start;
+    size_t end;         // the comma after the chunk, or where scanning stopped
+    int line;           // position of start, for flex's error messages
+    int column;
+    ElementList* elements;  // the parsed chunk's element trees; NULL if it failed
+    int ready;
+} Chunk;
+
+// Shared by the workers and the thread writing the rows. Workers find the
+// next chunk's end under the lock as they claim it, so the input is scanned
+// once, in order.
+typedef struct {
+    Converter* converter;
+    const char* filename;
+    SimdLexer* input;   // the mapped file; chunks are parsed straight from it
+    const char* data;
+    size_t size;
+    size_t pos;         // start of the next unclaimed chunk
+    int line;           // line of pos
+    size_t line_start;  // offset where that line starts
+    Chunk* chunks;      // ring of window slots; chunk n lives in slot n % window
+    int window;
+    int claimed;        // chunks handed to workers so far
+    int consumed;       // chunks written so far
+    int finished;       // the closing bracket was found, or the run failed;
+                        // no more chunks
+    int num_chunks;     // set once finished
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // a chunk was parsed
+    pthread_cond_t space;   // a slot was freed, or scanning finished
+} Splitter;
+
+static size_t skip_whitespace(const char* data, size_t size, size_t pos) {
+    while (pos < size && (data[pos] == ' ' || data[pos] == '\t' || data[pos] == '\r' || data[pos] == '\n')) pos++;
+    return pos;
+}
+
+// Counts lines up to pos, for a start that is not at the top of the file
+static void locate(Splitter* splitter, size_t pos) {
+    const char* nl;
+    while ((nl = memchr(splitter->data + splitter->line_start, '\n', pos - splitter->line_start))) {
+        splitter->line++;
+        splitter->line_start = nl + 1 - splitter->data;
+    }
+}
+
+// Returns where the chunk starting at pos ends: the first comma outside any
+// string, object or nested array at least SPLIT_CHUNK_SIZE bytes on, or the
+// bracket closing the root array (or the end of the input if it never
+// closes). Keeps the line count up to date as it goes.
+static size_t scan_chunk(Splitter* splitter, size_t pos) {
+    const char* data = splitter->data;
+    size_t size = splitter->size;
+    size_t target = pos + SPLIT_CHUNK_SIZE;
+    int depth = 0;
+    for (size_t i = pos; i < size; i++) {
+        char c = data[i];
+        if (c == '"') {
+            for (i++; i < size && data[i] != '"'; i++) {
+                if (data[i] == '\\') {
+                    i++;
+                } else if (data[i] == '\n') {
+                    splitter->line++;
+                    splitter->line_start = i + 1;
+                }
+            }
+        } else if (c == '\n') {
+            splitter->line++;
+            splitter->line_start = i + 1;
+        } else if (c == '[' || c == '{') {
+            depth++;
+        } else if (c == ']' || c == '}') {
+            if (depth == 0) return i;
+            depth--;
+        } else if (c == ',' && depth == 0 && i >= target) {
+            return i;
+        }
+    }
+    return size;
+}
+
+// Stops handing out chunks; those already claimed are still parsed.
+// Called with the lock held.
+static void stop_splitting(Splitter* splitter) {
+    if (splitter->finished) return;
+    splitter->finished = 1;
+    splitter->num_chunks = splitter->claimed;
+    pthread_cond_broadcast(&splitter->space);
+    pthread_cond_broadcast(&splitter->ready);
+}
+
+static void* split_worker(void* arg) {
+    Splitter* splitter = arg;
+    Converter* c = splitter->converter;
+    stats_thread_start(c);
+    pthread_mutex_lock(&splitter->lock);
+    for (;;) {
+        while (!splitter->finished && splitter->claimed >= splitter->consumed + splitter->window) {
+            pthread_cond_wait(&splitter->space, &splitter->lock);
+        }
+        if (!splitter->finished && converter_failed(c)) stop_splitting(splitter);
+        if (splitter->finished) break;
+
+        Chunk* chunk = &splitter->chunks[splitter->claimed % splitter->window];
+        chunk->start = splitter->pos;
+        chunk->line = splitter->line;
+        chunk->column = 1 + (int)(splitter->pos - splitter->line_start);
+        chunk->end = scan_chunk(splitter, splitter->pos);
+        chunk->ready = 0;
+        splitter->claimed++;
+        // The comma goes with the chunk; the last one runs to the end of the
+        // input, so the parser checks the closing bracket and what follows
+        size_t end;
+        if (chunk->end < splitter->size && splitter->data[chunk->end] == ',') {
+            end = chunk->end + 1;
+            splitter->pos = end;
+        } else {
+            end = splitter->size;
+            splitter->finished = 1;
+            splitter->num_chunks = splitter->claimed;
+            pthread_cond_broadcast(&splitter->space);
+        }
+        pthread_mutex_unlock(&splitter->lock);
+
+        int phase = stats_enter(PHASE_PARSE);
+        ElementList* elements = parse_chunk(c, splitter->filename, splitter->input, chunk->start, end, chunk->line, chunk->column, 1);
+        stats_leave(phase);
+
+        pthread_mutex_lock(&splitter->lock);
+        chunk->elements = elements;
+        chunk->ready = 1;
+        pthread_cond_broadcast(&splitter->ready);
+    }
+    pthread_mutex_unlock(&splitter->lock);
+    stats_thread_done(c);
+    return NULL;
+}
+
+// Stops the workers, waits for them and frees the chunks they parsed that
+// were never written
+static void join_workers(Splitter* splitter, pthread_t* workers, int num_workers) {
+    pthread_mutex_lock(&splitter->lock);
+    stop_splitting(splitter);
+    pthread_mutex_unlock(&splitter->lock);
+    for (int i = 0; i < num_workers; i++) pthread_join(workers[i], NULL);
+    for (int i = 0; i < splitter->window; i++) {
+        if (splitter->chunks[i].elements) free_element_list(splitter->chunks[i].elements);
+        splitter->chunks[i].elements = NULL;
+    }
+}
+
+// Finds the first chunk: just inside the root's bracket, or after the
+// element a resumed run stopped at. Returns 0 if the root is not an array.
+static int find_start(Splitter* splitter, size_t start) {
+    const char* data = splitter->data;
+    size_t size = splitter->size;
+    size_t pos = skip_whitespace(data, size, start);
+    if (start == 0) {
+        if (pos == size || data[pos] != '[') return 0;
+        pos = skip_whitespace(data, size, pos + 1);
+        if (pos < size && data[pos] == ']') splitter->finished = 1;    // []
+    } else if (pos < size && data[pos] == ',') {
+        pos++;
+    } else {
+        // Resumed after the last element: only the closing bracket is left
+        splitter->finished = 1;
+    }
+    splitter->pos = pos;
+    locate(splitter, pos);
+    return 1;
+}
+
+// Converts a document whose root is an array, from byte offset start, with
+// jobs parser threads; elements are numbered from first_index. A start past
+// 0 resumes after a checkpointed element. Returns 0, having written nothing,
+// if the root is not an array, and 1 once it is converted or the converter
+// has failed.
+int split_root_array(Converter* c, const char* filename, int jobs, size_t start, int first_index) {
+    ParseState state = { c, filename, 1, 1, 0, NULL, NULL, 0, 0, 0 };
+    Splitter splitter;
+    memset(&splitter, 0, sizeof(Splitter));
+    splitter.converter = c;
+    splitter.filename = filename;
+    splitter.input = simd_lexer_open(filename, &state);
+    if (!splitter.input) return 1;
+    splitter.data = simd_lexer_input(splitter.input, &splitter.size);
+    splitter.line = 1;
+    if (start > splitter.size) {
+        converter_fail(c, CONVERT_ERROR_INPUT, "%s is shorter than the resume offset", filename);
+        simd_lexer_close(splitter.input);
+        return 1;
+    }
+    if (!find_start(&splitter, start)) {
+        simd_lexer_close(splitter.input);
+        return 0;
+    }
+    stats_count_input(splitter.size - start);
+
+    splitter.window = jobs * SPLIT_WINDOW_PER_JOB;
+    splitter.chunks = calloc(splitter.window, sizeof(Chunk));
+    pthread_t* workers = malloc(jobs * sizeof(pthread_t));
+    if (!splitter.chunks || !workers) {
+        fprintf(stderr, "Error: Memory allocation failed for split chunks\n");
+        exit(1);
+    }
+    pthread_mutex_init(&splitter.lock, NULL);
+    pthread_cond_init(&splitter.ready, NULL);
+    pthread_cond_init(&splitter.space, NULL);
+    int started = 0;
+    while (started < jobs && pthread_create(&workers[started], NULL, split_worker, &splitter) == 0) started++;
+    if (started < jobs) converter_fail(c, CONVERT_ERROR_RESOURCE, "Cannot start parser thread");
+
+    // Elements go out in input order, with the index a sequential run gives
+    // them; checkpoints fall between chunks
+    SpineArray* spine = stream_root_array();
+    int index = first_index;
+    for (int n = 0; !converter_failed(c); n++) {
+        Chunk* chunk = &splitter.chunks[n % splitter.window];
+        pthread_mutex_lock(&splitter.lock);
+        int phase = stats_enter(PHASE_WAIT);
+        while (!(splitter.finished && n >= splitter.num_chunks) && !(n < splitter.claimed && chunk->ready)) {
+            pthread_cond_wait(&splitter.ready, &splitter.lock);
+        }
+        stats_leave(phase);
+        if (splitter.finished && n >= splitter.num_chunks) {
+            pthread_mutex_unlock(&splitter.lock);
+            break;
+        }
+        ElementList* elements = chunk->elements;
+        size_t end = chunk->end;
+        chunk->elements = NULL;
+        chunk->ready = 0;
+        pthread_mutex_unlock(&splitter.lock);
+        if (!elements) break;   // the chunk did not parse
+
+        for (int i = 0; i < elements->count; i++) {
+            StreamEvent event = { EVENT_ELEMENT, spine, elements->elements[i], index++, 0 };
+            stream_dispatch(c, &event);
+        }
+        elements->count = 0;     // the events own the elements now
+        free_element_list(elements);
+
+        pthread_mutex_lock(&splitter.lock);
+        splitter.consumed++;
+        pthread_cond_broadcast(&splitter.space);
+        pthread_mutex_unlock(&splitter.lock);
+
+        if (c->options.checkpoint_interval && checkpoint_due(c, end)) {
+            StreamEvent checkpoint = { EVENT_CHECKPOINT, NULL, NULL, index, end };
+            stream_dispatch(c, &checkpoint);
+        }
+    }
+    join_workers(&splitter, workers, started);
+    if (splitter.num_chunks == 0 && !converter_failed(c)) {
+        // No elements (left): the input must still close the array properly
+        ElementList* close = parse_chunk(c, filename, splitter.input, splitter.pos, splitter.size, splitter.line,
+                                     1 + (int)(splitter.pos - splitter.line_start), 0);
+        if (close) free_element_list(close);
+    }
+
+    StreamEvent array_end = { EVENT_ARRAY_END, spine, NULL, 0, 0 };
+    stream_dispatch(c, &array_end);
+    stream_finish(c, make_empty_array());
+    stream_end(c);
+
+    pthread_mutex_destroy(&splitter.lock);
+    pthread_cond_destroy(&splitter.ready);
+    pthread_cond_destroy(&splitter.space);
+    free(splitter.chunks);
+    free(workers);
+    simd_lexer_close(splitter.input);
+    return 1;
+}
@@ -0,0 +1,15 @@
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include <stddef.h>
+#include "json2relcsv.h"
+
+// --split: a document whose root is an array is cut at its top-level commas
+// into chunks of about SPLIT_CHUNK_SIZE bytes, which worker threads parse
+// at the same time, each with its own parser. Elements are then written in
+// input order on one thread, so ids and seq values match a sequential run.
+#define SPLIT_CHUNK_SIZE (1024 * 1024)
+
+int split_root_array(Converter* c, const char* filename, int jobs, size_t start, int first_index);
+
+#endif
@@ -0,0 +1,74 @@
+#include "spsc.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+void spsc_init(SpscQueue* q, unsigned capacity, size_t item_size) {
+    unsigned size = 1;
+    while (size < capacity) size *= 2;
+    q->slots = malloc((size_t)size * item_size);
+    if (!q->slots) {
+        fprintf(stderr, "Error: Memory allocation failed for queue\n");
+        exit(1);
+    }
+    q->item_size = item_size;
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+}
+
+// Waits a little longer each call: spin first, then yield the CPU, then sleep.
+// Spinning is skipped on a single CPU, where the other side cannot run until
+// this thread gives way.
+void spsc_backoff(int* spins) {
+    static int spin_limit = -1;     // both sides of a queue may set it first
+    int limit = __atomic_load_n(&spin_limit, __ATOMIC_RELAXED);
+    if (limit < 0) {
+        limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 64 : 0;
+        __atomic_store_n(&spin_limit, limit, __ATOMIC_RELAXED);
+    }
+    if (*spins < limit) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else if (*spins < 256) {
+        sched_yield();
+    } else {
+        struct timespec pause = { 0, 50000 };
+        nanosleep(&pause, NULL);
+    }
+    (*spins)++;
+}
+
+void spsc_push(SpscQueue* q, const void* item) {
+    unsigned tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask) {
+        int phase = stats_enter(PHASE_WAIT);
+        int spins = 0;
+        while (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask) spsc_backoff(&spins);
+        stats_leave(phase);
+    }
+    memcpy(q->slots + (size_t)(tail & q->mask) * q->item_size, item, q->item_size);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void spsc_pop(SpscQueue* q, void* item) {
+    unsigned head = q->head;
+    if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head) {
+        int phase = stats_enter(PHASE_WAIT);
+        int spins = 0;
+        while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head) spsc_backoff(&spins);
+        stats_leave(phase);
+    }
+    memcpy(item, q->slots + (size_t)(head & q->mask) * q->item_size, q->item_size);
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void spsc_free(SpscQueue* q) {
+    free(q->slots);
+    q->slots = NULL;
+}
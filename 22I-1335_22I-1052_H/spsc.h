@@ -0,0 +1,25 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Items are copied in and out by value. push waits while the queue is
+// full and pop waits while it is empty, which gives the pipeline stages their
+// backpressure. head and tail sit on separate cache lines so the two threads
+// do not false-share.
+typedef struct {
+    char* slots;
+    size_t item_size;
+    unsigned mask;      // capacity - 1; capacity is a power of two
+    unsigned head __attribute__((aligned(64)));    // next slot to pop
+    unsigned tail __attribute__((aligned(64)));    // next slot to push
+} SpscQueue;
+
+void spsc_init(SpscQueue* q, unsigned capacity, size_t item_size);
+void spsc_push(SpscQueue* q, const void* item);
+void spsc_pop(SpscQueue* q, void* item);
+void spsc_free(SpscQueue* q);
+void spsc_backoff(int* spins);
+
+#endif
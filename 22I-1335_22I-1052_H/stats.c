@@ -0,0 +1,153 @@
+#include "stats.h"
+#include "ast.h"
+#include "converter.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+__thread int stats_active = 0;
+__thread Stats thread_stats;
+
+static __thread int current_phase = PHASE_OTHER;
+static __thread unsigned long long phase_start = 0;
+
+static const char* phase_names[NUM_PHASES] = { "other", "lex", "parse", "csv", "flush", "wait" };
+static const char* node_names[7] = { "object", "array", "string", "number", "true", "false", "null" };
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Charges the time since the last switch to the current phase
+static void charge(unsigned long long now) {
+    if (phase_start) thread_stats.phase_ns[current_phase] += now - phase_start;
+    phase_start = now;
+}
+
+// Starts the wall clock and counting on the calling thread; called by
+// converter_run once the options are checked
+void stats_start(Converter* c) {
+    if (!c->options.stats) return;
+    c->stats.start = now_ns();
+    stats_thread_start(c);
+}
+
+// Starts counting on a thread the converter spawned, or the one running it
+void stats_thread_start(Converter* c) {
+    if (!c->options.stats) return;
+    memset(&thread_stats, 0, sizeof(Stats));
+    current_phase = PHASE_OTHER;
+    phase_start = now_ns();
+    stats_active = 1;
+}
+
+// Switches the calling thread into phase; returns the phase to restore
+int stats_enter(Phase phase) {
+    if (!stats_active) return PHASE_OTHER;
+    charge(now_ns());
+    int previous = current_phase;
+    current_phase = phase;
+    return previous;
+}
+
+void stats_leave(int previous) {
+    if (!stats_active) return;
+    charge(now_ns());
+    current_phase = previous;
+}
+
+// Adds the calling thread's counters to the converter's totals and stops
+// counting on it
+void stats_thread_done(Converter* c) {
+    if (!stats_active) return;
+    charge(now_ns());
+    Stats* totals = &c->stats.totals;
+    pthread_mutex_lock(&c->stats.lock);
+    for (int i = 0; i < NUM_PHASES; i++) totals->phase_ns[i] += thread_stats.phase_ns[i];
+    for (int i = 0; i < 7; i++) totals->nodes[i] += thread_stats.nodes[i];
+    totals->tokens += thread_stats.tokens;
+    totals->allocations += thread_stats.allocations;
+    totals->allocated_bytes += thread_stats.allocated_bytes;
+    totals->input_bytes += thread_stats.input_bytes;
+    totals->files += thread_stats.files;
+    pthread_mutex_unlock(&c->stats.lock);
+    memset(&thread_stats, 0, sizeof(Stats));
+    stats_active = 0;
+    phase_start = 0;
+}
+
+static void print_json_string(const char* s) {
+    fputc('"', stderr);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(stderr, "\\%c", c);
+        else if (c < 0x20) fprintf(stderr, "\\u%04x", c);
+        else fputc(c, stderr);
+    }
+    fputc('"', stderr);
+}
+
+static void report_text(Converter* c, Stats* totals, double wall, long peak_rss_kb) {
+    double mb = totals->input_bytes / 1e6;
+    fprintf(stderr, "json2relcsv stats\n");
+    fprintf(stderr, "  wall time      %.3f s\n", wall);
+    fprintf(stderr, "  input          %llu file(s), %.2f MB, %.1f MB/s\n", totals->files, mb, wall > 0 ? mb / wall : 0);
+    fprintf(stderr, "  phases (summed over threads)\n");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        fprintf(stderr, "    %-12s %.3f s\n", phase_names[i], totals->phase_ns[i] / 1e9);
+    }
+    fprintf(stderr, "  tokens         %llu\n", totals->tokens);
+    fprintf(stderr, "  nodes         ");
+    for (int i = 0; i < 7; i++) fprintf(stderr, " %s=%llu", node_names[i], totals->nodes[i]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  allocations    %llu (%llu bytes)\n", totals->allocations, totals->allocated_bytes);
+    fprintf(stderr, "  peak RSS       %ld KB\n", peak_rss_kb);
+    fprintf(stderr, "  tables\n");
+    const char* name;
+    int columns;
+    unsigned long long rows, bytes;
+    for (int i = 0; get_table_stats(c, i, &name, &columns, &rows, &bytes); i++) {
+        fprintf(stderr, "    %-24s %3d columns %10llu rows %12llu bytes\n", name, columns, rows, bytes);
+    }
+}
+
+static void report_json(Converter* c, Stats* totals, double wall, long peak_rss_kb) {
+    fprintf(stderr, "{\"wall_seconds\": %.6f, \"input_files\": %llu, \"input_bytes\": %llu", wall, totals->files, totals->input_bytes);
+    fprintf(stderr, ", \"phase_seconds\": {");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        fprintf(stderr, "%s\"%s\": %.6f", i ? ", " : "", phase_names[i], totals->phase_ns[i] / 1e9);
+    }
+    fprintf(stderr, "}, \"tokens\": %llu, \"nodes\": {", totals->tokens);
+    for (int i = 0; i < 7; i++) {
+        fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", node_names[i], totals->nodes[i]);
+    }
+    fprintf(stderr, "}, \"allocations\": %llu, \"allocated_bytes\": %llu, \"peak_rss_kb\": %ld, \"tables\": [",
+            totals->allocations, totals->allocated_bytes, peak_rss_kb);
+    const char* name;
+    int columns;
+    unsigned long long rows, bytes;
+    for (int i = 0; get_table_stats(c, i, &name, &columns, &rows, &bytes); i++) {
+        fprintf(stderr, "%s{\"name\": ", i ? ", " : "");
+        print_json_string(name);
+        fprintf(stderr, ", \"columns\": %d, \"rows\": %llu, \"bytes\": %llu}", columns, rows, bytes);
+    }
+    fprintf(stderr, "]}\n");
+}
+
+// Prints the totals to stderr; call before the tables are cleaned up
+void stats_report(Converter* c) {
+    if (!c->options.stats) return;
+    stats_thread_done(c);
+    double wall = c->stats.start ? (now_ns() - c->stats.start) / 1e9 : 0;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    if (c->options.stats == STATS_JSON) {
+        report_json(c, &c->stats.totals, wall, usage.ru_maxrss);
+    } else {
+        report_text(c, &c->stats.totals, wall, usage.ru_maxrss);
+    }
+}
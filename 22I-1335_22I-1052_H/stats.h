@@ -0,0 +1,78 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "json2relcsv.h"
+
+// Debug traces compile to nothing unless built with -DDEBUG_TRACE (make debug)
+#ifdef DEBUG_TRACE
+#define TRACE(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TRACE(...) ((void)0)
+#endif
+
+// Exclusive phases: time is charged to whichever phase the thread is in
+typedef enum {
+    PHASE_OTHER,
+    PHASE_LEX,      // inside the lexer
+    PHASE_PARSE,    // grammar actions and tree building
+    PHASE_CSV,      // walking the tree and formatting rows
+    PHASE_FLUSH,    // writing buffered output to files
+    PHASE_WAIT,     // waiting for other threads: workers, queues, writers
+    NUM_PHASES
+} Phase;
+
+// Per-thread counters, merged into the totals when the thread finishes
+typedef struct {
+    unsigned long long phase_ns[NUM_PHASES];
+    unsigned long long tokens;
+    unsigned long long nodes[7];    // indexed by NodeType
+    unsigned long long allocations;
+    unsigned long long allocated_bytes;
+    unsigned long long input_bytes;
+    unsigned long long files;
+} Stats;
+
+// A converter's totals, merged from every thread that worked on it
+typedef struct {
+    Stats totals;
+    pthread_mutex_t lock;
+    unsigned long long start;
+} RunStats;
+
+// Set on each thread working for a converter with --stats, by
+// stats_thread_start; the counters below do nothing while it is clear
+extern __thread int stats_active;
+extern __thread Stats thread_stats;
+
+void stats_start(Converter* c);
+void stats_thread_start(Converter* c);
+int stats_enter(Phase phase);
+void stats_leave(int previous);
+void stats_thread_done(Converter* c);
+void stats_report(Converter* c);
+
+static inline void stats_count_token() {
+    if (stats_active) thread_stats.tokens++;
+}
+
+// Nodes live in their tree's arena, whose growth is counted as allocations
+static inline void stats_count_node(int type) {
+    if (stats_active) thread_stats.nodes[type]++;
+}
+
+static inline void stats_count_alloc(size_t bytes) {
+    if (!stats_active) return;
+    thread_stats.allocations++;
+    thread_stats.allocated_bytes += bytes;
+}
+
+static inline void stats_count_input(size_t bytes) {
+    if (!stats_active) return;
+    thread_stats.files++;
+    thread_stats.input_bytes += bytes;
+}
+
+#endif
@@ -0,0 +1,274 @@
+#include "stream.h"
+#include "converter.h"
+#include "stats.h"
+#include "pipeline.h"
+#include "infer.h"
+#include "manifest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Streaming conversion: the parser reports every container it opens and closes,
+// and elements of "spine" arrays (the root array, or arrays held directly by the
+// root object) are written out and freed as soon as they are reduced. Only the
+// element currently being parsed and the root's non-array members stay in memory.
+
+// A spine array's table and key. The parser creates it when the array opens;
+// from then on it belongs to whichever thread runs the events, which frees it
+// at EVENT_ARRAY_END.
+struct SpineArray {
+    char* key;
+    char* parent_table;
+    int parent_id;
+    Table* table;       // created from the first element, like process_array
+};
+
+typedef struct Frame {
+    NodeType type;
+    char* key;          // pending member key for objects (interned)
+    SpineArray* spine;  // set when elements are emitted on close instead of kept
+    int count;
+} Frame;
+
+static Frame* push_frame(StreamState* s, NodeType type) {
+    if (s->num_frames == s->max_frames) {
+        s->max_frames = s->max_frames ? s->max_frames * 2 : 16;
+        s->frames = realloc(s->frames, s->max_frames * sizeof(Frame));
+        if (!s->frames) {
+            fprintf(stderr, "Error: Memory allocation failed for stream frames\n");
+            exit(1);
+        }
+    }
+    Frame* frame = &s->frames[s->num_frames++];
+    frame->type = type;
+    frame->key = NULL;
+    frame->spine = NULL;
+    frame->count = 0;
+    return frame;
+}
+
+static void free_spine(SpineArray* spine) {
+    free(spine);
+}
+
+static void pop_frame(StreamState* s) {
+    Frame* frame = &s->frames[--s->num_frames];
+    if (frame->spine) free_spine(frame->spine);
+}
+
+// key is interned (or a literal), so it is kept without copying
+static SpineArray* new_spine(char* key, char* parent_table, int parent_id) {
+    SpineArray* spine = malloc(sizeof(SpineArray));
+    if (!spine) {
+        fprintf(stderr, "Error: Memory allocation failed for stream key\n");
+        exit(1);
+    }
+    spine->key = key;
+    spine->parent_table = parent_table;
+    spine->parent_id = parent_id;
+    spine->table = NULL;
+    return spine;
+}
+
+void stream_open_object(Converter* c) {
+    if (!c->options.stream) return;
+    // The root object's row is written last, but its arrays refer to it from
+    // the start, so its id in main.csv is taken before any nested object can
+    if (c->stream.num_frames == 0) c->stream.root_id = reserve_row_id(c, "main.csv");
+    push_frame(&c->stream, OBJ);
+}
+
+// Returns 1 if the array is a spine, whose elements are taken as they are
+// reduced
+int stream_open_array(Converter* c) {
+    if (!c->options.stream) return 0;
+    StreamState* s = &c->stream;
+    Frame* frame = push_frame(s, ARR);
+    if (s->num_frames == 1) {
+        // Root array: same table as process_array(root, NULL, 0, "root")
+        frame->spine = stream_root_array();
+    } else if (s->num_frames == 2 && s->frames[0].type == OBJ && s->frames[0].key) {
+        // Member of the root object, whose row is always root_id of main.csv
+        frame->spine = new_spine(s->frames[0].key, "main.csv", s->root_id);
+    }
+    return frame->spine != NULL;
+}
+
+// The spine of a root array; --split dispatches its elements itself
+SpineArray* stream_root_array() {
+    return new_spine("root", NULL, 0);
+}
+
+void stream_set_key(Converter* c, char* key) {
+    if (!c->options.stream || c->stream.num_frames == 0) return;
+    c->stream.frames[c->stream.num_frames - 1].key = key;    // interned, like every object key
+}
+
+// Whether the innermost open container is a spine array
+int stream_spine_open(Converter* c) {
+    StreamState* s = &c->stream;
+    return c->options.stream && s->num_frames > 0 && s->frames[s->num_frames - 1].spine;
+}
+
+// Takes ownership of an element of the innermost spine array, a tree of its
+// own. offset is where the element ends in the input. Only elements of a
+// root array can be checkpointed: resuming inside the root object's arrays
+// would need the rest of the object.
+void stream_take_element(Converter* c, ASTNode* element, size_t offset) {
+    StreamState* s = &c->stream;
+    Frame* frame = &s->frames[s->num_frames - 1];
+    StreamEvent event = { EVENT_ELEMENT, frame->spine, element, frame->count++, 0 };
+    stream_dispatch(c, &event);
+    if (c->options.checkpoint_interval && s->num_frames == 1 && checkpoint_due(c, offset)) {
+        StreamEvent checkpoint = { EVENT_CHECKPOINT, NULL, NULL, frame->count, offset };
+        stream_dispatch(c, &checkpoint);
+    }
+}
+
+void stream_close_object(Converter* c) {
+    if (!c->options.stream) return;
+    pop_frame(&c->stream);
+}
+
+void stream_close_array(Converter* c) {
+    if (!c->options.stream) return;
+    Frame* frame = &c->stream.frames[c->stream.num_frames - 1];
+    if (frame->spine) {
+        StreamEvent event = { EVENT_ARRAY_END, frame->spine, NULL, 0, 0 };
+        frame->spine = NULL;
+        stream_dispatch(c, &event);
+    }
+    pop_frame(&c->stream);
+}
+
+// Takes ownership of root and frees it once its row is written
+void stream_finish(Converter* c, ASTNode* root) {
+    StreamEvent event = { EVENT_ROOT, NULL, root, 0, 0 };
+    stream_dispatch(c, &event);
+}
+
+// Frees the frames a failed parse left open, with their spines; call only
+// once the events using them have run (after stream_end)
+void stream_cleanup(Converter* c) {
+    StreamState* s = &c->stream;
+    while (s->num_frames > 0) pop_frame(s);
+    free(s->frames);
+    s->frames = NULL;
+    s->max_frames = 0;
+}
+
+static void finish_root(Converter* c, ASTNode* root) {
+    if (!root) {
+        fprintf(stderr, "Error: Null root node\n");
+        return;
+    }
+    if (root->type == OBJ) {
+        // Its arrays were written with root_id as their parent id
+        emit_object_row(c, root, NULL, 0, NULL, 0, c->stream.root_id);
+    } else if (root->type != ARR) {
+        fprintf(stderr, "Error: Invalid root node type\n");
+    }
+}
+
+// Writes the rows for one event. Once the converter has failed, events are
+// only freed.
+static void run_event(Converter* c, StreamEvent* event) {
+    SpineArray* spine = event->spine;
+    int phase = stats_enter(PHASE_CSV);
+    int failed = converter_failed(c);
+    switch (event->kind) {
+        case EVENT_ELEMENT:
+            if (failed) break;
+            if (!spine->table) {
+                spine->table = create_array_table(c, event->node, spine->parent_table, spine->key);
+            }
+            emit_array_element(c, spine->table, event->node, spine->parent_id, spine->key, event->index);
+            break;
+        case EVENT_ARRAY_END:
+            if (!spine->table && !failed) {
+                // Empty arrays still get a table with just a header
+                spine->table = create_array_table(c, NULL, spine->parent_table, spine->key);
+            }
+            free_spine(spine);
+            break;
+        case EVENT_ROOT:
+            if (!failed) finish_root(c, event->node);
+            break;
+        case EVENT_RECORD:
+            convert_document(c, event->node);
+            break;
+        case EVENT_CHECKPOINT:
+            if (!failed) save_checkpoint(c, event->offset, event->index);
+            break;
+        case EVENT_END:
+            break;
+    }
+    stats_leave(phase);
+    if (event->node) free_ast(event->node);
+}
+
+// --infer with a single input: holds back the first rows events until the
+// sample is in; see StreamState
+void stream_hold_rows(Converter* c, int rows) {
+    c->stream.hold_limit = rows;
+}
+
+static void infer_event(Converter* c, StreamEvent* event) {
+    if (event->kind == EVENT_ELEMENT) infer_array_element(c, event->spine->key, event->node);
+    else if (event->kind == EVENT_RECORD || event->kind == EVENT_ROOT) infer_document(c, event->node);
+}
+
+static void hold_event(StreamState* s, StreamEvent* event) {
+    if (s->num_held == s->max_held) {
+        s->max_held = s->max_held ? s->max_held * 2 : 256;
+        s->held = realloc(s->held, s->max_held * sizeof(StreamEvent));
+        if (!s->held) {
+            fprintf(stderr, "Error: Memory allocation failed for held rows\n");
+            exit(1);
+        }
+    }
+    s->held[s->num_held++] = *event;
+}
+
+// Runs an event. Events must run in the order they were dispatched, all on
+// one thread, for the output to match a sequential run.
+void stream_run_event(Converter* c, StreamEvent* event) {
+    StreamState* s = &c->stream;
+    if (s->hold_limit > 0) {
+        if (event->kind != EVENT_END) {
+            infer_event(c, event);
+            hold_event(s, event);
+            int is_row = event->kind == EVENT_ELEMENT || event->kind == EVENT_RECORD;
+            if (!is_row || --s->hold_limit > 0) return;
+        }
+        s->hold_limit = -1;
+        for (int i = 0; i < s->num_held; i++) run_event(c, &s->held[i]);
+        free(s->held);
+        s->held = NULL;
+        s->num_held = s->max_held = 0;
+        return;
+    }
+    // Outside the window only the root still gets a look, as it is written last
+    if (c->options.infer && (s->hold_limit == 0 || event->kind == EVENT_ROOT)) infer_event(c, event);
+    run_event(c, event);
+}
+
+// Sends the final EVENT_END, which releases any held rows, and waits for the
+// pipeline to drain
+void stream_end(Converter* c) {
+    if (c->pipeline.running) {
+        pipeline_finish(c);
+    } else {
+        StreamEvent end = { EVENT_END, NULL, NULL, 0, 0 };
+        stream_run_event(c, &end);
+    }
+}
+
+// Runs the event now, or queues it for the generator thread under --pipeline
+void stream_dispatch(Converter* c, StreamEvent* event) {
+    if (c->pipeline.running) {
+        pipeline_push(c, event);
+    } else {
+        stream_run_event(c, event);
+    }
+}
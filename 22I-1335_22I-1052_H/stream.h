@@ -0,0 +1,62 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "ast.h"
+
+// Rows the parser hands off for writing. With --pipeline they cross to the
+// generator thread in order; otherwise they run right away on the parser's
+// thread. Nodes are the roots of trees owned by the event and freed once it
+// has run.
+typedef enum {
+    EVENT_ELEMENT,      // one element of a spine array
+    EVENT_ARRAY_END,    // a spine array closed; frees its SpineArray
+    EVENT_ROOT,         // the root node, after the whole document
+    EVENT_RECORD,       // one NDJSON record
+    EVENT_CHECKPOINT,   // rows so far are complete; records the resume point
+    EVENT_END           // stops the generator thread
+} EventKind;
+
+typedef struct SpineArray SpineArray;
+
+typedef struct {
+    EventKind kind;
+    SpineArray* spine;
+    ASTNode* node;
+    int index;
+    size_t offset;      // checkpoints: input bytes consumed
+} StreamEvent;
+
+// A converter's streaming state: the containers the parser has open, and
+// with --infer the events held back for the sample
+typedef struct {
+    struct Frame* frames;
+    int num_frames;
+    int max_frames;
+    // Row id of the root object in main.csv, taken when the object opens
+    int root_id;
+    // --infer with a single input: the first events are held back, and
+    // their nodes inferred, until hold_limit rows are waiting. 0 when not
+    // holding (batch input infers each record on its own), -1 once the
+    // window is over.
+    int hold_limit;
+    StreamEvent* held;
+    int num_held;
+    int max_held;
+} StreamState;
+
+void stream_open_object(Converter* c);
+int stream_open_array(Converter* c);
+void stream_set_key(Converter* c, char* key);
+int stream_spine_open(Converter* c);
+void stream_take_element(Converter* c, ASTNode* element, size_t offset);
+SpineArray* stream_root_array();
+void stream_close_object(Converter* c);
+void stream_close_array(Converter* c);
+void stream_finish(Converter* c, ASTNode* root);
+void stream_cleanup(Converter* c);
+void stream_dispatch(Converter* c, StreamEvent* event);
+void stream_run_event(Converter* c, StreamEvent* event);
+void stream_hold_rows(Converter* c, int rows);
+void stream_end(Converter* c);
+
+#endif